@@ -19,6 +19,7 @@ Module Name:
 
 NTSTATUS
 BcdOpenStoreFromFile (
+    IN  PMEMORY_ARENA   Arena,
     IN  PUNICODE_STRING Path,
     OUT PHANDLE         DataStoreHandle
     )
@@ -31,6 +32,10 @@ Routine Description:
 
 Arguments:
 
+    Arena - Pointer to the arena to allocate temporary buffers from.
+
+    Path - Pointer to the device identifier and file path of the BCD.
+
     DataStoreHandle - Pointer to a HANDLE that receives the data store handle.
 
 Return Value:
@@ -44,14 +49,16 @@ Return Value:
 {
     PFILE_IDENTIFIER FileIdentifier;
     ULONG TotalSize;
+    MEMORY_ARENA_CHECKPOINT Checkpoint;
 
     (VOID) DataStoreHandle;
 
     //
     // Allocate buffer for file identifier.
     //
+    BlMmArenaGetCheckpoint(Arena, &Checkpoint);
     TotalSize = sizeof(*FileIdentifier) + Path->Length;
-    FileIdentifier = BlMmAllocateHeap(TotalSize);
+    FileIdentifier = BlMmArenaAllocate(Arena, TotalSize);
     if (FileIdentifier == NULL) {
         return STATUS_NO_MEMORY;
     }
@@ -70,12 +77,13 @@ Return Value:
     //
     *DataStoreHandle = (PVOID)0xca7f00d;
 
-    BlMmFreeHeap(FileIdentifier);
+    BlMmArenaRollback(Arena, &Checkpoint);
     return STATUS_SUCCESS;
 }
 
 NTSTATUS
 BmGetDataStorePath (
+    IN  PMEMORY_ARENA      Arena,
     OUT PDEVICE_IDENTIFIER *DeviceIdentifierOut,
     OUT PWSTR              *FilePathOut,
     OUT PBOOLEAN           FilePathFoundOut
@@ -87,11 +95,12 @@ Routine Description:
 
     Finds the containing device and file path of the BCD.
 
-    If the device is found but the file path is not, BmGetDataStorePath will set
-    DeviceIdentifier, but return an error code and set FilePathFound to FALSE.
+    The results are allocated from Arena and are released along with it.
 
 Arguments:
 
+    Arena - Pointer to the arena to allocate the results from.
+
     DeviceIdentifier - Receives a pointer to the device identifier.
 
     FilePath - Receives a pointer to the file path.
@@ -112,8 +121,9 @@ Return Value:
 
 {
     NTSTATUS Status;
-    PDEVICE_IDENTIFIER DeviceIdentifier, BootDeviceIdentifier;
-    PWSTR FilePath;
+    PDEVICE_IDENTIFIER DeviceIdentifier, SourceDeviceIdentifier, OptionDeviceIdentifier;
+    PWSTR FilePath, OptionFilePath;
+    size_t FilePathSize;
     BOOLEAN FilePathFound;
 
     //
@@ -124,21 +134,43 @@ Return Value:
     //
     // Use the specified device or the boot device.
     //
-    Status = BlGetBootOptionDevice(BlpApplicationEntry.Options, BCDE_BOOTMGR_TYPE_BCD_DEVICE, &DeviceIdentifier, NULL);
-    if (!NT_SUCCESS(Status)) {
-        BootDeviceIdentifier = BlpBootDevice;
-        DeviceIdentifier = BlMmAllocateHeap(BootDeviceIdentifier->Size);
-        if (DeviceIdentifier == NULL) {
-            return STATUS_NO_MEMORY;
-        }
-        RtlMoveMemory(DeviceIdentifier, BootDeviceIdentifier, BootDeviceIdentifier->Size);
+    Status = BlGetBootOptionDevice(BlpApplicationEntry.Options, BCDE_BOOTMGR_TYPE_BCD_DEVICE, &OptionDeviceIdentifier, NULL);
+    if (NT_SUCCESS(Status)) {
+        SourceDeviceIdentifier = OptionDeviceIdentifier;
+    } else {
+        OptionDeviceIdentifier = NULL;
+        SourceDeviceIdentifier = BlpBootDevice;
+    }
+
+    DeviceIdentifier = BlMmArenaAllocate(Arena, SourceDeviceIdentifier->Size);
+    if (DeviceIdentifier != NULL) {
+        RtlMoveMemory(DeviceIdentifier, SourceDeviceIdentifier, SourceDeviceIdentifier->Size);
+    }
+
+    if (OptionDeviceIdentifier != NULL) {
+        BlMmFreeHeap(OptionDeviceIdentifier);
+    }
+
+    if (DeviceIdentifier == NULL) {
+        return STATUS_NO_MEMORY;
     }
 
     //
     // Use the specified path if possible.
     //
-    Status = BlGetBootOptionString(BlpApplicationEntry.Options, BCDE_BOOTMGR_TYPE_BCD_FILE_PATH, &FilePath);
+    Status = BlGetBootOptionString(BlpApplicationEntry.Options, BCDE_BOOTMGR_TYPE_BCD_FILE_PATH, &OptionFilePath);
     if (NT_SUCCESS(Status)) {
+        FilePathSize = (wcslen(OptionFilePath) + 1) * sizeof(WCHAR);
+        FilePath = BlMmArenaAllocate(Arena, FilePathSize);
+        if (FilePath != NULL) {
+            RtlMoveMemory(FilePath, OptionFilePath, FilePathSize);
+        }
+
+        BlMmFreeHeap(OptionFilePath);
+        if (FilePath == NULL) {
+            return STATUS_NO_MEMORY;
+        }
+
         FilePathFound = TRUE;
         goto Success;
     }
@@ -151,19 +183,17 @@ Return Value:
         // TODO: Implement network device support.
         //
 
-        BlMmFreeHeap(DeviceIdentifier);
         return STATUS_NOT_IMPLEMENTED;
     } else {
         //
         // Get the full default path of the BCD.
         //
-        Status = BmpFwGetFullPath(L"\\BCD", &FilePath);
+        Status = BmpFwGetFullPath(Arena, L"\\BCD", &FilePath);
         if (NT_SUCCESS(Status)) {
             FilePathFound = TRUE;
             goto Success;
         }
 
-        BlMmFreeHeap(DeviceIdentifier);
         return Status;
     }
 
@@ -246,19 +276,29 @@ Return Value:
     size_t FilePathSize;
     PVOID Buffer;
     UNICODE_STRING Path;
+    PMEMORY_ARENA Arena;
 
 #if !defined(NDEBUG)
 
     DebugInfo(L"Opening BCD...\r\n");
 #endif
 
+    //
+    // All buffers used to open the BCD are only needed until it is open,
+    // so allocate them from an arena and release them together.
+    //
+    Status = BlMmArenaCreate(PAGE_SIZE, &Arena);
+    if (!NT_SUCCESS(Status)) {
+        return Status;
+    }
+
     //
     // Get the BCD path.
     //
     DeviceIdentifier = NULL;
     FilePath = NULL;
     FilePathFound = FALSE;
-    Status = BmGetDataStorePath(&DeviceIdentifier, &FilePath, &FilePathFound);
+    Status = BmGetDataStorePath(Arena, &DeviceIdentifier, &FilePath, &FilePathFound);
     if (!NT_SUCCESS(Status)) {
         goto Exit;
     }
@@ -296,7 +336,7 @@ Return Value:
     //
     // Copy the device identifier and file path.
     //
-    Buffer = BlMmAllocateHeap(TotalSize);
+    Buffer = BlMmArenaAllocate(Arena, TotalSize);
     if (Buffer == NULL) {
         Status = STATUS_NO_MEMORY;
         goto Exit;
@@ -310,21 +350,12 @@ Return Value:
     Path.Length = TotalSize;
     Path.MaximumLength = TotalSize;
     Path.Buffer = Buffer;
-    Status = BcdOpenStoreFromFile(&Path, DataStoreHandle);
-    BlMmFreeHeap(Buffer);
+    Status = BcdOpenStoreFromFile(Arena, &Path, DataStoreHandle);
 
 Exit:
     //
     // Free allocated memory.
     //
-
-    if (FilePath != NULL && FilePathFound) {
-        BlMmFreeHeap(FilePath);
-    }
-
-    if (DeviceIdentifier != NULL) {
-        BlMmFreeHeap(DeviceIdentifier);
-    }
-
+    BlMmArenaDestroy(Arena);
     return Status;
 }
@@ -56,8 +56,9 @@ Return Value:
 
 NTSTATUS
 BmpFwGetFullPath (
-    IN  PWSTR PartialPath,
-    OUT PWSTR *FullPathOut
+    IN  PMEMORY_ARENA Arena,
+    IN  PWSTR         PartialPath,
+    OUT PWSTR         *FullPathOut
     )
 
 /*++
@@ -68,6 +69,8 @@ Routine Description:
 
 Arguments:
 
+    Arena - Pointer to the arena to allocate the full path from.
+
     PartialPath - Pointer to the partial path.
 
     FullPath - Pointer to a PWSTR that receives the address of the full path.
@@ -115,7 +118,7 @@ Return Value:
     //
     // Concatenate the paths.
     //
-    FullPath = BlMmAllocateHeap(TotalSize);
+    FullPath = BlMmArenaAllocate(Arena, TotalSize);
     *FullPathOut = FullPath;
     if (FullPath == NULL) {
         return STATUS_NO_MEMORY;
@@ -107,6 +107,9 @@ typedef ULONG MEMORY_TYPE;
 //
 #define MEMORY_TYPE_BOOT_APPLICATION      0xd0000002
 #define MEMORY_TYPE_HEAP                  0xd0000005
+#define MEMORY_TYPE_DESCRIPTOR_POOL       0xd0000006
+#define MEMORY_TYPE_PAGE_BITMAP           0xd0000007
+#define MEMORY_TYPE_PAGE_TABLE            0xd0000008
 #define MEMORY_TYPE_UNKNOWN_D0000013      0xd0000013
 #define MEMORY_TYPE_FREE                  0xf0000001
 #define MEMORY_TYPE_UNUSABLE              0xf0000002
@@ -138,10 +141,17 @@ typedef ULONG MEMORY_TYPE;
 #define MEMORY_ATTRIBUTE_RP  0x00000200
 #define MEMORY_ATTRIBUTE_XP  0x00000400
 
+//
+// Memory allocation attributes.
+//
+#define MEMORY_ATTRIBUTE_ALLOCATION_LARGE_PAGES  0x00010000
+#define MEMORY_ATTRIBUTE_ALLOCATION_FIXED        0x00040000
+#define MEMORY_ATTRIBUTE_ALLOCATION_KERNEL_RANGE 0x00200000
+
 //
 // Memory descriptor.
 //
-typedef struct {
+typedef struct _MEMORY_DESCRIPTOR {
     LIST_ENTRY  ListEntry;
 
     ULONG_PTR   FirstPage;
@@ -150,6 +160,14 @@ typedef struct {
 
     ULONG       Attributes;
     MEMORY_TYPE MemoryType;
+
+    //
+    // Search index links, private to the memory manager.
+    //
+    struct _MEMORY_DESCRIPTOR *IndexLeft;
+    struct _MEMORY_DESCRIPTOR *IndexRight;
+    ULONG_PTR                 IndexLargestPageCount;
+    ULONG                     IndexPriority;
 } MEMORY_DESCRIPTOR, *PMEMORY_DESCRIPTOR;
 
 //
@@ -161,16 +179,79 @@ typedef enum {
     MDL_TYPE_VIRTUAL
 } MEMORY_DESCRIPTOR_LIST_TYPE;
 
+//
+// Descriptors are kept in order of first page, both on the list and in
+// a search tree rooted at IndexRoot.
+//
 typedef struct {
     LIST_ENTRY                  ListEntry;
 
     PLIST_ENTRY                 Head;
     PLIST_ENTRY                 Current;
     MEMORY_DESCRIPTOR_LIST_TYPE Type;
+
+    PMEMORY_DESCRIPTOR          IndexRoot;
+    ULONG                       DescriptorCount;
 } MEMORY_DESCRIPTOR_LIST, *PMEMORY_DESCRIPTOR_LIST;
 
 //
-// Memory address range.
+// Slab allocator statistics for one size class.
+//
+typedef struct {
+    ULONG     ObjectSize;
+    ULONG     ObjectsPerSlab;
+    ULONG     SlabCount;
+    ULONG     FallbackCount;
+    ULONG_PTR ActiveObjects;
+    ULONG_PTR PeakActiveObjects;
+    ULONGLONG AllocationCount;
+    ULONGLONG FreeCount;
+} MEMORY_SLAB_CLASS_STATISTICS, *PMEMORY_SLAB_CLASS_STATISTICS;
+
+//
+// Heap allocator statistics.
+//
+// FreeListLengths[0] counts free buffers smaller than 256 bytes, and
+// FreeListLengths[n] counts free buffers of 2^(n+7) to 2^(n+8)-1 bytes.
+// The last entry also counts all larger buffers.
+//
+#define MEMORY_HEAP_FREE_LIST_COUNT 23
+
+typedef struct {
+    ULONG_PTR BytesInUse;
+    ULONG_PTR PeakBytesInUse;
+    ULONGLONG AllocationCount;
+    ULONGLONG FreeCount;
+    ULONG_PTR HeapSize;
+    ULONG_PTR FreeBytes;
+    ULONG_PTR LargestFreeBlock;
+    ULONG     RegionCount;
+    ULONG     FragmentationPercent;
+    ULONG     FreeListLengths[MEMORY_HEAP_FREE_LIST_COUNT];
+} MEMORY_HEAP_STATISTICS, *PMEMORY_HEAP_STATISTICS;
+
+//
+// Arena for short-lived allocations.
+//
+typedef struct {
+    LIST_ENTRY ChunkList;
+    PVOID      CurrentChunk;
+    ULONG_PTR  Current;
+    ULONG_PTR  Limit;
+    ULONG_PTR  Base;
+    ULONG_PTR  ChunkSize;
+} MEMORY_ARENA, *PMEMORY_ARENA;
+
+//
+// Arena allocation state, used to release nested groups of allocations.
+//
+typedef struct {
+    PVOID     Chunk;
+    ULONG_PTR Current;
+} MEMORY_ARENA_CHECKPOINT, *PMEMORY_ARENA_CHECKPOINT;
+
+//
+// Memory address range. Both bounds are inclusive.
 //
 
 typedef struct {
@@ -487,6 +568,7 @@ typedef struct {
     EFI_SYSTEM_TABLE         *SystemTable;
 #if defined(__x86_64__) || defined(__i386__)
     ULONG_PTR                Cr3;
+    ULONG                    Pcid;
     DESCRIPTOR_TABLE_CONTEXT DescriptorTableContext;
 #endif
 #endif
@@ -714,6 +796,7 @@ typedef struct {
     ULONG                    Attributes;
 #if defined(__x86_64__) || defined(__i386__)
     ULONG_PTR                Cr3;
+    ULONG                    Pcid;
     DESCRIPTOR_TABLE_CONTEXT DescriptorTableContext;
 #endif
 } EXECUTION_CONTEXT, *PEXECUTION_CONTEXT;
@@ -864,6 +947,14 @@ BlGetBootOptionInteger (
     OUT INT64*             Value
     );
 
+NTSTATUS
+BlGetBootOptionIntegerList (
+    IN  PBOOT_ENTRY_OPTION Options,
+    IN  BCDE_DATA_TYPE     Type,
+    OUT PULONGLONG         *Values,
+    OUT ULONG_PTR          *Count
+    );
+
 NTSTATUS
 BlGetBootOptionBoolean (
     IN  PBOOT_ENTRY_OPTION Options,
@@ -937,6 +1028,11 @@ VOID BlMmRemoveBadMemory (
     VOID
     );
 
+NTSTATUS
+BlMmCompactMemoryMap (
+    VOID
+    );
+
     
 NTSTATUS
 BlpMmInitialize (
@@ -952,7 +1048,15 @@ BlMmAllocatePagesInRange (
     IN     ULONG          MemoryType,
     IN     ULONG          AllocationAttributes,
     IN     PADDRESS_RANGE Range OPTIONAL,
-    IN     ULONG          Unknown
+    IN     ULONG          Alignment
+    );
+
+NTSTATUS
+BlMmMapPhysicalAddress (
+    IN OUT PVOID     *VirtualAddress,
+    IN     ULONGLONG PhysicalAddress,
+    IN     ULONGLONG Size,
+    IN     ULONG     Attributes
     );
 
 PVOID
@@ -960,11 +1064,68 @@ BlMmAllocateHeap (
     IN ULONG_PTR Size
     );
 
+PVOID
+BlMmAllocateHeapAligned (
+    IN ULONG_PTR Size,
+    IN ULONG_PTR Alignment
+    );
+
 NTSTATUS
 BlMmFreeHeap (
     IN PVOID Pointer
     );
 
+PVOID
+BlMmReallocateHeap (
+    IN PVOID     Pointer,
+    IN ULONG_PTR Size
+    );
+
+NTSTATUS
+BlMmQueryHeapStatistics (
+    OUT PMEMORY_HEAP_STATISTICS Statistics
+    );
+
+NTSTATUS
+BlMmQuerySlabStatistics (
+    OUT    PMEMORY_SLAB_CLASS_STATISTICS Statistics,
+    IN OUT PULONG                        ClassCount
+    );
+
+NTSTATUS
+BlMmArenaCreate (
+    IN  ULONG_PTR     Size,
+    OUT PMEMORY_ARENA *Arena
+    );
+
+PVOID
+BlMmArenaAllocate (
+    IN PMEMORY_ARENA Arena,
+    IN ULONG_PTR     Size
+    );
+
+VOID
+BlMmArenaGetCheckpoint (
+    IN  PMEMORY_ARENA            Arena,
+    OUT PMEMORY_ARENA_CHECKPOINT Checkpoint
+    );
+
+VOID
+BlMmArenaRollback (
+    IN PMEMORY_ARENA            Arena,
+    IN PMEMORY_ARENA_CHECKPOINT Checkpoint
+    );
+
+VOID
+BlMmArenaReset (
+    IN PMEMORY_ARENA Arena
+    );
+
+VOID
+BlMmArenaDestroy (
+    IN PMEMORY_ARENA Arena
+    );
+
 NTSTATUS
 BlpMmDestroy (
     IN ULONG Phase
@@ -32,8 +32,9 @@ BmFwInitializeBootDirectoryPath (
 
 NTSTATUS
 BmpFwGetFullPath (
-    IN  PWSTR PartialPath,
-    OUT PWSTR *FullPath
+    IN  PMEMORY_ARENA Arena,
+    IN  PWSTR         PartialPath,
+    OUT PWSTR         *FullPath
     );
 
 //
@@ -42,6 +43,7 @@ BmpFwGetFullPath (
 
 NTSTATUS
 BmGetDataStorePath (
+    IN  PMEMORY_ARENA      Arena,
     OUT PDEVICE_IDENTIFIER *DeviceIdentifier,
     OUT PWSTR              *FilePath,
     OUT PBOOLEAN           FilePathFound
@@ -25,6 +25,44 @@ Module Name:
 
 #define MAX_STATIC_DESCRIPTOR_COUNT 1024
 
+//
+// Dynamic descriptors are allocated in slabs of MM_DESCRIPTOR_SLAB_PAGES
+// pages. The pool is grown whenever fewer than MM_DESCRIPTOR_POOL_RESERVE
+// dynamic descriptors are left at the end of a memory manager call.
+//
+#define MM_DESCRIPTOR_SLAB_PAGES    16
+#define MM_DESCRIPTOR_POOL_RESERVE  64
+
+//
+// Memory descriptor list operation flags.
+//
+#define MM_MD_FLAG_COALESCE 0x1
+
+//
+// Firmware free regions of at least MM_PAGE_BITMAP_MINIMUM_PAGES pages get
+// a free page bitmap. Requests for at least MM_PAGE_BITMAP_MINIMUM_RUN pages,
+// or with an alignment, are served from the bitmaps first.
+//
+#define MM_PAGE_BITMAP_MINIMUM_PAGES 4096
+#define MM_PAGE_BITMAP_MINIMUM_RUN   64
+
+//
+// Size of the smallest large page. Allocations with
+// MEMORY_ATTRIBUTE_ALLOCATION_LARGE_PAGES are aligned to it.
+//
+#define MM_LARGE_PAGE_SIZE 0x200000
+
+#define MM_SLAB_CLASS_COUNT 8
+#define MM_SLAB_MAX_SIZE    256
+
+//
+// Heap entry link flags, stored in the low bits of BufferNext.
+//
+// MM_HEAP_LINK_BUFFER_FREE is set on any buffer that is not allocated.
+// MM_HEAP_LINK_BUFFER_ON_HEAP is additionally set on the free buffer at
+// the top of a heap region (HeapStart), which links to itself and is not
+// on the free list.
+//
 #define MM_HEAP_LINK_BUFFER_FREE    0x1
 #define MM_HEAP_LINK_BUFFER_ON_HEAP 0x2
 #define MM_HEAP_LINK_ENTRY_NOT_USED 0x4
@@ -53,6 +91,31 @@ typedef struct {
     ULONG_PTR  HeapStart;
 } MM_HEAP_BOUNDARY, *PMM_HEAP_BOUNDARY;
 
+//
+// Free page bitmap for one large region of firmware free memory. A clear
+// bit means the page is free, whether or not it has been claimed from
+// the firmware yet.
+//
+typedef struct {
+    ULONG_PTR  FirstPage;
+    RTL_BITMAP Bitmap;
+} MM_PAGE_BITMAP, *PMM_PAGE_BITMAP;
+
+//
+// A run of physical pages.
+//
+typedef struct {
+    ULONG_PTR FirstPage;
+    ULONG_PTR PageCount;
+} MM_PAGE_RANGE, *PMM_PAGE_RANGE;
+
+typedef struct {
+    LIST_ENTRY        ListEntry;
+    ULONG_PTR         PageCount;
+    ULONG             DescriptorCount;
+    MEMORY_DESCRIPTOR Descriptors[ANYSIZE_ARRAY];
+} MM_MEMORY_DESCRIPTOR_SLAB, *PMM_MEMORY_DESCRIPTOR_SLAB;
+
 extern ULONG MmDescriptorCallTreeCount;
 extern ULONG MmTranslationType;
 
@@ -60,27 +123,156 @@ extern MEMORY_DESCRIPTOR MmStaticMemoryDescriptors[MAX_STATIC_DESCRIPTOR_COUNT];
 extern PMEMORY_DESCRIPTOR MmGlobalMemoryDescriptors;
 extern ULONG MmGlobalMemoryDescriptorCount, MmGlobalMemoryDescriptorsUsed;
 extern LIST_ENTRY MmFreeGlobalMemoryDescriptorsList;
+extern ULONG MmFreeGlobalMemoryDescriptorCount;
+extern ULONG MmDynamicMemoryDescriptorCount, MmDynamicMemoryDescriptorsUsed;
+extern BOOLEAN MmDynamicMemoryDescriptorsEnabled;
+extern ULONGLONG MmMdIndexLookups, MmMdIndexSteps;
 
 //
 // Architecture services.
 //
 
+NTSTATUS
+MmArchInitialize (
+    VOID
+    );
+
+NTSTATUS
+MmArchMapPhysicalRange (
+    IN ULONG_PTR VirtualAddress,
+    IN ULONGLONG PhysicalAddress,
+    IN ULONGLONG Size,
+    IN ULONG     Attributes
+    );
+
+NTSTATUS
+MmArchMapKernelRange (
+    IN OUT ULONG_PTR *VirtualAddress,
+    IN     ULONGLONG PhysicalAddress,
+    IN     ULONGLONG Size,
+    IN     BOOLEAN   Fixed
+    );
+
 BOOLEAN
 MmArchTranslateVirtualAddress (
     IN  PVOID             VirtualAddress,
     OUT PPHYSICAL_ADDRESS PhysicalAddress
     );
 
+VOID
+MmArchDestroy (
+    VOID
+    );
+
+//
+// Firmware memory services.
+//
+
+NTSTATUS
+MmFwGetMemoryMap (
+    IN PMEMORY_DESCRIPTOR_LIST Mdl
+    );
+
+NTSTATUS
+MmFwGetPageLimit (
+    OUT ULONG_PTR *LimitPage
+    );
+
+NTSTATUS
+MmFwAllocatePages (
+    IN ULONG_PTR FirstPage,
+    IN ULONG_PTR PageCount
+    );
+
+NTSTATUS
+MmFwFreePages (
+    IN ULONG_PTR FirstPage,
+    IN ULONG_PTR PageCount
+    );
+
 //
 // Memory descriptor services.
 //
 
+VOID
+MmMdInitialize (
+    VOID
+    );
+
+VOID
+MmMdInitializeList (
+    IN PMEMORY_DESCRIPTOR_LIST     Mdl,
+    IN MEMORY_DESCRIPTOR_LIST_TYPE Type,
+    IN PLIST_ENTRY                 ListHead
+    );
+
+PMEMORY_DESCRIPTOR
+MmMdInitDescriptor (
+    IN ULONG_PTR   FirstPage,
+    IN ULONG_PTR   VirtualFirstPage,
+    IN ULONG_PTR   PageCount,
+    IN ULONG       Attributes,
+    IN MEMORY_TYPE MemoryType
+    );
+
+BOOLEAN
+MmMdCanInitDescriptors (
+    IN ULONG Count
+    );
+
+VOID
+MmMdAddDescriptorToList (
+    IN PMEMORY_DESCRIPTOR_LIST Mdl,
+    IN PMEMORY_DESCRIPTOR      Descriptor,
+    IN ULONG                   Flags
+    );
+
+PMEMORY_DESCRIPTOR
+MmMdCoalesceDescriptor (
+    IN PMEMORY_DESCRIPTOR_LIST Mdl,
+    IN PMEMORY_DESCRIPTOR      Descriptor
+    );
+
+ULONG
+MmMdCompactList (
+    IN PMEMORY_DESCRIPTOR_LIST Mdl
+    );
+
 VOID
 MmMdRemoveDescriptorFromList (
     IN PMEMORY_DESCRIPTOR_LIST Mdl,
     IN PMEMORY_DESCRIPTOR      Descriptor
     );
 
+VOID
+MmMdUpdateDescriptor (
+    IN PMEMORY_DESCRIPTOR_LIST Mdl,
+    IN PMEMORY_DESCRIPTOR      Descriptor
+    );
+
+PMEMORY_DESCRIPTOR
+MmMdFindDescriptor (
+    IN PMEMORY_DESCRIPTOR_LIST Mdl,
+    IN ULONG_PTR               Page
+    );
+
+PMEMORY_DESCRIPTOR
+MmMdFindFirstFit (
+    IN  PMEMORY_DESCRIPTOR_LIST Mdl,
+    IN  ULONG_PTR               PageCount,
+    IN  ULONG_PTR               MinimumPage,
+    IN  ULONG_PTR               LimitPage,
+    IN  ULONG_PTR               Alignment,
+    OUT ULONG_PTR               *FirstPage
+    );
+
+NTSTATUS
+MmMdRemoveRegionFromList (
+    IN PMEMORY_DESCRIPTOR_LIST Mdl,
+    IN ULONG_PTR               FirstPage,
+    IN ULONG_PTR               PageCount
+    );
+
 NTSTATUS
 MmMdFreeDescriptor (
     IN PMEMORY_DESCRIPTOR Descriptor
@@ -96,17 +288,44 @@ MmMdFreeGlobalDescriptors (
     VOID
     );
 
+NTSTATUS
+MmMdReserveDescriptors (
+    IN ULONG Count
+    );
+
+VOID
+MmMdDestroyDynamicDescriptors (
+    VOID
+    );
+
 //
 // Page allocation services.
 //
 
+NTSTATUS
+MmPaInitialize (
+    VOID
+    );
+
 NTSTATUS
 MmPapAllocatePagesInRange (
     IN OUT PVOID          *Address,
     IN     ULONG_PTR      PageCount,
     IN     ULONG          MemoryType,
     IN     ULONG          AllocationAttributes,
-    IN     PADDRESS_RANGE Range OPTIONAL
+    IN     PADDRESS_RANGE Range OPTIONAL,
+    IN     ULONG_PTR      Alignment
+    );
+
+NTSTATUS
+MmPapFreePages (
+    IN PVOID     Address,
+    IN ULONG_PTR PageCount
+    );
+
+VOID
+MmPaDestroy (
+    IN ULONG Phase
     );
 
 //
@@ -129,4 +348,38 @@ MmHaDestroy (
     VOID
     );
 
+//
+// Small allocation services.
+//
+
+VOID
+MmSaInitialize (
+    IN ULONG AllocationAttributes
+    );
+
+PVOID
+MmSaAllocate (
+    IN ULONG_PTR Size
+    );
+
+BOOLEAN
+MmSaIsSlabBuffer (
+    IN PVOID Buffer
+    );
+
+ULONG_PTR
+MmSaGetBufferSize (
+    IN PVOID Buffer
+    );
+
+NTSTATUS
+MmSaFree (
+    IN PVOID Buffer
+    );
+
+VOID
+MmSaDestroy (
+    VOID
+    );
+
 #endif /* !_MM_H */
@@ -218,6 +218,7 @@ Return Value:
     if (EnSubsystemInitialized) {
         BlpEnDestroy();
     }
+    BlpMmDestroy(0);
     BlpMmDestroy(1);
 Phase1Failed:
     ArchRestoreProcessorFeatures(TRUE);
@@ -277,6 +278,11 @@ Return Value:
         }
     }
 
+    Status = BlpMmDestroy(0);
+    if (!NT_SUCCESS(Status)) {
+        ReturnStatus = Status;
+    }
+
     Status = BlpMmDestroy(1);
     if (!NT_SUCCESS(Status)) {
         ReturnStatus = Status;
@@ -0,0 +1,334 @@
+/*++
+
+Copyright (c) 2025, Quinn Stephens, w1redch4d
+All rights reserved.
+Provided under the BSD 3-Clause license.
+
+Module Name:
+
+    efimm.c
+
+Abstract:
+
+    EFI memory services.
+
+--*/
+
+#include "efilib.h"
+#include "mm.h"
+
+ULONG
+MmFwpGetAttributes (
+    IN UINT64 EfiAttributes
+    )
+
+/*++
+
+Routine Description:
+
+    Converts EFI memory attributes to memory descriptor attributes.
+
+Arguments:
+
+    EfiAttributes - The EFI memory attributes.
+
+Return Value:
+
+    The memory descriptor attributes.
+
+--*/
+
+{
+    ULONG Attributes;
+
+    //
+    // The caching attributes share their bit positions.
+    //
+    Attributes = (ULONG)(EfiAttributes & (EFI_MEMORY_UC | EFI_MEMORY_WC | EFI_MEMORY_WT | EFI_MEMORY_WB | EFI_MEMORY_UCE));
+
+    if (EfiAttributes & EFI_MEMORY_WP) {
+        Attributes |= MEMORY_ATTRIBUTE_WP;
+    }
+
+    if (EfiAttributes & EFI_MEMORY_RP) {
+        Attributes |= MEMORY_ATTRIBUTE_RP;
+    }
+
+    if (EfiAttributes & EFI_MEMORY_XP) {
+        Attributes |= MEMORY_ATTRIBUTE_XP;
+    }
+
+    return Attributes;
+}
+
+NTSTATUS
+MmFwpGetMemoryMap (
+    OUT EFI_PHYSICAL_ADDRESS *MapBuffer,
+    OUT UINTN                *MapPages,
+    OUT UINTN                *MapSize,
+    OUT UINTN                *DescriptorSize
+    )
+
+/*++
+
+Routine Description:
+
+    Gets the firmware memory map.
+
+Arguments:
+
+    MapBuffer - Pointer to a variable that receives the address of the map.
+
+    MapPages - Pointer to a variable that receives the number of pages in
+        the map buffer. The caller must free them with EfiFreePages.
+
+    MapSize - Pointer to a variable that receives the size of the map.
+
+    DescriptorSize - Pointer to a variable that receives the size of each
+        descriptor in the map.
+
+Return Value:
+
+    STATUS_SUCCESS if successful.
+
+    Any other status value returned by EfiGetMemoryMap or EfiAllocatePages.
+
+--*/
+
+{
+    NTSTATUS Status;
+    UINTN MapKey;
+    UINT32 DescriptorVersion;
+
+    //
+    // Allocating the buffer can add descriptors to the map, so leave room for more.
+    //
+    *MapPages = 0;
+    *MapBuffer = 0;
+    while (TRUE) {
+        *MapSize = *MapPages << EFI_PAGE_SHIFT;
+        Status = EfiGetMemoryMap(MapSize, (EFI_MEMORY_DESCRIPTOR *)(ULONG_PTR)*MapBuffer, &MapKey, DescriptorSize, &DescriptorVersion);
+        if (Status != STATUS_BUFFER_TOO_SMALL) {
+            break;
+        }
+
+        if (*MapPages != 0) {
+            EfiFreePages(*MapBuffer, *MapPages);
+            *MapPages = 0;
+        }
+
+        Status = EfiAllocatePages(AllocateAnyPages, EfiLoaderData, EFI_SIZE_TO_PAGES(*MapSize) + 1, MapBuffer);
+        if (!NT_SUCCESS(Status)) {
+            DebugError(L"Memory map allocation failed (Status=0x%x)\r\n", Status);
+            return Status;
+        }
+
+        *MapPages = EFI_SIZE_TO_PAGES(*MapSize) + 1;
+    }
+
+    if (!NT_SUCCESS(Status)) {
+        DebugError(L"Failed to get memory map (Status=0x%x)\r\n", Status);
+        if (*MapPages != 0) {
+            EfiFreePages(*MapBuffer, *MapPages);
+            *MapPages = 0;
+        }
+    }
+
+    return Status;
+}
+
+NTSTATUS
+MmFwGetMemoryMap (
+    IN PMEMORY_DESCRIPTOR_LIST Mdl
+    )
+
+/*++
+
+Routine Description:
+
+    Adds the free memory in the firmware memory map to a MDL.
+
+    Only conventional memory is added, and page zero is left out.
+
+Arguments:
+
+    Mdl - Pointer to the MDL to add descriptors to.
+
+Return Value:
+
+    STATUS_SUCCESS if successful.
+
+    STATUS_NO_MEMORY if no descriptors are available.
+
+    Any other status value returned by MmFwpGetMemoryMap.
+
+--*/
+
+{
+    NTSTATUS Status;
+    UINTN MapSize, DescriptorSize, MapPages;
+    EFI_PHYSICAL_ADDRESS MapBuffer;
+    EFI_MEMORY_DESCRIPTOR *EfiDescriptor;
+    ULONG_PTR FirstPage, PageCount;
+    PMEMORY_DESCRIPTOR Descriptor;
+
+    Status = MmFwpGetMemoryMap(&MapBuffer, &MapPages, &MapSize, &DescriptorSize);
+    if (!NT_SUCCESS(Status)) {
+        return Status;
+    }
+
+    //
+    // Describe each free region.
+    //
+    for (UINTN Offset = 0; Offset < MapSize; Offset += DescriptorSize) {
+        EfiDescriptor = (EFI_MEMORY_DESCRIPTOR *)(ULONG_PTR)(MapBuffer + Offset);
+        if (EfiDescriptor->Type != EfiConventionalMemory) {
+            continue;
+        }
+
+        FirstPage = EfiDescriptor->PhysicalStart >> EFI_PAGE_SHIFT;
+        PageCount = EfiDescriptor->NumberOfPages;
+        if (FirstPage == 0) {
+            FirstPage++;
+            PageCount--;
+        }
+
+        if (PageCount == 0) {
+            continue;
+        }
+
+        Descriptor = MmMdInitDescriptor(FirstPage, 0, PageCount, MmFwpGetAttributes(EfiDescriptor->Attribute), MEMORY_TYPE_FREE);
+        if (Descriptor == NULL) {
+            Status = STATUS_NO_MEMORY;
+            goto Exit;
+        }
+
+        MmMdAddDescriptorToList(Mdl, Descriptor, MM_MD_FLAG_COALESCE);
+    }
+
+Exit:
+    if (MapPages != 0) {
+        EfiFreePages(MapBuffer, MapPages);
+    }
+
+    return Status;
+}
+
+NTSTATUS
+MmFwGetPageLimit (
+    OUT ULONG_PTR *LimitPage
+    )
+
+/*++
+
+Routine Description:
+
+    Finds the page after the highest page in the firmware memory map.
+
+    Every descriptor counts, whatever its type, since the firmware places
+    loaded images, pool allocations and runtime regions above the highest
+    free page.
+
+Arguments:
+
+    LimitPage - Pointer to a variable that receives the page after the
+        highest page in the memory map.
+
+Return Value:
+
+    STATUS_SUCCESS if successful.
+
+    Any other status value returned by MmFwpGetMemoryMap.
+
+--*/
+
+{
+    NTSTATUS Status;
+    UINTN MapSize, DescriptorSize, MapPages;
+    EFI_PHYSICAL_ADDRESS MapBuffer;
+    EFI_MEMORY_DESCRIPTOR *EfiDescriptor;
+    ULONG_PTR EndPage;
+
+    Status = MmFwpGetMemoryMap(&MapBuffer, &MapPages, &MapSize, &DescriptorSize);
+    if (!NT_SUCCESS(Status)) {
+        return Status;
+    }
+
+    *LimitPage = 0;
+    for (UINTN Offset = 0; Offset < MapSize; Offset += DescriptorSize) {
+        EfiDescriptor = (EFI_MEMORY_DESCRIPTOR *)(ULONG_PTR)(MapBuffer + Offset);
+        EndPage = (EfiDescriptor->PhysicalStart >> EFI_PAGE_SHIFT) + EfiDescriptor->NumberOfPages;
+        if (EndPage > *LimitPage) {
+            *LimitPage = EndPage;
+        }
+    }
+
+    if (MapPages != 0) {
+        EfiFreePages(MapBuffer, MapPages);
+    }
+
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS
+MmFwAllocatePages (
+    IN ULONG_PTR FirstPage,
+    IN ULONG_PTR PageCount
+    )
+
+/*++
+
+Routine Description:
+
+    Claims free pages at a fixed address from the firmware.
+
+Arguments:
+
+    FirstPage - The first page to claim.
+
+    PageCount - The number of pages to claim.
+
+Return Value:
+
+    STATUS_SUCCESS if successful.
+
+    Any other status value returned by EfiAllocatePages.
+
+--*/
+
+{
+    EFI_PHYSICAL_ADDRESS Address;
+
+    Address = (EFI_PHYSICAL_ADDRESS)FirstPage << EFI_PAGE_SHIFT;
+    return EfiAllocatePages(AllocateAddress, EfiLoaderData, PageCount, &Address);
+}
+
+NTSTATUS
+MmFwFreePages (
+    IN ULONG_PTR FirstPage,
+    IN ULONG_PTR PageCount
+    )
+
+/*++
+
+Routine Description:
+
+    Returns pages claimed by MmFwAllocatePages to the firmware.
+
+Arguments:
+
+    FirstPage - The first page to return.
+
+    PageCount - The number of pages to return.
+
+Return Value:
+
+    STATUS_SUCCESS if successful.
+
+    Any other status value returned by EfiFreePages.
+
+--*/
+
+{
+    return EfiFreePages((EFI_PHYSICAL_ADDRESS)FirstPage << EFI_PAGE_SHIFT, PageCount);
+}
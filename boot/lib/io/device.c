@@ -53,9 +53,9 @@ Return Value:
     //
 
     //
-    // Free device table.
+    // The device table is released with the heap by BlpMmDestroy.
     //
-    BlMmFreeHeap(DmDeviceTable);
+    DmDeviceTable = NULL;
 
     return STATUS_SUCCESS;
 }
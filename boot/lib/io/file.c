@@ -64,9 +64,8 @@ Return Value:
     //
 
     //
-    // Freefile table.
+    // The file table and registry entries are released with the heap by BlpMmDestroy.
     //
-    BlMmFreeHeap(FileTable);
     FileTable = NULL;
     FileEntries = 0;
 
@@ -85,11 +84,10 @@ Return Value:
         }
 
         //
-        // Remove from registry list and free data.
+        // Remove from registry list.
         //
         NextRegistryEntry = CONTAINING_RECORD(RegistryEntry->ListEntry.Flink, FS_REGISTRY_ENTRY, ListEntry);
         RemoveEntryList(&RegistryEntry->ListEntry);
-        BlMmFreeHeap(RegistryEntry);
         RegistryEntry = NextRegistryEntry;
     }
 
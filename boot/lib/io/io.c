@@ -73,12 +73,9 @@ Return Value:
     //
 
     //
-    // Free destroy routine table.
+    // The destroy routine table is released with the heap by BlpMmDestroy.
     //
-    Status = BlMmFreeHeap(IoMgrDestroyRoutineTable);
-    if (!NT_SUCCESS(Status)) {
-        ReturnStatus = Status;
-    }
+    IoMgrDestroyRoutineTable = NULL;
 
     return ReturnStatus;
 }
@@ -609,7 +609,7 @@ Return Value:
     //
     // Validate the requested option type.
     //
-    if ((Type & BCDE_FORMAT_MASK) == BCDE_FORMAT_INTEGER) {
+    if ((Type & BCDE_FORMAT_MASK) != BCDE_FORMAT_INTEGER) {
         return STATUS_INVALID_PARAMETER;
     }
 
@@ -618,7 +618,7 @@ Return Value:
     //
     BootOption = BcdUtilGetBootOption(Options, Type);
     if (BootOption) {
-        Value = *(INT64*)((ULONG_PTR)BootOption->Type + BootOption->DataOffset);
+        Value = *(INT64*)((ULONG_PTR)BootOption + BootOption->DataOffset);
         Status = STATUS_SUCCESS;
     } else {
         Status = STATUS_NOT_FOUND;
@@ -648,6 +648,64 @@ Return Value:
     return Status;
 }
 
+NTSTATUS
+BlGetBootOptionIntegerList (
+    IN  PBOOT_ENTRY_OPTION Options,
+    IN  BCDE_DATA_TYPE     Type,
+    OUT PULONGLONG         *ValuesOut,
+    OUT ULONG_PTR          *CountOut
+    )
+
+/*++
+
+Routine Description:
+
+    Retrieves a boot option of type Type as a list of integers.
+
+Arguments:
+
+    Options - Pointer to the boot option list.
+
+    Type - The type of option to search for.
+
+    ValuesOut - Receives a pointer to the option's values. The values are
+        not copied and remain owned by the option list.
+
+    CountOut - Receives the number of values.
+
+Return Value:
+
+    STATUS_SUCCESS if successful.
+
+    STATUS_INVALID_PARAMETER if Type is not of format BCDE_FORMAT_INTEGER_LIST.
+
+    STATUS_NOT_FOUND if no matching option could be found.
+
+--*/
+
+{
+    PBOOT_ENTRY_OPTION Option;
+
+    //
+    // Validate the requested option type.
+    //
+    if ((Type & BCDE_FORMAT_MASK) != BCDE_FORMAT_INTEGER_LIST) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    //
+    // Find an option of the requested type.
+    //
+    Option = BcdUtilGetBootOption(Options, Type);
+    if (Option == NULL) {
+        return STATUS_NOT_FOUND;
+    }
+
+    *ValuesOut = (PULONGLONG)((ULONG_PTR)Option + Option->DataOffset);
+    *CountOut = Option->DataSize / sizeof(ULONGLONG);
+    return STATUS_SUCCESS;
+}
+
 NTSTATUS
 BlGetBootOptionBoolean (
     IN  PBOOT_ENTRY_OPTION Options,
@@ -760,8 +818,10 @@ Return Value:
 
 {
     NTSTATUS Status;
-    ULONG BufferSize;
+    ULONG BufferSize, OldSize, LastOffset;
     PVOID Buffer;
+    PBOOT_ENTRY_OPTION OldOptions;
+    BOOLEAN Aliased;
 
     //
     // Get required buffer size.
@@ -779,27 +839,58 @@ Return Value:
         return Status;
     }
 
+    //
+    // Options owned by the entry are grown in place when possible,
+    // since merging copies the first list to the start of the buffer.
+    // This cannot be done if the options to append live in the same
+    // buffer, as reallocating may move or free it.
+    //
+    OldOptions = BootEntry->Options;
+    OldSize = BlGetBootOptionListSize(OldOptions);
+    Aliased = (ULONG_PTR)Options >= (ULONG_PTR)OldOptions && (ULONG_PTR)Options < (ULONG_PTR)OldOptions + OldSize;
+    if ((BootEntry->Attributes & BOOT_ENTRY_OPTIONS_INTERNAL) && !Aliased) {
+        Buffer = BlMmReallocateHeap(BootEntry->Options, BufferSize);
+        if (Buffer == NULL) {
+            return STATUS_NO_MEMORY;
+        }
+
+        //
+        // The old list may have been freed, so the entry must use the new
+        // buffer either way. A failed merge only changes the link of the
+        // last old option, which is put back to keep the old list.
+        //
+        BootEntry->Options = Buffer;
+        LastOffset = 0;
+        while (((PBOOT_ENTRY_OPTION)((ULONG_PTR)Buffer + LastOffset))->NextOptionOffset != 0) {
+            LastOffset = ((PBOOT_ENTRY_OPTION)((ULONG_PTR)Buffer + LastOffset))->NextOptionOffset;
+        }
+
+        Status = BlMergeBootOptionLists(Buffer, Options, Buffer, &BufferSize);
+        if (!NT_SUCCESS(Status)) {
+            ((PBOOT_ENTRY_OPTION)((ULONG_PTR)Buffer + LastOffset))->NextOptionOffset = 0;
+        }
+
+        return Status;
+    }
+
     Buffer = BlMmAllocateHeap(BufferSize);
     if (Buffer == NULL) {
         return STATUS_NO_MEMORY;
     }
 
-    Status = BlMergeBootOptionLists(BootEntry->Options, Options, Buffer, &BufferSize);
+    Status = BlMergeBootOptionLists(OldOptions, Options, Buffer, &BufferSize);
     if (!NT_SUCCESS(Status)) {
         BlMmFreeHeap(Buffer);
         return Status;
     }
 
     //
-    // Free old options.
+    // Use new options.
     //
     if (BootEntry->Attributes & BOOT_ENTRY_OPTIONS_INTERNAL) {
-        BlMmFreeHeap(BootEntry->Options);
+        BlMmFreeHeap(OldOptions);
     }
 
-    //
-    // Use new options.
-    //
     BootEntry->Options = Buffer;
     BootEntry->Attributes &= ~BOOT_ENTRY_OPTIONS_EXTERNAL;
     BootEntry->Attributes |= BOOT_ENTRY_OPTIONS_INTERNAL;
@@ -236,13 +236,11 @@ Return Value:
     // Reallocate and expand table.
     //
     NewEntryCount = OldEntryCount * 2;
-    NewTable = BlMmAllocateHeap(sizeof(*NewTable) * NewEntryCount);
+    NewTable = BlMmReallocateHeap(OldTable, sizeof(*NewTable) * NewEntryCount);
     if (NewTable == NULL) {
         return STATUS_NO_MEMORY;
     }
     RtlZeroMemory(&NewTable[OldEntryCount], sizeof(*NewTable) * OldEntryCount);
-    RtlMoveMemory(NewTable, OldTable, sizeof(*NewTable) * OldEntryCount);
-    BlMmFreeHeap(OldTable);
     *Table = NewTable;
     *EntryCount = NewEntryCount;
 
@@ -19,6 +19,76 @@ Module Name:
 ULONG MmDescriptorCallTreeCount;
 ULONG MmTranslationType = TRANSLATION_TYPE_MAX;
 
+#if !defined(NDEBUG)
+VOID
+MmpPrintHeapStatistics (
+    VOID
+    )
+
+/*++
+
+Routine Description:
+
+    Prints heap and slab allocator statistics.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    None.
+
+--*/
+
+{
+    MEMORY_HEAP_STATISTICS HeapStatistics;
+    MEMORY_SLAB_CLASS_STATISTICS SlabStatistics[MM_SLAB_CLASS_COUNT];
+    ULONG ClassCount;
+
+    if (!NT_SUCCESS(BlMmQueryHeapStatistics(&HeapStatistics))) {
+        return;
+    }
+
+    DebugInfo(
+        L"Heap: %d bytes in use (peak %d), %d allocations, %d frees\r\n",
+        (ULONG)HeapStatistics.BytesInUse,
+        (ULONG)HeapStatistics.PeakBytesInUse,
+        (ULONG)HeapStatistics.AllocationCount,
+        (ULONG)HeapStatistics.FreeCount
+    );
+    DebugInfo(
+        L"Heap: %d bytes in %d regions, %d bytes free, largest free block %d bytes, %d%% fragmented\r\n",
+        (ULONG)HeapStatistics.HeapSize,
+        HeapStatistics.RegionCount,
+        (ULONG)HeapStatistics.FreeBytes,
+        (ULONG)HeapStatistics.LargestFreeBlock,
+        HeapStatistics.FragmentationPercent
+    );
+    for (ULONG Index = 0; Index < MEMORY_HEAP_FREE_LIST_COUNT; Index++) {
+        if (HeapStatistics.FreeListLengths[Index] != 0) {
+            DebugInfo(L"Heap: freelist %d: %d buffers\r\n", Index, HeapStatistics.FreeListLengths[Index]);
+        }
+    }
+
+    ClassCount = MM_SLAB_CLASS_COUNT;
+    if (!NT_SUCCESS(BlMmQuerySlabStatistics(SlabStatistics, &ClassCount))) {
+        return;
+    }
+
+    for (ULONG Index = 0; Index < ClassCount; Index++) {
+        DebugInfo(
+            L"Slab %d: %d active (peak %d) in %d slabs, %d fallbacks\r\n",
+            SlabStatistics[Index].ObjectSize,
+            (ULONG)SlabStatistics[Index].ActiveObjects,
+            (ULONG)SlabStatistics[Index].PeakActiveObjects,
+            SlabStatistics[Index].SlabCount,
+            SlabStatistics[Index].FallbackCount
+        );
+    }
+}
+#endif
+
 NTSTATUS
 BlpMmDestroy (
     IN ULONG Phase
@@ -38,7 +108,8 @@ Routine Description:
 
         Phase 0: Free all application allocations.
 
-        Phase 1: Destroy all MM modules.
+        Phase 1: Destroy all MM modules. Phase 0 must have been
+            performed first.
 
 Return Value:
 
@@ -51,11 +122,7 @@ Return Value:
 #if !defined(NDEBUG)
         DebugInfo(L"Destroying memory manager (phase 1/1)...\r\n");
 #endif
-        //
-        // TODO: Implement remaining functionality.
-        //
-
-        MmHaDestroy();
+        MmPaDestroy(1);
 
         return STATUS_SUCCESS;
     }
@@ -63,10 +130,15 @@ Return Value:
     if (Phase == 0) {
 #if !defined(NDEBUG)
         DebugInfo(L"Destroying memory manager (phase 0/1)...\r\n");
+        MmpPrintHeapStatistics();
 #endif
         //
-        // TODO: Implement remaining functionality.
+        // Release all heap regions, slab segments and other page runs in
+        // one sweep instead of freeing allocations one by one.
         //
+        MmHaDestroy();
+        MmArchDestroy();
+        MmPaDestroy(0);
 
         return STATUS_SUCCESS;
     }
@@ -75,6 +147,68 @@ Return Value:
     return STATUS_INVALID_PARAMETER;
 }
 
+NTSTATUS
+BlMmMapPhysicalAddress (
+    IN OUT PVOID     *VirtualAddress,
+    IN     ULONGLONG PhysicalAddress,
+    IN     ULONGLONG Size,
+    IN     ULONG     Attributes
+    )
+
+/*++
+
+Routine Description:
+
+    Maps a range of physical memory, such as a kernel image or MMIO,
+    into the application address space.
+
+Arguments:
+
+    VirtualAddress - Pointer to the virtual address to map at. If it points
+        to NULL, the range is identity mapped and this receives its address.
+
+    PhysicalAddress - The page-aligned physical address to map.
+
+    Size - The number of bytes to map.
+
+    Attributes - MEMORY_ATTRIBUTE_* caching and protection attributes.
+
+Return Value:
+
+    STATUS_SUCCESS if successful.
+
+    STATUS_INVALID_PARAMETER if any argument is invalid, or if translation
+    is disabled and VirtualAddress is not the physical address.
+
+    Any other status value returned by MmArchMapPhysicalRange.
+
+--*/
+
+{
+    NTSTATUS Status;
+
+    if (VirtualAddress == NULL || Size == 0) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    if (*VirtualAddress == NULL) {
+        *VirtualAddress = (PVOID)(ULONG_PTR)PhysicalAddress;
+    }
+
+    //
+    // Without translation, physical memory can only be reached where it is.
+    //
+    if (MmTranslationType == TRANSLATION_TYPE_NONE) {
+        return (ULONG_PTR)*VirtualAddress == PhysicalAddress ? STATUS_SUCCESS : STATUS_INVALID_PARAMETER;
+    }
+
+    MmDescriptorCallTreeCount++;
+    Status = MmArchMapPhysicalRange((ULONG_PTR)*VirtualAddress, PhysicalAddress, Size, Attributes);
+    MmMdFreeGlobalDescriptors();
+    MmDescriptorCallTreeCount--;
+    return Status;
+}
+
 NTSTATUS
 BlpMmInitialize (
     IN PMEMORY_INFO             MemoryInfo,
@@ -129,8 +263,15 @@ Return Value:
     //
     // Start off using statically-allocated memory descriptors.
     //
-    MmGlobalMemoryDescriptors = MmStaticMemoryDescriptors;
-    MmGlobalMemoryDescriptorCount = MAX_STATIC_DESCRIPTOR_COUNT;
+    MmMdInitialize();
+
+    //
+    // Initialize the page allocator.
+    //
+    Status = MmPaInitialize();
+    if (!NT_SUCCESS(Status)) {
+        goto Exit;
+    }
 
     //
     // Initialize the heap allocator.
@@ -140,6 +281,29 @@ Return Value:
         goto Exit;
     }
 
+    //
+    // Descriptors can now be allocated dynamically.
+    //
+    MmDynamicMemoryDescriptorsEnabled = TRUE;
+
+    //
+    // Apply any physical memory constraints.
+    //
+    Status = BlpMmInitializeConstraints();
+    if (!NT_SUCCESS(Status)) {
+        goto Exit;
+    }
+
+    //
+    // Build the application address space if translation is requested.
+    //
+    if (MmTranslationType == TRANSLATION_TYPE_VIRTUAL) {
+        Status = MmArchInitialize();
+        if (!NT_SUCCESS(Status)) {
+            goto Exit;
+        }
+    }
+
     //
     // TODO: Finish implementing this routine.
     //
@@ -0,0 +1,363 @@
+/*++
+
+Copyright (c) 2025, Quinn Stephens, w1redch4d
+All rights reserved.
+Provided under the BSD 3-Clause license.
+
+Module Name:
+
+    mmar.c
+
+Abstract:
+
+    Arena allocation services.
+
+--*/
+
+#include "mm.h"
+
+#define ARENA_ALIGNMENT    16
+#define ARENA_CHUNK_HEADER ALIGN_UP(sizeof(MM_ARENA_CHUNK), ARENA_ALIGNMENT)
+
+//
+// Arena chunk header, stored at the start of every page run owned by an arena.
+//
+typedef struct {
+    LIST_ENTRY ListEntry;
+    ULONG_PTR  PageCount;
+} MM_ARENA_CHUNK, *PMM_ARENA_CHUNK;
+
+PMM_ARENA_CHUNK
+MmArpAllocateChunk (
+    IN ULONG_PTR Size
+    )
+
+/*++
+
+Routine Description:
+
+    Allocates a page run for an arena.
+
+Arguments:
+
+    Size - The minimum usable size of the chunk, in bytes.
+
+Return Value:
+
+    Pointer to the chunk if successful.
+
+    NULL if unsuccessful.
+
+--*/
+
+{
+    NTSTATUS Status;
+    ULONG_PTR ChunkSize;
+    PVOID Base;
+    PMM_ARENA_CHUNK Chunk;
+
+    Status = RtlSizeTAdd(Size, ARENA_CHUNK_HEADER + PAGE_MASK, &ChunkSize);
+    if (!NT_SUCCESS(Status)) {
+        return NULL;
+    }
+
+    Base = NULL;
+    Status = BlMmAllocatePagesInRange(
+        &Base,
+        ChunkSize >> PAGE_SHIFT,
+        MEMORY_TYPE_HEAP,
+        0,
+        NULL,
+        0
+    );
+    if (!NT_SUCCESS(Status)) {
+        DebugError(L"Arena chunk allocation failed (Status=0x%x)\r\n", Status);
+        return NULL;
+    }
+
+    Chunk = Base;
+    Chunk->PageCount = ChunkSize >> PAGE_SHIFT;
+    return Chunk;
+}
+
+VOID
+MmArpUseChunk (
+    IN PMEMORY_ARENA   Arena,
+    IN PMM_ARENA_CHUNK Chunk,
+    IN ULONG_PTR       Current
+    )
+
+/*++
+
+Routine Description:
+
+    Makes a chunk the arena's current allocation chunk.
+
+Arguments:
+
+    Arena - Pointer to the arena.
+
+    Chunk - Pointer to the chunk.
+
+    Current - The address of the first free byte in Chunk.
+
+Return Value:
+
+    None.
+
+--*/
+
+{
+    Arena->CurrentChunk = Chunk;
+    Arena->Current = Current;
+    Arena->Limit = (ULONG_PTR)Chunk + (Chunk->PageCount << PAGE_SHIFT);
+}
+
+NTSTATUS
+BlMmArenaCreate (
+    IN  ULONG_PTR     Size,
+    OUT PMEMORY_ARENA *ArenaOut
+    )
+
+/*++
+
+Routine Description:
+
+    Creates an arena for short-lived allocations.
+
+    The arena is hosted in its own first chunk, so creating it does not
+    touch the heap.
+
+Arguments:
+
+    Size - The expected total size of the arena's allocations, in bytes.
+        The arena grows past this size if needed.
+
+    Arena - Pointer to a PMEMORY_ARENA that receives the arena.
+
+Return Value:
+
+    STATUS_SUCCESS if successful.
+
+    STATUS_NO_MEMORY if memory allocation fails.
+
+--*/
+
+{
+    PMM_ARENA_CHUNK Chunk;
+    PMEMORY_ARENA Arena;
+
+    Chunk = MmArpAllocateChunk(Size + ALIGN_UP(sizeof(MEMORY_ARENA), ARENA_ALIGNMENT));
+    if (Chunk == NULL) {
+        return STATUS_NO_MEMORY;
+    }
+
+    Arena = (PMEMORY_ARENA)((ULONG_PTR)Chunk + ARENA_CHUNK_HEADER);
+    InitializeListHead(&Arena->ChunkList);
+    InsertTailList(&Arena->ChunkList, &Chunk->ListEntry);
+    Arena->ChunkSize = ALIGN_UP(Size, PAGE_SIZE);
+    Arena->Base = (ULONG_PTR)Arena + ALIGN_UP(sizeof(MEMORY_ARENA), ARENA_ALIGNMENT);
+    MmArpUseChunk(Arena, Chunk, Arena->Base);
+
+    *ArenaOut = Arena;
+    return STATUS_SUCCESS;
+}
+
+PVOID
+BlMmArenaAllocate (
+    IN PMEMORY_ARENA Arena,
+    IN ULONG_PTR     Size
+    )
+
+/*++
+
+Routine Description:
+
+    Allocates memory from an arena.
+
+    Arena allocations cannot be freed individually. They are released by
+    BlMmArenaRollback, BlMmArenaReset or BlMmArenaDestroy.
+
+Arguments:
+
+    Arena - Pointer to the arena.
+
+    Size - The size, in bytes, to allocate.
+
+Return Value:
+
+    Pointer to the allocated memory if successful.
+
+    NULL if unsuccessful.
+
+--*/
+
+{
+    ULONG_PTR RealSize;
+    PMM_ARENA_CHUNK Chunk;
+    PVOID Buffer;
+
+    RealSize = ALIGN_UP(Size, ARENA_ALIGNMENT);
+    if (RealSize < Size) {
+        DebugError(L"Integer overflow\r\n");
+        return NULL;
+    }
+
+    //
+    // Start a new chunk if the current one is full.
+    //
+    if (RealSize > Arena->Limit - Arena->Current) {
+        Chunk = MmArpAllocateChunk(RealSize > Arena->ChunkSize ? RealSize : Arena->ChunkSize);
+        if (Chunk == NULL) {
+            return NULL;
+        }
+
+        InsertTailList(&Arena->ChunkList, &Chunk->ListEntry);
+        MmArpUseChunk(Arena, Chunk, (ULONG_PTR)Chunk + ARENA_CHUNK_HEADER);
+    }
+
+    Buffer = (PVOID)Arena->Current;
+    Arena->Current += RealSize;
+    return Buffer;
+}
+
+VOID
+BlMmArenaGetCheckpoint (
+    IN  PMEMORY_ARENA            Arena,
+    OUT PMEMORY_ARENA_CHECKPOINT Checkpoint
+    )
+
+/*++
+
+Routine Description:
+
+    Records the current allocation state of an arena.
+
+    Checkpoints nest: rolling back to a checkpoint discards any checkpoints
+    taken after it.
+
+Arguments:
+
+    Arena - Pointer to the arena.
+
+    Checkpoint - Pointer to a MEMORY_ARENA_CHECKPOINT that receives the state.
+
+Return Value:
+
+    None.
+
+--*/
+
+{
+    Checkpoint->Chunk = Arena->CurrentChunk;
+    Checkpoint->Current = Arena->Current;
+}
+
+VOID
+BlMmArenaRollback (
+    IN PMEMORY_ARENA            Arena,
+    IN PMEMORY_ARENA_CHECKPOINT Checkpoint
+    )
+
+/*++
+
+Routine Description:
+
+    Releases every allocation made since a checkpoint was taken.
+
+Arguments:
+
+    Arena - Pointer to the arena.
+
+    Checkpoint - Pointer to the checkpoint.
+
+Return Value:
+
+    None.
+
+--*/
+
+{
+    PMM_ARENA_CHUNK Chunk;
+    PLIST_ENTRY Entry;
+
+    //
+    // Release chunks added after the checkpoint.
+    //
+    Chunk = Checkpoint->Chunk;
+    while (Chunk->ListEntry.Flink != &Arena->ChunkList) {
+        Entry = RemoveTailList(&Arena->ChunkList);
+        MmPapFreePages(Entry, CONTAINING_RECORD(Entry, MM_ARENA_CHUNK, ListEntry)->PageCount);
+    }
+
+    MmArpUseChunk(Arena, Chunk, Checkpoint->Current);
+}
+
+VOID
+BlMmArenaReset (
+    IN PMEMORY_ARENA Arena
+    )
+
+/*++
+
+Routine Description:
+
+    Releases every allocation made from an arena, keeping the arena itself.
+
+Arguments:
+
+    Arena - Pointer to the arena.
+
+Return Value:
+
+    None.
+
+--*/
+
+{
+    MEMORY_ARENA_CHECKPOINT Checkpoint;
+
+    Checkpoint.Chunk = CONTAINING_RECORD(Arena->ChunkList.Flink, MM_ARENA_CHUNK, ListEntry);
+    Checkpoint.Current = Arena->Base;
+    BlMmArenaRollback(Arena, &Checkpoint);
+}
+
+VOID
+BlMmArenaDestroy (
+    IN PMEMORY_ARENA Arena
+    )
+
+/*++
+
+Routine Description:
+
+    Releases an arena and every allocation made from it.
+
+Arguments:
+
+    Arena - Pointer to the arena.
+
+Return Value:
+
+    None.
+
+--*/
+
+{
+    PLIST_ENTRY Entry;
+    BOOLEAN Last;
+
+    if (Arena == NULL) {
+        return;
+    }
+
+    //
+    // The first chunk hosts the arena, so it must be released last,
+    // and the list must not be touched once it has been.
+    //
+    do {
+        Entry = RemoveTailList(&Arena->ChunkList);
+        Last = IsListEmpty(&Arena->ChunkList);
+        MmPapFreePages(Entry, CONTAINING_RECORD(Entry, MM_ARENA_CHUNK, ListEntry)->PageCount);
+    } while (!Last);
+}
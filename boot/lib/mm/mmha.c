@@ -14,20 +14,69 @@ Module Name:
 
 --*/
 
-#include "efilib.h"
 #include "mm.h"
 
-#define FREE_LIST_BUCKET_COUNT 7
-#define FREE_LIST_SIZE (sizeof(PMM_FREE_HEAP_ENTRY) * FREE_LIST_BUCKET_COUNT)
+//
+// The freelist is a two-level segregated-fit index. The first level splits
+// buffer sizes by power of two, and the second level splits each power of two
+// into FREE_LIST_SL_COUNT linear ranges. Sizes below FREE_LIST_SMALL_SIZE all
+// share the first first-level index and are split linearly.
+//
+#define FREE_LIST_ALIGN_SHIFT    4
+#define FREE_LIST_SL_SHIFT       4
+#define FREE_LIST_SL_COUNT       (1 << FREE_LIST_SL_SHIFT)
+#define FREE_LIST_FL_SHIFT       (FREE_LIST_SL_SHIFT + FREE_LIST_ALIGN_SHIFT)
+#define FREE_LIST_FL_MAX         30
+#define FREE_LIST_FL_COUNT       (FREE_LIST_FL_MAX - FREE_LIST_FL_SHIFT + 1)
+#define FREE_LIST_SMALL_SIZE     (1 << FREE_LIST_FL_SHIFT)
+#define FREE_LIST_SIZE           sizeof(MM_HEAP_FREE_LIST)
+
+//
+// The free top of a heap region is returned to the page allocator once it
+// exceeds the larger of this, the minimum heap size and twice the largest
+// in-place growth so far.
+//
+#define HEAP_TRIM_THRESHOLD      (16 * PAGE_SIZE)
+
+#if FREE_LIST_FL_COUNT != MEMORY_HEAP_FREE_LIST_COUNT
+#error "MEMORY_HEAP_FREE_LIST_COUNT must match the first-level freelist count"
+#endif
+
+typedef struct {
+    ULONG               FlBitmap;
+    ULONG               SlBitmap[FREE_LIST_FL_COUNT];
+    PMM_FREE_HEAP_ENTRY Heads[FREE_LIST_FL_COUNT][FREE_LIST_SL_COUNT];
+} MM_HEAP_FREE_LIST, *PMM_HEAP_FREE_LIST;
 
 ULONG HapInitializationStatus = 0;
-PMM_FREE_HEAP_ENTRY *MmFreeList;
+PMM_HEAP_FREE_LIST MmFreeList;
 ULONG HapMinimumHeapSize;
 ULONG HapAllocationAttributes;
 LIST_ENTRY MmHeapBoundaries;
 
+//
+// One empty region is kept instead of being released, so a loop that
+// allocates and frees a region's worth of memory does not create and
+// destroy a region every time.
+//
+PMM_HEAP_BOUNDARY HapSpareRegion;
+
+//
+// Raised as regions grow in place, so memory that was just needed is not
+// handed back only to be claimed again.
+//
+ULONG_PTR HapTrimThreshold;
+
+//
+// Heap usage counters, reported by BlMmQueryHeapStatistics.
+//
+ULONG_PTR HapBytesInUse;
+ULONG_PTR HapPeakBytesInUse;
+ULONGLONG HapAllocationCount;
+ULONGLONG HapFreeCount;
+
 FORCEINLINE
-ULONG
+ULONG_PTR
 MmHapGetBufferSize (
     IN PMM_FREE_HEAP_ENTRY HeapEntry
     )
@@ -52,8 +101,142 @@ Return Value:
     return MM_HEAP_LINK_DECODE(HeapEntry->BufferNext) - (ULONG_PTR)HeapEntry;
 }
 
+FORCEINLINE
+VOID
+MmHapRecordUsage (
+    IN ULONG_PTR OldSize,
+    IN ULONG_PTR NewSize
+    )
+
+/*++
+
+Routine Description:
+
+    Updates the heap usage counters after a buffer changes size.
+
+Arguments:
+
+    OldSize - The previous buffer size, or 0 for a new buffer.
+
+    NewSize - The new buffer size, or 0 for a freed buffer.
+
+Return Value:
+
+    None.
+
+--*/
+
+{
+    HapBytesInUse = HapBytesInUse - OldSize + NewSize;
+    if (HapBytesInUse > HapPeakBytesInUse) {
+        HapPeakBytesInUse = HapBytesInUse;
+    }
+}
+
+FORCEINLINE
+ULONG
+MmHapFindFirstSetBit (
+    IN ULONG Mask
+    )
+
+/*++
+
+Routine Description:
+
+    Finds the least significant set bit in a mask.
+
+Arguments:
+
+    Mask - The mask to scan. Must be nonzero.
+
+Return Value:
+
+    The index of the lowest set bit.
+
+--*/
+
+{
+    return __builtin_ctz(Mask);
+}
+
+FORCEINLINE
 ULONG
-MmHapGetBucketIndex (
+MmHapFindLastSetBit (
+    IN ULONG_PTR Value
+    )
+
+/*++
+
+Routine Description:
+
+    Finds the most significant set bit in a value.
+
+Arguments:
+
+    Value - The value to scan. Must be nonzero.
+
+Return Value:
+
+    The index of the highest set bit.
+
+--*/
+
+{
+    return 63 - __builtin_clzll((ULONGLONG)Value);
+}
+
+VOID
+MmHapGetFreeListIndex (
+    IN  ULONG_PTR BufferSize,
+    OUT PULONG    FirstLevel,
+    OUT PULONG    SecondLevel
+    )
+
+/*++
+
+Routine Description:
+
+    Calculates the freelist that a buffer of the specified size belongs on.
+
+Arguments:
+
+    BufferSize - The buffer size.
+
+    FirstLevel - Pointer to a ULONG that receives the first-level index.
+
+    SecondLevel - Pointer to a ULONG that receives the second-level index.
+
+Return Value:
+
+    None.
+
+--*/
+
+{
+    ULONG Shift;
+
+    if (BufferSize < FREE_LIST_SMALL_SIZE) {
+        *FirstLevel = 0;
+        *SecondLevel = (ULONG)(BufferSize >> FREE_LIST_ALIGN_SHIFT);
+        return;
+    }
+
+    //
+    // Buffers of 2^FREE_LIST_FL_MAX bytes or more all share the last list.
+    //
+    Shift = MmHapFindLastSetBit(BufferSize);
+    if (Shift >= FREE_LIST_FL_MAX) {
+        *FirstLevel = FREE_LIST_FL_COUNT - 1;
+        *SecondLevel = FREE_LIST_SL_COUNT - 1;
+        return;
+    }
+
+    *FirstLevel = Shift - (FREE_LIST_FL_SHIFT - 1);
+    *SecondLevel = (ULONG)(BufferSize >> (Shift - FREE_LIST_SL_SHIFT)) ^ FREE_LIST_SL_COUNT;
+}
+
+PMM_FREE_HEAP_ENTRY
+MmHapFindSuitableFreeList (
     IN ULONG_PTR BufferSize
     )
 
@@ -61,245 +244,1230 @@ MmHapGetBucketIndex (
 
 Routine Description:
 
-    Calculates the bucket index for the specified buffer size.
+    Finds the first non-empty freelist whose buffers are all at least
+    BufferSize bytes large.
+
+Arguments:
+
+    BufferSize - The minimum buffer size.
+
+Return Value:
+
+    Pointer to the head of the freelist if found.
+
+    NULL if no suitable buffer is free.
+
+--*/
+
+{
+    ULONG FirstLevel, SecondLevel;
+    ULONG FlBitmap, SlBitmap;
+
+    //
+    // Round up to the start of the next list so any buffer found is large enough.
+    //
+    if (BufferSize >= FREE_LIST_SMALL_SIZE) {
+        BufferSize += ((ULONG_PTR)1 << (MmHapFindLastSetBit(BufferSize) - FREE_LIST_SL_SHIFT)) - 1;
+    }
+
+    //
+    // The last list mixes all larger sizes, so it cannot guarantee a fit for them.
+    //
+    if (BufferSize >= ((ULONG_PTR)1 << FREE_LIST_FL_MAX)) {
+        return NULL;
+    }
+
+    MmHapGetFreeListIndex(BufferSize, &FirstLevel, &SecondLevel);
+
+    //
+    // Look for a list in the same power of two first.
+    //
+    SlBitmap = MmFreeList->SlBitmap[FirstLevel] & (~0U << SecondLevel);
+    if (SlBitmap == 0) {
+        //
+        // Move on to the next non-empty power of two.
+        //
+        if (FirstLevel + 1 >= FREE_LIST_FL_COUNT) {
+            return NULL;
+        }
+
+        FlBitmap = MmFreeList->FlBitmap & (~0U << (FirstLevel + 1));
+        if (FlBitmap == 0) {
+            return NULL;
+        }
+
+        FirstLevel = MmHapFindFirstSetBit(FlBitmap);
+        SlBitmap = MmFreeList->SlBitmap[FirstLevel];
+    }
+
+    SecondLevel = MmHapFindFirstSetBit(SlBitmap);
+    return MmFreeList->Heads[FirstLevel][SecondLevel];
+}
+
+PMM_HEAP_BOUNDARY
+MmHapFindHeapBoundary (
+    IN PVOID Address
+    )
+
+/*++
+
+Routine Description:
+
+    Finds the heap region containing an address.
+
+Arguments:
+
+    Address - The address to look up.
+
+Return Value:
+
+    Pointer to the heap boundary if found.
+
+    NULL if Address is not on the heap.
+
+--*/
+
+{
+    PLIST_ENTRY Entry;
+    PMM_HEAP_BOUNDARY HeapBoundary;
+
+    Entry = MmHeapBoundaries.Flink;
+    while (Entry != &MmHeapBoundaries) {
+        HeapBoundary = CONTAINING_RECORD(Entry, MM_HEAP_BOUNDARY, ListEntry);
+        if ((ULONG_PTR)Address >= HeapBoundary->HeapBase && (ULONG_PTR)Address < HeapBoundary->HeapLimit) {
+            return HeapBoundary;
+        }
+
+        Entry = Entry->Flink;
+    }
+
+    return NULL;
+}
+
+PMM_FREE_HEAP_ENTRY
+MmHapCheckBufferLinks (
+    IN PMM_FREE_HEAP_ENTRY HeapEntry
+    )
+
+/*++
+
+Routine Description:
+
+    Checks that a heap entry's neighbours link back to it.
+
+Arguments:
+
+    HeapEntry - Pointer to the heap entry to check.
+
+Return Value:
+
+    HeapEntry if its links are consistent.
+
+    NULL if heap corruption was detected.
+
+--*/
+
+{
+    PMM_FREE_HEAP_ENTRY NextEntry, PreviousEntry;
+
+    NextEntry = (PMM_FREE_HEAP_ENTRY)MM_HEAP_LINK_DECODE(HeapEntry->BufferNext);
+    PreviousEntry = (PMM_FREE_HEAP_ENTRY)MM_HEAP_LINK_DECODE(HeapEntry->BufferPrevious);
+
+    //
+    // The top of the heap links to itself.
+    //
+    if (NextEntry != HeapEntry && MM_HEAP_LINK_DECODE(NextEntry->BufferPrevious) != (ULONG_PTR)HeapEntry) {
+        DebugError(L"Heap corruption detected (next buffer 0x%x)\r\n", NextEntry);
+        return NULL;
+    }
+
+    //
+    // The first entry in a region has no previous buffer.
+    //
+    if (PreviousEntry != NULL && MM_HEAP_LINK_DECODE(PreviousEntry->BufferNext) != (ULONG_PTR)HeapEntry) {
+        DebugError(L"Heap corruption detected (previous buffer 0x%x)\r\n", PreviousEntry);
+        return NULL;
+    }
+
+    return HeapEntry;
+}
+
+VOID
+MmHapAddToFreeList (
+    IN PMM_FREE_HEAP_ENTRY FreeEntry
+    )
+
+/*++
+
+Routine Description:
+
+    Inserts a free buffer into its freelist.
+
+Arguments:
+
+    FreeEntry - Pointer to the free heap entry.
+
+Return Value:
+
+    None.
+
+--*/
+
+{
+    ULONG FirstLevel, SecondLevel;
+    PMM_FREE_HEAP_ENTRY Head;
+
+    MmHapGetFreeListIndex(MmHapGetBufferSize(FreeEntry), &FirstLevel, &SecondLevel);
+    Head = MmFreeList->Heads[FirstLevel][SecondLevel];
+
+    FreeEntry->BufferNext |= MM_HEAP_LINK_BUFFER_FREE;
+    FreeEntry->FreeNext = (ULONG_PTR)Head;
+    FreeEntry->FreePrevious = 0;
+    if (Head != NULL) {
+        Head->FreePrevious = (ULONG_PTR)FreeEntry;
+    }
+
+    MmFreeList->Heads[FirstLevel][SecondLevel] = FreeEntry;
+    MmFreeList->FlBitmap |= 1U << FirstLevel;
+    MmFreeList->SlBitmap[FirstLevel] |= 1U << SecondLevel;
+}
+
+PMM_FREE_HEAP_ENTRY
+MmHapRemoveBufferFromFreeList (
+    IN PMM_FREE_HEAP_ENTRY FreeEntry
+    )
+
+/*++
+
+Routine Description:
+
+    Removes a free buffer from its freelist.
+
+Arguments:
+
+    FreeEntry - Pointer to the free heap entry.
+
+Return Value:
+
+    FreeEntry if successful.
+
+    NULL if the freelist links are corrupt.
+
+--*/
+
+{
+    ULONG FirstLevel, SecondLevel;
+    PMM_FREE_HEAP_ENTRY NextEntry, PreviousEntry;
+
+    NextEntry = (PMM_FREE_HEAP_ENTRY)MM_HEAP_LINK_DECODE(FreeEntry->FreeNext);
+    PreviousEntry = (PMM_FREE_HEAP_ENTRY)MM_HEAP_LINK_DECODE(FreeEntry->FreePrevious);
+
+    //
+    // Unlink from the previous entry or the list head.
+    //
+    if (PreviousEntry != NULL) {
+        if (MM_HEAP_LINK_DECODE(PreviousEntry->FreeNext) != (ULONG_PTR)FreeEntry) {
+            DebugError(L"Freelist corruption detected (0x%x)\r\n", FreeEntry);
+            return NULL;
+        }
+
+        PreviousEntry->FreeNext = (ULONG_PTR)NextEntry;
+    } else {
+        MmHapGetFreeListIndex(MmHapGetBufferSize(FreeEntry), &FirstLevel, &SecondLevel);
+        if (MmFreeList->Heads[FirstLevel][SecondLevel] != FreeEntry) {
+            DebugError(L"Freelist corruption detected (0x%x)\r\n", FreeEntry);
+            return NULL;
+        }
+
+        //
+        // Clear the bitmap bits if the list is now empty.
+        //
+        MmFreeList->Heads[FirstLevel][SecondLevel] = NextEntry;
+        if (NextEntry == NULL) {
+            MmFreeList->SlBitmap[FirstLevel] &= ~(1U << SecondLevel);
+            if (MmFreeList->SlBitmap[FirstLevel] == 0) {
+                MmFreeList->FlBitmap &= ~(1U << FirstLevel);
+            }
+        }
+    }
+
+    if (NextEntry != NULL) {
+        NextEntry->FreePrevious = (ULONG_PTR)PreviousEntry;
+    }
+
+    FreeEntry->FreeNext = 0;
+    FreeEntry->FreePrevious = 0;
+    return FreeEntry;
+}
+
+PMM_USED_HEAP_ENTRY
+MmHapFindFreeHeapEntry (
+    IN ULONG_PTR BufferSize
+    )
+
+/*++
+
+Routine Description:
+
+    Finds a suitable entry in the freelist.
+
+Arguments:
+
+    BufferSize - The minimum buffer size.
+
+Return Value:
+
+    Pointer to the entry if successful.
+
+    NULL if unsuccessful.
+
+--*/
+
+{
+    PMM_FREE_HEAP_ENTRY FreeEntry, SplitEntry, NextEntry;
+    ULONG_PTR FreeBufferSize;
+
+    if (MmFreeList == NULL) {
+        return NULL;
+    }
+
+    //
+    // Take the first buffer from the smallest list that is guaranteed to fit.
+    //
+    FreeEntry = MmHapFindSuitableFreeList(BufferSize);
+    if (FreeEntry == NULL) {
+        return NULL;
+    }
+    FreeBufferSize = MmHapGetBufferSize(FreeEntry);
+
+    //
+    // Remove it from the list.
+    //
+    FreeEntry = MmHapRemoveBufferFromFreeList(FreeEntry);
+    if (FreeEntry == NULL) {
+        return NULL;
+    }
+
+    //
+    // Check for corruption.
+    //
+    FreeEntry = MmHapCheckBufferLinks(FreeEntry);
+    if (FreeEntry == NULL) {
+        return NULL;
+    }
+
+    //
+    // Split off the unused tail if it can hold a free entry.
+    //
+    NextEntry = (PMM_FREE_HEAP_ENTRY)MM_HEAP_LINK_DECODE(FreeEntry->BufferNext);
+    if (FreeBufferSize - BufferSize >= sizeof(MM_FREE_HEAP_ENTRY)) {
+        SplitEntry = (PMM_FREE_HEAP_ENTRY)((ULONG_PTR)FreeEntry + BufferSize);
+        SplitEntry->BufferNext = MM_HEAP_LINK_ENCODE(NextEntry, MM_HEAP_LINK_BUFFER_FREE);
+        SplitEntry->BufferPrevious = (ULONG_PTR)FreeEntry;
+        NextEntry->BufferPrevious = (ULONG_PTR)SplitEntry;
+        MmHapAddToFreeList(SplitEntry);
+        NextEntry = SplitEntry;
+    }
+
+    //
+    // Mark the buffer as used.
+    //
+    FreeEntry->BufferNext = (ULONG_PTR)NextEntry;
+    return (PMM_USED_HEAP_ENTRY)FreeEntry;
+}
+
+PMM_USED_HEAP_ENTRY
+MmHapAllocateFromHeapTop (
+    IN ULONG_PTR BufferSize
+    )
+
+/*++
+
+Routine Description:
+
+    Carves a buffer from the unallocated top of a heap region.
+
+Arguments:
+
+    BufferSize - The buffer size, including the entry header.
+
+Return Value:
+
+    Pointer to the entry if successful.
+
+    NULL if no heap region has enough space.
+
+--*/
+
+{
+    PLIST_ENTRY Entry;
+    PMM_HEAP_BOUNDARY HeapBoundary;
+    PMM_FREE_HEAP_ENTRY TopEntry, NewTopEntry;
+
+    Entry = MmHeapBoundaries.Flink;
+    while (Entry != &MmHeapBoundaries) {
+        HeapBoundary = CONTAINING_RECORD(Entry, MM_HEAP_BOUNDARY, ListEntry);
+        Entry = Entry->Flink;
+
+        //
+        // The new top entry must still fit below the limit.
+        //
+        if (HeapBoundary->HeapLimit - HeapBoundary->HeapStart < sizeof(MM_FREE_HEAP_ENTRY)
+            || BufferSize > HeapBoundary->HeapLimit - HeapBoundary->HeapStart - sizeof(MM_FREE_HEAP_ENTRY)) {
+            continue;
+        }
+
+        //
+        // Move the top of the heap up past the new buffer.
+        //
+        TopEntry = (PMM_FREE_HEAP_ENTRY)HeapBoundary->HeapStart;
+        NewTopEntry = (PMM_FREE_HEAP_ENTRY)(HeapBoundary->HeapStart + BufferSize);
+        NewTopEntry->BufferNext = MM_HEAP_LINK_ENCODE(NewTopEntry, MM_HEAP_LINK_BUFFER_FREE | MM_HEAP_LINK_BUFFER_ON_HEAP);
+        NewTopEntry->BufferPrevious = (ULONG_PTR)TopEntry;
+        TopEntry->BufferNext = (ULONG_PTR)NewTopEntry;
+        HeapBoundary->HeapStart = (ULONG_PTR)NewTopEntry;
+
+        return (PMM_USED_HEAP_ENTRY)TopEntry;
+    }
+
+    return NULL;
+}
+
+VOID
+MmHapCoalesceFreeBuffer (
+    IN PMM_HEAP_BOUNDARY   HeapBoundary,
+    IN PMM_FREE_HEAP_ENTRY FreeEntry
+    )
+
+/*++
+
+Routine Description:
+
+    Merges a newly freed buffer with its free neighbours and returns
+    the result to the freelist or the top of the heap.
+
+Arguments:
+
+    HeapBoundary - Pointer to the heap region containing FreeEntry.
+
+    FreeEntry - Pointer to the heap entry being freed.
+
+Return Value:
+
+    None.
+
+--*/
+
+{
+    PMM_FREE_HEAP_ENTRY NextEntry, PreviousEntry;
+
+    NextEntry = (PMM_FREE_HEAP_ENTRY)MM_HEAP_LINK_DECODE(FreeEntry->BufferNext);
+    PreviousEntry = (PMM_FREE_HEAP_ENTRY)MM_HEAP_LINK_DECODE(FreeEntry->BufferPrevious);
+
+    //
+    // Merge with the following buffer if it is free.
+    //
+    if (NextEntry->BufferNext & MM_HEAP_LINK_BUFFER_ON_HEAP) {
+        //
+        // The following buffer is the top of the heap, so this buffer becomes the new top.
+        //
+        FreeEntry->BufferNext = MM_HEAP_LINK_ENCODE(FreeEntry, MM_HEAP_LINK_BUFFER_FREE | MM_HEAP_LINK_BUFFER_ON_HEAP);
+        HeapBoundary->HeapStart = (ULONG_PTR)FreeEntry;
+    } else if (NextEntry->BufferNext & MM_HEAP_LINK_BUFFER_FREE) {
+        if (MmHapRemoveBufferFromFreeList(NextEntry) == NULL) {
+            return;
+        }
+
+        FreeEntry->BufferNext = MM_HEAP_LINK_ENCODE(MM_HEAP_LINK_DECODE(NextEntry->BufferNext), MM_HEAP_LINK_BUFFER_FREE);
+        NextEntry = (PMM_FREE_HEAP_ENTRY)MM_HEAP_LINK_DECODE(FreeEntry->BufferNext);
+        NextEntry->BufferPrevious = (ULONG_PTR)FreeEntry;
+    } else {
+        FreeEntry->BufferNext |= MM_HEAP_LINK_BUFFER_FREE;
+    }
+
+    //
+    // Merge with the preceding buffer if it is free.
+    //
+    if (PreviousEntry != NULL && (PreviousEntry->BufferNext & MM_HEAP_LINK_BUFFER_FREE)) {
+        if (MmHapRemoveBufferFromFreeList(PreviousEntry) == NULL) {
+            return;
+        }
+
+        if (FreeEntry->BufferNext & MM_HEAP_LINK_BUFFER_ON_HEAP) {
+            PreviousEntry->BufferNext = MM_HEAP_LINK_ENCODE(PreviousEntry, MM_HEAP_LINK_BUFFER_FREE | MM_HEAP_LINK_BUFFER_ON_HEAP);
+            HeapBoundary->HeapStart = (ULONG_PTR)PreviousEntry;
+        } else {
+            PreviousEntry->BufferNext = FreeEntry->BufferNext;
+            NextEntry = (PMM_FREE_HEAP_ENTRY)MM_HEAP_LINK_DECODE(FreeEntry->BufferNext);
+            NextEntry->BufferPrevious = (ULONG_PTR)PreviousEntry;
+        }
+
+        FreeEntry = PreviousEntry;
+    }
+
+    //
+    // The top of the heap is not kept on the freelist.
+    //
+    if (!(FreeEntry->BufferNext & MM_HEAP_LINK_BUFFER_ON_HEAP)) {
+        MmHapAddToFreeList(FreeEntry);
+    }
+}
+
+PMM_USED_HEAP_ENTRY
+MmHapValidateHeapBuffer (
+    IN  PVOID             Pointer,
+    OUT PMM_HEAP_BOUNDARY *HeapBoundaryOut
+    )
+
+/*++
+
+Routine Description:
+
+    Finds and checks the heap entry of an allocated heap buffer.
+
+Arguments:
+
+    Pointer - Pointer to the buffer.
+
+    HeapBoundary - Pointer to a PMM_HEAP_BOUNDARY that receives the heap
+        region containing the buffer.
+
+Return Value:
+
+    Pointer to the heap entry if successful.
+
+    NULL if Pointer is not an allocated heap buffer.
+
+--*/
+
+{
+    PMM_USED_HEAP_ENTRY HeapEntry;
+    PMM_HEAP_BOUNDARY HeapBoundary;
+
+    //
+    // Find the heap region containing the buffer.
+    //
+    HeapEntry = CONTAINING_RECORD(Pointer, MM_USED_HEAP_ENTRY, Buffer);
+    HeapBoundary = MmHapFindHeapBoundary(HeapEntry);
+    if (HeapBoundary == NULL || (ULONG_PTR)HeapEntry < HeapBoundary->HeapBase + FIELD_OFFSET(MM_USED_HEAP_ENTRY, Buffer) + sizeof(MM_HEAP_BOUNDARY)) {
+        DebugError(L"Buffer 0x%x is not on the heap\r\n", Pointer);
+        return NULL;
+    }
+
+    //
+    // Reject free and corrupted entries.
+    //
+    if (HeapEntry->BufferNext & MM_HEAP_LINK_BUFFER_FREE) {
+        DebugError(L"Buffer 0x%x is already free\r\n", Pointer);
+        return NULL;
+    }
+
+    if (MmHapCheckBufferLinks((PMM_FREE_HEAP_ENTRY)HeapEntry) == NULL) {
+        return NULL;
+    }
+
+    *HeapBoundaryOut = HeapBoundary;
+    return HeapEntry;
+}
+
+VOID
+MmHapTrimUsedBuffer (
+    IN PMM_HEAP_BOUNDARY   HeapBoundary,
+    IN PMM_USED_HEAP_ENTRY HeapEntry,
+    IN ULONG_PTR           BufferSize
+    )
+
+/*++
+
+Routine Description:
+
+    Shrinks a used buffer, releasing its tail if it can hold a free entry.
+
+Arguments:
+
+    HeapBoundary - Pointer to the heap region containing HeapEntry.
+
+    HeapEntry - Pointer to the used heap entry.
+
+    BufferSize - The new buffer size, including the entry header.
+
+Return Value:
+
+    None.
+
+--*/
+
+{
+    PMM_FREE_HEAP_ENTRY TailEntry, NextEntry;
+
+    if (MmHapGetBufferSize((PMM_FREE_HEAP_ENTRY)HeapEntry) - BufferSize < sizeof(MM_FREE_HEAP_ENTRY)) {
+        return;
+    }
+
+    //
+    // Link the tail in as a used buffer, then free it.
+    //
+    NextEntry = (PMM_FREE_HEAP_ENTRY)MM_HEAP_LINK_DECODE(HeapEntry->BufferNext);
+    TailEntry = (PMM_FREE_HEAP_ENTRY)((ULONG_PTR)HeapEntry + BufferSize);
+    TailEntry->BufferNext = (ULONG_PTR)NextEntry;
+    TailEntry->BufferPrevious = (ULONG_PTR)HeapEntry;
+    NextEntry->BufferPrevious = (ULONG_PTR)TailEntry;
+    HeapEntry->BufferNext = (ULONG_PTR)TailEntry;
+    MmHapCoalesceFreeBuffer(HeapBoundary, TailEntry);
+}
+
+VOID
+MmHapTrimHeapRegion (
+    IN PMM_HEAP_BOUNDARY HeapBoundary
+    )
+
+/*++
+
+Routine Description:
+
+    Returns unused pages of a heap region to the page allocator.
+
+    Empty regions are released entirely, except for one kept as a spare
+    and the one hosting the freelist. Otherwise, the free top of the region is
+    released once it exceeds the trim threshold, keeping the reserved top
+    page and at least the minimum heap size.
+
+Arguments:
+
+    HeapBoundary - Pointer to the heap region.
+
+Return Value:
+
+    None.
+
+--*/
+
+{
+    NTSTATUS Status;
+    BOOLEAN HostsFreeList;
+    ULONG_PTR RegionEnd, NewRegionEnd, Reserve;
+    PMM_HEAP_FREE_LIST FreeList;
+    PMM_HEAP_BOUNDARY Spare;
+
+    HostsFreeList = HeapBoundary->HeapEnd == (ULONG_PTR)MmFreeList;
+
+    //
+    // Keep one empty region whole as a spare, so the next burst of
+    // allocations can reuse it. When a second region empties, the larger
+    // of the two is kept and the other is released. A spare that has
+    // since been allocated from is simply replaced.
+    //
+    if (!HostsFreeList && HeapBoundary->HeapStart == (ULONG_PTR)(HeapBoundary + 1)) {
+        Spare = HapSpareRegion;
+        HapSpareRegion = HeapBoundary;
+        if (Spare != NULL && Spare != HeapBoundary && Spare->HeapStart == (ULONG_PTR)(Spare + 1)) {
+            if (Spare->HeapEnd - Spare->HeapBase > HeapBoundary->HeapEnd - HeapBoundary->HeapBase) {
+                HapSpareRegion = Spare;
+                Spare = HeapBoundary;
+            }
+
+            RemoveEntryList(&Spare->ListEntry);
+            Status = MmPapFreePages((PVOID)Spare->HeapBase, (Spare->HeapEnd - Spare->HeapBase) >> PAGE_SHIFT);
+            if (!NT_SUCCESS(Status)) {
+                InsertTailList(&MmHeapBoundaries, &Spare->ListEntry);
+            }
+        }
+
+        return;
+    }
+
+    //
+    // Keep a free top entry, the reserved top page and the freelist.
+    //
+    RegionEnd = HeapBoundary->HeapEnd;
+    Reserve = sizeof(MM_FREE_HEAP_ENTRY) + PAGE_SIZE;
+    if (HostsFreeList) {
+        RegionEnd += FREE_LIST_SIZE;
+        Reserve += FREE_LIST_SIZE;
+    }
+
+    //
+    // Never shrink a region below the minimum heap size.
+    //
+    NewRegionEnd = ALIGN_UP(HeapBoundary->HeapStart + Reserve, PAGE_SIZE);
+    if (NewRegionEnd - HeapBoundary->HeapBase < HapMinimumHeapSize) {
+        NewRegionEnd = HeapBoundary->HeapBase + HapMinimumHeapSize;
+    }
+
+    if (RegionEnd <= NewRegionEnd || RegionEnd - NewRegionEnd < HapTrimThreshold) {
+        return;
+    }
+
+    //
+    // Keep the freelist at the very top of its region.
+    //
+    if (HostsFreeList) {
+        FreeList = (PMM_HEAP_FREE_LIST)(NewRegionEnd - FREE_LIST_SIZE);
+        RtlMoveMemory(FreeList, MmFreeList, FREE_LIST_SIZE);
+        MmFreeList = FreeList;
+        HeapBoundary->HeapEnd = (ULONG_PTR)FreeList;
+    } else {
+        HeapBoundary->HeapEnd = NewRegionEnd;
+    }
+
+    HeapBoundary->HeapLimit = HeapBoundary->HeapEnd - PAGE_SIZE;
+
+    //
+    // If this fails, the pages stay allocated until MmPaDestroy.
+    //
+    Status = MmPapFreePages((PVOID)NewRegionEnd, (RegionEnd - NewRegionEnd) >> PAGE_SHIFT);
+    if (!NT_SUCCESS(Status)) {
+        DebugError(L"Heap trim failed (Status=0x%x)\r\n", Status);
+    }
+}
+
+NTSTATUS
+BlMmFreeHeap (
+    IN PVOID Pointer
+    )
+
+/*++
+
+Routine Description:
+
+    Frees allocated heap memory.
+
+Arguments:
+
+    Pointer - Pointer to the memory to free.
+
+Return Value:
+
+    STATUS_SUCCESS if successful.
+
+    STATUS_UNSUCCESSFUL if the heap allocator is not initialized.
+
+    STATUS_INVALID_PARAMETER if Pointer is not an allocated heap buffer.
+
+--*/
+
+{
+    NTSTATUS Status;
+    ULONG_PTR BufferSize;
+    PMM_USED_HEAP_ENTRY HeapEntry;
+    PMM_HEAP_BOUNDARY HeapBoundary;
+
+    //
+    // The heap allocator must be initialized.
+    //
+    if (HapInitializationStatus != 1) {
+        DebugError(L"Heap allocator not initialized\r\n");
+        return STATUS_UNSUCCESSFUL;
+    }
+
+    if (Pointer == NULL) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    //
+    // Small buffers may belong to the slab allocator.
+    //
+    if (MmSaIsSlabBuffer(Pointer)) {
+        BufferSize = MmSaGetBufferSize(Pointer);
+        Status = MmSaFree(Pointer);
+        if (NT_SUCCESS(Status)) {
+            MmHapRecordUsage(BufferSize, 0);
+            HapFreeCount++;
+        }
+
+        return Status;
+    }
+
+    //
+    // Reject foreign, already freed and corrupted buffers.
+    //
+    HeapEntry = MmHapValidateHeapBuffer(Pointer, &HeapBoundary);
+    if (HeapEntry == NULL) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    MmHapRecordUsage(MmHapGetBufferSize((PMM_FREE_HEAP_ENTRY)HeapEntry), 0);
+    HapFreeCount++;
+    MmHapCoalesceFreeBuffer(HeapBoundary, (PMM_FREE_HEAP_ENTRY)HeapEntry);
+    MmHapTrimHeapRegion(HeapBoundary);
+    return STATUS_SUCCESS;
+}
+
+PMM_USED_HEAP_ENTRY
+MmHapAllocateHeapEntry (
+    IN ULONG_PTR BufferSize
+    )
+
+/*++
+
+Routine Description:
+
+    Allocates a heap buffer, extending the heap if needed.
+
+Arguments:
+
+    BufferSize - The buffer size, including the entry header.
+
+Return Value:
+
+    Pointer to the entry if successful.
+
+    NULL if unsuccessful.
+
+--*/
+
+{
+    PMM_USED_HEAP_ENTRY HeapEntry;
+
+    //
+    // Reuse a freed buffer if possible.
+    // Otherwise carve from the top of the heap, extending it if needed.
+    //
+    HeapEntry = MmHapFindFreeHeapEntry(BufferSize);
+    if (HeapEntry == NULL) {
+        HeapEntry = MmHapAllocateFromHeapTop(BufferSize);
+    }
+
+    if (HeapEntry == NULL) {
+        if (!NT_SUCCESS(MmHapHeapAllocatorExtend(BufferSize))) {
+            return NULL;
+        }
+
+        HeapEntry = MmHapAllocateFromHeapTop(BufferSize);
+    }
+
+    return HeapEntry;
+}
+
+PVOID
+BlMmAllocateHeap (
+    IN ULONG_PTR Size
+    )
+
+/*++
+
+Routine Description:
+
+    Allocates memory on the heap.
 
 Arguments:
 
-    BufferSize - The buffer size.
+    Size - The size, in bytes, to allocate.
 
 Return Value:
 
-    The bucket index if successful.
+    Pointer to the allocated memory, if successful.
 
-    FREE_LIST_BUCKET_COUNT if unsuccessful.
+    NULL if unsuccessful.
 
 --*/
 
 {
-    ULONG Shift;
+    ULONG_PTR RealSize;
+    PMM_USED_HEAP_ENTRY HeapEntry;
+    PVOID Buffer;
+
+    //
+    // The heap allocator must be initialized.
+    //
+    if (HapInitializationStatus != 1) {
+        DebugError(L"Heap allocator not initialized\r\n");
+        return NULL;
+    }
+
+    //
+    // Serve small allocations from slabs, falling back to the heap.
+    //
+    if (Size <= MM_SLAB_MAX_SIZE) {
+        Buffer = MmSaAllocate(Size);
+        if (Buffer != NULL) {
+            MmHapRecordUsage(0, MmSaGetBufferSize(Buffer));
+            HapAllocationCount++;
+            return Buffer;
+        }
+    }
 
     //
-    // Large allocations use the last bucket.
+    // Align to size of used entry.
     //
-    if (BufferSize >= PAGE_SIZE) {
-        return FREE_LIST_BUCKET_COUNT - 1;
+    RealSize = ALIGN_UP(Size + FIELD_OFFSET(MM_USED_HEAP_ENTRY, Buffer), FIELD_OFFSET(MM_USED_HEAP_ENTRY, Buffer));
+    if (RealSize <= Size) {
+        DebugError(L"Integer overflow\r\n");
+        return NULL;
     }
 
     //
-    // Calculate the bucket index.
+    // Must be large enough to hold a free entry.
     //
-    Shift = 0;
-    do {
-        Shift++;
-    } while (BufferSize >> Shift);
+    if (RealSize < sizeof(MM_FREE_HEAP_ENTRY)) {
+        RealSize = sizeof(MM_FREE_HEAP_ENTRY);
+    }
+
+    HeapEntry = MmHapAllocateHeapEntry(RealSize);
+    if (HeapEntry == NULL) {
+        return NULL;
+    }
 
-    return Shift - 6;
+    MmHapRecordUsage(0, MmHapGetBufferSize((PMM_FREE_HEAP_ENTRY)HeapEntry));
+    HapAllocationCount++;
+    return HeapEntry->Buffer;
 }
 
-PMM_USED_HEAP_ENTRY
-MmHapFindFreeHeapEntry (
-    IN ULONG_PTR BufferSize
+PVOID
+BlMmAllocateHeapAligned (
+    IN ULONG_PTR Size,
+    IN ULONG_PTR Alignment
     )
 
 /*++
 
 Routine Description:
 
-    Finds a suitable entry in the freelist.
+    Allocates aligned memory on the heap.
+
+    The buffer is carved from an oversized heap buffer, and the slack on
+    either side of it is returned to the heap. It is freed with BlMmFreeHeap.
+    BlMmReallocateHeap keeps the alignment only if it resizes in place.
 
 Arguments:
 
-    BufferSize - The minimum buffer size.
+    Size - The size, in bytes, to allocate.
+
+    Alignment - The required alignment of the buffer, a power of two.
 
 Return Value:
 
-    Pointer to the entry if successful.
+    Pointer to the allocated memory, if successful.
 
     NULL if unsuccessful.
 
 --*/
 
 {
-    ULONG BucketIndex;
-    PMM_FREE_HEAP_ENTRY FreeEntry;
-    ULONG_PTR FreeBufferSize;
+    ULONG_PTR RealSize, SearchSize, Buffer;
+    PMM_USED_HEAP_ENTRY HeapEntry, AlignedEntry;
+    PMM_FREE_HEAP_ENTRY NextEntry;
+    PMM_HEAP_BOUNDARY HeapBoundary;
+
+    if (Alignment == 0 || (Alignment & (Alignment - 1)) != 0) {
+        DebugError(L"Invalid alignment 0x%x\r\n", Alignment);
+        return NULL;
+    }
+
+    //
+    // Every heap buffer is aligned to the size of a used entry.
+    //
+    if (Alignment <= FIELD_OFFSET(MM_USED_HEAP_ENTRY, Buffer)) {
+        return BlMmAllocateHeap(Size);
+    }
 
     //
-    // Find the bucket index for the buffer size.
+    // The heap allocator must be initialized.
     //
-    BucketIndex = MmHapGetBucketIndex(BufferSize);
-    if (BucketIndex >= FREE_LIST_BUCKET_COUNT) {
-        DebugError(L"Invalid bucket index\r\n");
+    if (HapInitializationStatus != 1) {
+        DebugError(L"Heap allocator not initialized\r\n");
         return NULL;
     }
 
     //
-    // Search the freelist.
+    // Align to size of used entry.
     //
-    do {
-        FreeEntry = MmFreeList != NULL ? MmFreeList[BucketIndex] : NULL;
+    RealSize = ALIGN_UP(Size + FIELD_OFFSET(MM_USED_HEAP_ENTRY, Buffer), FIELD_OFFSET(MM_USED_HEAP_ENTRY, Buffer));
+    if (RealSize <= Size) {
+        DebugError(L"Integer overflow\r\n");
+        return NULL;
+    }
 
-        //
-        // Find a large enough free entry in the bucket.
-        //
-        while (FreeEntry != NULL) {
-            FreeBufferSize = MmHapGetBufferSize(FreeEntry);
-            if (FreeBufferSize >= BufferSize) {
-                break;
-            }
+    if (RealSize < sizeof(MM_FREE_HEAP_ENTRY)) {
+        RealSize = sizeof(MM_FREE_HEAP_ENTRY);
+    }
 
-            FreeEntry = (PMM_FREE_HEAP_ENTRY)(MM_HEAP_LINK_DECODE(FreeEntry->FreeNext));
-        }
+    //
+    // Leave room for an aligned buffer preceded by either nothing or a free entry.
+    //
+    if (!NT_SUCCESS(RtlSizeTAdd(RealSize, Alignment + sizeof(MM_FREE_HEAP_ENTRY), &SearchSize))) {
+        DebugError(L"Integer overflow\r\n");
+        return NULL;
+    }
 
-        //
-        // Done if an entry was found.
-        //
-        if (FreeEntry != NULL) {
-            break;
-        }
+    HeapEntry = MmHapAllocateHeapEntry(SearchSize);
+    if (HeapEntry == NULL) {
+        return NULL;
+    }
 
-        //
-        // Move on to the next bucket.
-        //
-        BucketIndex++;
-        if (BucketIndex >= FREE_LIST_BUCKET_COUNT) {
-            return NULL;
-        }
-    } while (FreeEntry == NULL);
+    HeapBoundary = MmHapFindHeapBoundary(HeapEntry);
+    Buffer = ALIGN_UP((ULONG_PTR)HeapEntry->Buffer, Alignment);
+    AlignedEntry = CONTAINING_RECORD((PVOID)Buffer, MM_USED_HEAP_ENTRY, Buffer);
 
     //
-    // Remove it from the list.
+    // Give the leading slack back to the heap.
     //
-    // FreeEntry = MmHapRemoveBufferFromFreeList(FreeEntry);
-    // if (FreeEntry == NULL) {
-    //     return NULL;
-    // }
+    if (AlignedEntry != HeapEntry) {
+        if ((ULONG_PTR)AlignedEntry - (ULONG_PTR)HeapEntry < sizeof(MM_FREE_HEAP_ENTRY)) {
+            AlignedEntry = (PMM_USED_HEAP_ENTRY)((ULONG_PTR)AlignedEntry + Alignment);
+        }
 
-    //
-    // Check for corruption.
-    //
-    // FreeEntry = MmHapCheckBufferLinks(FreeEntry);
-    // if (FreeEntry == NULL) {
-    //     return NULL;
-    // }
+        NextEntry = (PMM_FREE_HEAP_ENTRY)MM_HEAP_LINK_DECODE(HeapEntry->BufferNext);
+        AlignedEntry->BufferNext = (ULONG_PTR)NextEntry;
+        AlignedEntry->BufferPrevious = (ULONG_PTR)HeapEntry;
+        NextEntry->BufferPrevious = (ULONG_PTR)AlignedEntry;
+        HeapEntry->BufferNext = (ULONG_PTR)AlignedEntry;
+        MmHapCoalesceFreeBuffer(HeapBoundary, (PMM_FREE_HEAP_ENTRY)HeapEntry);
+    }
 
     //
-    // TODO: Finish implementing this routine.
+    // Give the trailing slack back to the heap.
     //
-    return NULL;
+    MmHapTrimUsedBuffer(HeapBoundary, AlignedEntry, RealSize);
+
+    MmHapRecordUsage(0, MmHapGetBufferSize((PMM_FREE_HEAP_ENTRY)AlignedEntry));
+    HapAllocationCount++;
+    return AlignedEntry->Buffer;
 }
 
-NTSTATUS
-BlMmFreeHeap (
-    IN PVOID Pointer
+PVOID
+BlMmReallocateHeap (
+    IN PVOID     Pointer,
+    IN ULONG_PTR Size
     )
 
 /*++
 
 Routine Description:
 
-    Frees allocated heap memory.
+    Resizes allocated heap memory.
+
+    The buffer is grown into the following free buffer or the top of the
+    heap if possible, and is only moved when neither has enough space.
 
 Arguments:
 
-    Pointer - Pointer to the memory to free.
+    Pointer - Pointer to the memory to resize, or NULL to allocate new memory.
 
-Return Value:
+    Size - The new size, in bytes.
 
-    STATUS_SUCCESS if successful.
+Return Value:
 
-    STATUS_UNSUCCESSFUL if the heap allocator is not initialized.
+    Pointer to the resized memory if successful. Its contents are preserved
+    up to the smaller of the old and new sizes.
 
-    Error code if unsuccessful.
+    NULL if unsuccessful. The original memory is left unchanged.
 
 --*/
 
 {
-    NTSTATUS Status;
+    PMM_USED_HEAP_ENTRY HeapEntry;
+    PMM_HEAP_BOUNDARY HeapBoundary;
+    PMM_FREE_HEAP_ENTRY NextEntry, TopEntry;
+    ULONG_PTR RealSize, OldSize, CopySize;
+    PVOID Buffer;
 
     //
     // The heap allocator must be initialized.
     //
     if (HapInitializationStatus != 1) {
         DebugError(L"Heap allocator not initialized\r\n");
-        return STATUS_UNSUCCESSFUL;
+        return NULL;
+    }
+
+    if (Pointer == NULL) {
+        return BlMmAllocateHeap(Size);
     }
 
     //
-    // TODO: Don't use the firmware allocator.
+    // Slab objects have a fixed size, so they can only be kept or moved.
     //
-    Status = EfiFreePool(Pointer);
-    if (!NT_SUCCESS(Status)) {
-        DebugError(L"EfiFreePool failed (Status=0x%x)\r\n", Status);
-        return Status;
+    if (MmSaIsSlabBuffer(Pointer)) {
+        CopySize = MmSaGetBufferSize(Pointer);
+        if (CopySize == 0) {
+            return NULL;
+        }
+
+        if (Size <= CopySize) {
+            return Pointer;
+        }
+
+        goto Move;
     }
 
-    return STATUS_SUCCESS;
+    HeapEntry = MmHapValidateHeapBuffer(Pointer, &HeapBoundary);
+    if (HeapEntry == NULL) {
+        return NULL;
+    }
+
+    //
+    // Align to size of used entry.
+    //
+    RealSize = ALIGN_UP(Size + FIELD_OFFSET(MM_USED_HEAP_ENTRY, Buffer), FIELD_OFFSET(MM_USED_HEAP_ENTRY, Buffer));
+    if (RealSize <= Size) {
+        DebugError(L"Integer overflow\r\n");
+        return NULL;
+    }
+
+    //
+    // Must be large enough to hold a free entry.
+    //
+    if (RealSize < sizeof(MM_FREE_HEAP_ENTRY)) {
+        RealSize = sizeof(MM_FREE_HEAP_ENTRY);
+    }
+
+    OldSize = MmHapGetBufferSize((PMM_FREE_HEAP_ENTRY)HeapEntry);
+    CopySize = OldSize - FIELD_OFFSET(MM_USED_HEAP_ENTRY, Buffer);
+
+    //
+    // Shrink in place.
+    //
+    if (RealSize <= OldSize) {
+        MmHapTrimUsedBuffer(HeapBoundary, HeapEntry, RealSize);
+        MmHapTrimHeapRegion(HeapBoundary);
+        goto Resized;
+    }
+
+    NextEntry = (PMM_FREE_HEAP_ENTRY)MM_HEAP_LINK_DECODE(HeapEntry->BufferNext);
+    if (NextEntry->BufferNext & MM_HEAP_LINK_BUFFER_ON_HEAP) {
+        //
+        // Grow into the top of the heap if the new top entry still fits below the limit.
+        //
+        if (HeapBoundary->HeapLimit - (ULONG_PTR)HeapEntry >= sizeof(MM_FREE_HEAP_ENTRY)
+            && RealSize <= HeapBoundary->HeapLimit - (ULONG_PTR)HeapEntry - sizeof(MM_FREE_HEAP_ENTRY)) {
+            TopEntry = (PMM_FREE_HEAP_ENTRY)((ULONG_PTR)HeapEntry + RealSize);
+            TopEntry->BufferNext = MM_HEAP_LINK_ENCODE(TopEntry, MM_HEAP_LINK_BUFFER_FREE | MM_HEAP_LINK_BUFFER_ON_HEAP);
+            TopEntry->BufferPrevious = (ULONG_PTR)HeapEntry;
+            HeapEntry->BufferNext = (ULONG_PTR)TopEntry;
+            HeapBoundary->HeapStart = (ULONG_PTR)TopEntry;
+            goto Resized;
+        }
+    } else if (NextEntry->BufferNext & MM_HEAP_LINK_BUFFER_FREE) {
+        //
+        // Absorb the following free buffer, then give back what is not needed.
+        //
+        if (RealSize - OldSize <= MmHapGetBufferSize(NextEntry)) {
+            if (MmHapRemoveBufferFromFreeList(NextEntry) == NULL) {
+                return NULL;
+            }
+
+            HeapEntry->BufferNext = MM_HEAP_LINK_DECODE(NextEntry->BufferNext);
+            NextEntry = (PMM_FREE_HEAP_ENTRY)HeapEntry->BufferNext;
+            NextEntry->BufferPrevious = (ULONG_PTR)HeapEntry;
+            MmHapTrimUsedBuffer(HeapBoundary, HeapEntry, RealSize);
+            goto Resized;
+        }
+    }
+
+Move:
+    //
+    // Move the contents to a new buffer.
+    //
+    Buffer = BlMmAllocateHeap(Size);
+    if (Buffer == NULL) {
+        return NULL;
+    }
+
+    RtlMoveMemory(Buffer, Pointer, CopySize < Size ? CopySize : Size);
+    BlMmFreeHeap(Pointer);
+    return Buffer;
+
+Resized:
+    MmHapRecordUsage(OldSize, MmHapGetBufferSize((PMM_FREE_HEAP_ENTRY)HeapEntry));
+    return Pointer;
 }
 
-PVOID
-BlMmAllocateHeap (
-    IN ULONG_PTR Size
+NTSTATUS
+BlMmQueryHeapStatistics (
+    OUT PMEMORY_HEAP_STATISTICS Statistics
     )
 
 /*++
 
 Routine Description:
 
-    Allocates memory on the heap.
+    Reports heap usage and fragmentation statistics.
+
+    Buffer sizes include their entry headers. Slab buffers count toward
+    the usage counters with their object size.
 
 Arguments:
 
-    Size - The size, in bytes, to allocate.
+    Statistics - Pointer to a MEMORY_HEAP_STATISTICS that receives the statistics.
 
 Return Value:
 
-    Pointer to the allocated memory, if successful.
+    STATUS_SUCCESS if successful.
 
-    NULL if unsuccessful.
+    STATUS_UNSUCCESSFUL if the heap allocator is not initialized.
+
+    STATUS_INVALID_PARAMETER if Statistics is NULL.
 
 --*/
 
 {
-    NTSTATUS Status;
-    ULONG_PTR RealSize;
-    PVOID Buffer;
+    PLIST_ENTRY Entry;
+    PMM_HEAP_BOUNDARY HeapBoundary;
+    PMM_FREE_HEAP_ENTRY FreeEntry;
+    ULONG_PTR BufferSize;
 
     //
     // The heap allocator must be initialized.
     //
     if (HapInitializationStatus != 1) {
         DebugError(L"Heap allocator not initialized\r\n");
-        return NULL;
+        return STATUS_UNSUCCESSFUL;
+    }
+
+    if (Statistics == NULL) {
+        return STATUS_INVALID_PARAMETER;
     }
 
+    RtlZeroMemory(Statistics, sizeof(*Statistics));
+    Statistics->BytesInUse = HapBytesInUse;
+    Statistics->PeakBytesInUse = HapPeakBytesInUse;
+    Statistics->AllocationCount = HapAllocationCount;
+    Statistics->FreeCount = HapFreeCount;
+
     //
-    // Align to size of used entry.
+    // The unallocated top of each region is free space too.
     //
-    RealSize = ALIGN_UP(Size + FIELD_OFFSET(MM_USED_HEAP_ENTRY, Buffer), FIELD_OFFSET(MM_USED_HEAP_ENTRY, Buffer));
-    if (RealSize <= Size) {
-        DebugError(L"Integer overflow\r\n");
-        return NULL;
+    Entry = MmHeapBoundaries.Flink;
+    while (Entry != &MmHeapBoundaries) {
+        HeapBoundary = CONTAINING_RECORD(Entry, MM_HEAP_BOUNDARY, ListEntry);
+        Entry = Entry->Flink;
+
+        BufferSize = HeapBoundary->HeapLimit - HeapBoundary->HeapStart;
+        Statistics->RegionCount++;
+        Statistics->HeapSize += HeapBoundary->HeapLimit - HeapBoundary->HeapBase;
+        Statistics->FreeBytes += BufferSize;
+        if (BufferSize > Statistics->LargestFreeBlock) {
+            Statistics->LargestFreeBlock = BufferSize;
+        }
     }
 
     //
-    // Must be large enough to hold a free entry.
+    // Walk every freelist.
     //
-    if (RealSize < sizeof(MM_FREE_HEAP_ENTRY)) {
-        RealSize = sizeof(MM_FREE_HEAP_ENTRY);
+    for (ULONG FirstLevel = 0; FirstLevel < FREE_LIST_FL_COUNT; FirstLevel++) {
+        for (ULONG SecondLevel = 0; SecondLevel < FREE_LIST_SL_COUNT; SecondLevel++) {
+            FreeEntry = MmFreeList->Heads[FirstLevel][SecondLevel];
+            while (FreeEntry != NULL) {
+                BufferSize = MmHapGetBufferSize(FreeEntry);
+                Statistics->FreeListLengths[FirstLevel]++;
+                Statistics->FreeBytes += BufferSize;
+                if (BufferSize > Statistics->LargestFreeBlock) {
+                    Statistics->LargestFreeBlock = BufferSize;
+                }
+
+                FreeEntry = (PMM_FREE_HEAP_ENTRY)MM_HEAP_LINK_DECODE(FreeEntry->FreeNext);
+            }
+        }
     }
 
     //
-    // TODO: Don't use the firmware allocator.
+    // Fragmentation is the share of free space outside the largest free block.
     //
-
-    Status = EfiAllocatePool(EfiLoaderData, Size, &Buffer);
-    if (!NT_SUCCESS(Status)) {
-        DebugError(L"EfiAllocatePool failed (Status=0x%x)\r\n", Status);
-        return NULL;
+    if (Statistics->FreeBytes != 0) {
+        Statistics->FragmentationPercent = (ULONG)(100 - (((ULONGLONG)Statistics->LargestFreeBlock * 100) / Statistics->FreeBytes));
     }
 
-    return Buffer;
+    return STATUS_SUCCESS;
 }
 
 VOID
@@ -313,6 +1481,9 @@ Routine Description:
 
     Destroys the heap allocator.
 
+    Heap regions are not walked or freed here; they are page runs, and
+    are released in bulk by MmPaDestroy.
+
 Arguments:
 
     None.
@@ -327,7 +1498,106 @@ Return Value:
 #if !defined(NDEBUG)
     DebugInfo(L"Destroying heap allocator...\r\n");
 #endif
+    MmSaDestroy();
     HapInitializationStatus = 0;
+    MmFreeList = NULL;
+    HapSpareRegion = NULL;
+    InitializeListHead(&MmHeapBoundaries);
+}
+
+NTSTATUS
+MmHapGrowHeapRegion (
+    IN PMM_HEAP_BOUNDARY HeapBoundary,
+    IN ULONG_PTR         BufferSize,
+    IN ULONG_PTR         GrowSize
+    )
+
+/*++
+
+Routine Description:
+
+    Grows a heap region in place so that its top can hold a buffer.
+
+    The reserved top page is used first. If that is not enough, the pages
+    directly above the region are claimed and the top page is reserved
+    again.
+
+Arguments:
+
+    HeapBoundary - Pointer to the heap region.
+
+    BufferSize - The buffer size, including the entry header.
+
+    GrowSize - The number of bytes to claim above the region, a multiple
+        of the page size.
+
+Return Value:
+
+    STATUS_SUCCESS if successful.
+
+    Any other status value returned by BlMmAllocatePagesInRange.
+
+--*/
+
+{
+    NTSTATUS Status;
+    ULONG_PTR RegionEnd;
+    PVOID Address;
+    PMM_HEAP_FREE_LIST FreeList;
+
+    //
+    // Use the reserved top page if it is enough.
+    //
+    if (HeapBoundary->HeapEnd - HeapBoundary->HeapStart >= sizeof(MM_FREE_HEAP_ENTRY)
+        && BufferSize <= HeapBoundary->HeapEnd - HeapBoundary->HeapStart - sizeof(MM_FREE_HEAP_ENTRY)) {
+        HeapBoundary->HeapLimit = HeapBoundary->HeapEnd;
+        return STATUS_SUCCESS;
+    }
+
+    //
+    // Otherwise claim the pages directly above the region.
+    // The region hosting the freelist ends past it.
+    //
+    RegionEnd = HeapBoundary->HeapEnd;
+    if (RegionEnd == (ULONG_PTR)MmFreeList) {
+        RegionEnd += FREE_LIST_SIZE;
+    }
+
+    Address = (PVOID)RegionEnd;
+    Status = BlMmAllocatePagesInRange(
+        &Address,
+        GrowSize >> PAGE_SHIFT,
+        MEMORY_TYPE_HEAP,
+        HapAllocationAttributes | MEMORY_ATTRIBUTE_ALLOCATION_FIXED,
+        NULL,
+        0
+    );
+    if (!NT_SUCCESS(Status)) {
+        return Status;
+    }
+
+    if (GrowSize > HapTrimThreshold / 2) {
+        HapTrimThreshold = GrowSize * 2;
+    }
+
+    RegionEnd += GrowSize;
+
+    //
+    // Keep the freelist at the very top of its region.
+    //
+    if (HeapBoundary->HeapEnd == (ULONG_PTR)MmFreeList) {
+        FreeList = (PMM_HEAP_FREE_LIST)(RegionEnd - FREE_LIST_SIZE);
+        RtlMoveMemory(FreeList, MmFreeList, FREE_LIST_SIZE);
+        MmFreeList = FreeList;
+        RegionEnd = (ULONG_PTR)FreeList;
+    }
+
+    //
+    // Reserve the new top page.
+    //
+    HeapBoundary->HeapEnd = RegionEnd;
+    HeapBoundary->HeapLimit = RegionEnd - PAGE_SIZE;
+    return STATUS_SUCCESS;
 }
 
 NTSTATUS
@@ -341,6 +1611,9 @@ Routine Description:
 
     Extends the heap to the desired size.
 
+    The newest heap region is grown in place if possible. A new region is
+    only added when that fails.
+
 Arguments:
 
     HeapSize - The amount to extend the heap by.
@@ -357,11 +1630,14 @@ Return Value:
 
 {
     NTSTATUS Status;
+    ULONG_PTR BufferSize;
     PMM_HEAP_BOUNDARY HeapBoundary;
     PVOID HeapBase;
     PMM_USED_HEAP_ENTRY FirstHeapEntry;
     PMM_FREE_HEAP_ENTRY SecondHeapEntry;
 
+    BufferSize = HeapSize;
+
     //
     // Add space for extra data.
     //
@@ -386,13 +1662,12 @@ Return Value:
     }
 
     //
-    // Check if a heap already exists.
+    // Try to grow the newest heap region first.
     //
     if (!IsListEmpty(&MmHeapBoundaries)) {
-        HeapBoundary = CONTAINING_RECORD(MmHeapBoundaries.Flink, MM_HEAP_BOUNDARY, ListEntry);
-        if ((HeapBoundary->HeapLimit + PAGE_SIZE) <= HeapBoundary->HeapEnd) {
-            DebugError(L"Existing heap expansion not implemented\r\n");
-            return STATUS_NOT_IMPLEMENTED;
+        HeapBoundary = CONTAINING_RECORD(MmHeapBoundaries.Blink, MM_HEAP_BOUNDARY, ListEntry);
+        if (NT_SUCCESS(MmHapGrowHeapRegion(HeapBoundary, BufferSize, HeapSize))) {
+            return STATUS_SUCCESS;
         }
     }
 
@@ -439,7 +1714,7 @@ Return Value:
     // Host the free list if needed.
     //
     if (IsListEmpty(&MmHeapBoundaries)) {
-        MmFreeList = (PMM_FREE_HEAP_ENTRY *)(HeapBoundary->HeapLimit - FREE_LIST_SIZE);
+        MmFreeList = (PMM_HEAP_FREE_LIST)(HeapBoundary->HeapLimit - FREE_LIST_SIZE);
         HeapBoundary->HeapLimit = (ULONG_PTR)MmFreeList;
         RtlZeroMemory(MmFreeList, FREE_LIST_SIZE);
     }
@@ -493,6 +1768,12 @@ Return Value:
     HapMinimumHeapSize = ALIGN_UP(MinimumHeapSize, PAGE_SIZE);
     HapAllocationAttributes = AllocationAttributes & 0x20000;
     InitializeListHead(&MmHeapBoundaries);
+    HapSpareRegion = NULL;
+    HapTrimThreshold = HapMinimumHeapSize > HEAP_TRIM_THRESHOLD ? HapMinimumHeapSize : HEAP_TRIM_THRESHOLD;
+    HapBytesInUse = 0;
+    HapPeakBytesInUse = 0;
+    HapAllocationCount = 0;
+    HapFreeCount = 0;
 
     //
     // Expand the heap.
@@ -502,6 +1783,7 @@ Return Value:
         return Status;
     }
 
+    MmSaInitialize(HapAllocationAttributes);
     HapInitializationStatus = 1;
     return STATUS_SUCCESS;
 }
@@ -16,59 +16,1211 @@ Module Name:
 
 #include "mm.h"
 
+//
+// Descriptors come from a static array until the heap is up. After that,
+// slabs of dynamic descriptors are allocated from the page allocator and
+// descriptors in use are migrated out of the static array whenever the
+// outermost memory manager call returns, so the static array is always
+// available as a reserve for the next call.
+//
 MEMORY_DESCRIPTOR MmStaticMemoryDescriptors[MAX_STATIC_DESCRIPTOR_COUNT];
 PMEMORY_DESCRIPTOR MmGlobalMemoryDescriptors;
 ULONG MmGlobalMemoryDescriptorCount, MmGlobalMemoryDescriptorsUsed;
 LIST_ENTRY MmFreeGlobalMemoryDescriptorsList;
+ULONG MmFreeGlobalMemoryDescriptorCount;
 PMEMORY_DESCRIPTOR MmDynamicMemoryDescriptors = NULL;
-ULONG MmDynamicMemoryDescriptorCount;
+ULONG MmDynamicMemoryDescriptorCount, MmDynamicMemoryDescriptorsUsed;
+LIST_ENTRY MmMemoryDescriptorSlabs;
+BOOLEAN MmDynamicMemoryDescriptorsEnabled;
+
+//
+// MDLs whose descriptors are migrated out of the static array.
+//
+LIST_ENTRY MmMemoryDescriptorLists;
+
+//
+// Every MDL is indexed by a treap ordered by first page. Each node also
+// records the largest page count in its subtree, so searches for a free
+// run can skip subtrees that are too small.
+//
+ULONG MmMdIndexSeed = 0x9e3779b9;
+ULONGLONG MmMdIndexLookups;
+ULONGLONG MmMdIndexSteps;
+
+VOID
+MmMdInitialize (
+    VOID
+    )
+
+/*++
+
+Routine Description:
+
+    Initializes the memory descriptor pool.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    None.
+
+--*/
+
+{
+    MmGlobalMemoryDescriptors = MmStaticMemoryDescriptors;
+    MmGlobalMemoryDescriptorCount = MAX_STATIC_DESCRIPTOR_COUNT;
+    MmGlobalMemoryDescriptorsUsed = 0;
+    InitializeListHead(&MmFreeGlobalMemoryDescriptorsList);
+    MmFreeGlobalMemoryDescriptorCount = 0;
+
+    MmDynamicMemoryDescriptors = NULL;
+    MmDynamicMemoryDescriptorCount = 0;
+    MmDynamicMemoryDescriptorsUsed = 0;
+    InitializeListHead(&MmMemoryDescriptorSlabs);
+    MmDynamicMemoryDescriptorsEnabled = FALSE;
+
+    InitializeListHead(&MmMemoryDescriptorLists);
+}
+
+VOID
+MmMdInitializeList (
+    IN PMEMORY_DESCRIPTOR_LIST     Mdl,
+    IN MEMORY_DESCRIPTOR_LIST_TYPE Type,
+    IN PLIST_ENTRY                 ListHead
+    )
+
+/*++
+
+Routine Description:
+
+    Initializes an empty MDL.
+
+Arguments:
+
+    Mdl - Pointer to the MDL.
+
+    Type - The type of addresses described by the MDL.
+
+    ListHead - Pointer to the list head that holds the MDL's descriptors.
+
+Return Value:
+
+    None.
+
+--*/
+
+{
+    //
+    // The descriptor pool keeps track of the MDL so its descriptors can
+    // be migrated. Mdl must stay valid until the memory manager is destroyed.
+    //
+    InsertTailList(&MmMemoryDescriptorLists, &Mdl->ListEntry);
+
+    InitializeListHead(ListHead);
+    Mdl->Head = ListHead;
+    Mdl->Current = NULL;
+    Mdl->Type = Type;
+    Mdl->IndexRoot = NULL;
+    Mdl->DescriptorCount = 0;
+}
+
+PMEMORY_DESCRIPTOR
+MmMdInitDescriptor (
+    IN ULONG_PTR   FirstPage,
+    IN ULONG_PTR   VirtualFirstPage,
+    IN ULONG_PTR   PageCount,
+    IN ULONG       Attributes,
+    IN MEMORY_TYPE MemoryType
+    )
+
+/*++
+
+Routine Description:
+
+    Allocates and initializes a memory descriptor.
+
+Arguments:
+
+    FirstPage - The first page described.
+
+    VirtualFirstPage - The virtual address of the first page, or 0.
+
+    PageCount - The number of pages described.
+
+    Attributes - The memory attributes of the pages.
+
+    MemoryType - The memory type of the pages.
+
+Return Value:
+
+    Pointer to the descriptor if successful.
+
+    NULL if no descriptors are available.
+
+--*/
+
+{
+    PMEMORY_DESCRIPTOR Descriptor;
+
+    //
+    // Reuse a freed descriptor if possible, then fall back to the current
+    // dynamic slab and finally the static array.
+    //
+    if (!IsListEmpty(&MmFreeGlobalMemoryDescriptorsList)) {
+        Descriptor = CONTAINING_RECORD(RemoveHeadList(&MmFreeGlobalMemoryDescriptorsList), MEMORY_DESCRIPTOR, ListEntry);
+        MmFreeGlobalMemoryDescriptorCount--;
+    } else if (MmDynamicMemoryDescriptorsUsed < MmDynamicMemoryDescriptorCount) {
+        Descriptor = &MmDynamicMemoryDescriptors[MmDynamicMemoryDescriptorsUsed++];
+    } else if (MmGlobalMemoryDescriptorsUsed < MmGlobalMemoryDescriptorCount) {
+        Descriptor = &MmGlobalMemoryDescriptors[MmGlobalMemoryDescriptorsUsed++];
+    } else {
+        DebugError(L"Out of memory descriptors\r\n");
+        return NULL;
+    }
+
+    Descriptor->FirstPage = FirstPage;
+    Descriptor->VirtualFirstPage = VirtualFirstPage;
+    Descriptor->PageCount = PageCount;
+    Descriptor->Attributes = Attributes;
+    Descriptor->MemoryType = MemoryType;
+    return Descriptor;
+}
+
+BOOLEAN
+MmMdCanInitDescriptors (
+    IN ULONG Count
+    )
+
+/*++
+
+Routine Description:
+
+    Checks whether a number of descriptors can be allocated.
+
+    Callers that must not fail part way through changing several MDLs
+    check this first.
+
+Arguments:
+
+    Count - The number of descriptors needed.
+
+Return Value:
+
+    TRUE if Count descriptors are available.
+
+    FALSE otherwise.
+
+--*/
+
+{
+    ULONG Available;
+
+    Available = MmFreeGlobalMemoryDescriptorCount
+                + (MmDynamicMemoryDescriptorCount - MmDynamicMemoryDescriptorsUsed)
+                + (MmGlobalMemoryDescriptorCount - MmGlobalMemoryDescriptorsUsed);
+    return Available >= Count;
+}
+
+VOID
+MmMdpIndexUpdate (
+    IN PMEMORY_DESCRIPTOR Node
+    )
+
+/*++
+
+Routine Description:
+
+    Recomputes the largest page count in an index subtree.
+
+Arguments:
+
+    Node - Pointer to the subtree root.
+
+Return Value:
+
+    None.
+
+--*/
+
+{
+    ULONG_PTR Largest;
+
+    Largest = Node->PageCount;
+    if (Node->IndexLeft != NULL && Node->IndexLeft->IndexLargestPageCount > Largest) {
+        Largest = Node->IndexLeft->IndexLargestPageCount;
+    }
+
+    if (Node->IndexRight != NULL && Node->IndexRight->IndexLargestPageCount > Largest) {
+        Largest = Node->IndexRight->IndexLargestPageCount;
+    }
+
+    Node->IndexLargestPageCount = Largest;
+}
+
+PMEMORY_DESCRIPTOR
+MmMdpIndexInsert (
+    IN PMEMORY_DESCRIPTOR Root,
+    IN PMEMORY_DESCRIPTOR Descriptor
+    )
+
+/*++
+
+Routine Description:
+
+    Inserts a descriptor into an index subtree.
+
+Arguments:
+
+    Root - Pointer to the subtree root, or NULL.
+
+    Descriptor - Pointer to the descriptor to insert.
+
+Return Value:
+
+    Pointer to the new subtree root.
+
+--*/
+
+{
+    PMEMORY_DESCRIPTOR Child;
+
+    if (Root == NULL) {
+        Descriptor->IndexLeft = NULL;
+        Descriptor->IndexRight = NULL;
+        MmMdpIndexUpdate(Descriptor);
+        return Descriptor;
+    }
+
+    //
+    // Insert below Root, then rotate the child up if it has the higher priority.
+    //
+    if (Descriptor->FirstPage < Root->FirstPage) {
+        Root->IndexLeft = MmMdpIndexInsert(Root->IndexLeft, Descriptor);
+        if (Root->IndexLeft->IndexPriority > Root->IndexPriority) {
+            Child = Root->IndexLeft;
+            Root->IndexLeft = Child->IndexRight;
+            Child->IndexRight = Root;
+            MmMdpIndexUpdate(Root);
+            Root = Child;
+        }
+    } else {
+        Root->IndexRight = MmMdpIndexInsert(Root->IndexRight, Descriptor);
+        if (Root->IndexRight->IndexPriority > Root->IndexPriority) {
+            Child = Root->IndexRight;
+            Root->IndexRight = Child->IndexLeft;
+            Child->IndexLeft = Root;
+            MmMdpIndexUpdate(Root);
+            Root = Child;
+        }
+    }
+
+    MmMdpIndexUpdate(Root);
+    return Root;
+}
+
+PMEMORY_DESCRIPTOR
+MmMdpIndexMerge (
+    IN PMEMORY_DESCRIPTOR Left,
+    IN PMEMORY_DESCRIPTOR Right
+    )
+
+/*++
+
+Routine Description:
+
+    Joins two index subtrees.
+
+Arguments:
+
+    Left - Pointer to the lower subtree, or NULL.
+
+    Right - Pointer to the higher subtree, or NULL.
+
+Return Value:
+
+    Pointer to the joined subtree root.
+
+--*/
+
+{
+    if (Left == NULL) {
+        return Right;
+    }
+
+    if (Right == NULL) {
+        return Left;
+    }
+
+    if (Left->IndexPriority > Right->IndexPriority) {
+        Left->IndexRight = MmMdpIndexMerge(Left->IndexRight, Right);
+        MmMdpIndexUpdate(Left);
+        return Left;
+    }
+
+    Right->IndexLeft = MmMdpIndexMerge(Left, Right->IndexLeft);
+    MmMdpIndexUpdate(Right);
+    return Right;
+}
+
+PMEMORY_DESCRIPTOR
+MmMdpIndexRemove (
+    IN PMEMORY_DESCRIPTOR Root,
+    IN PMEMORY_DESCRIPTOR Descriptor
+    )
+
+/*++
+
+Routine Description:
+
+    Removes a descriptor from an index subtree.
+
+Arguments:
+
+    Root - Pointer to the subtree root.
+
+    Descriptor - Pointer to the descriptor to remove.
+
+Return Value:
+
+    Pointer to the new subtree root.
+
+--*/
+
+{
+    if (Root == Descriptor) {
+        return MmMdpIndexMerge(Root->IndexLeft, Root->IndexRight);
+    }
+
+    if (Descriptor->FirstPage < Root->FirstPage) {
+        Root->IndexLeft = MmMdpIndexRemove(Root->IndexLeft, Descriptor);
+    } else {
+        Root->IndexRight = MmMdpIndexRemove(Root->IndexRight, Descriptor);
+    }
+
+    MmMdpIndexUpdate(Root);
+    return Root;
+}
+
+VOID
+MmMdpIndexRefresh (
+    IN PMEMORY_DESCRIPTOR Root,
+    IN PMEMORY_DESCRIPTOR Descriptor
+    )
+
+/*++
+
+Routine Description:
+
+    Recomputes the index data on the path to a descriptor.
+
+Arguments:
+
+    Root - Pointer to the subtree root.
+
+    Descriptor - Pointer to the descriptor.
+
+Return Value:
+
+    None.
+
+--*/
+
+{
+    if (Root != Descriptor) {
+        MmMdpIndexRefresh(Descriptor->FirstPage < Root->FirstPage ? Root->IndexLeft : Root->IndexRight, Descriptor);
+    }
+
+    MmMdpIndexUpdate(Root);
+}
+
+PMEMORY_DESCRIPTOR
+MmMdpIndexFindFloor (
+    IN PMEMORY_DESCRIPTOR_LIST Mdl,
+    IN ULONG_PTR               Page
+    )
+
+/*++
+
+Routine Description:
+
+    Finds the last descriptor in a MDL that starts at or below a page.
+
+Arguments:
+
+    Mdl - Pointer to the MDL.
+
+    Page - The page to look up.
+
+Return Value:
+
+    Pointer to the descriptor if found.
+
+    NULL if every descriptor in Mdl starts above Page.
+
+--*/
+
+{
+    PMEMORY_DESCRIPTOR Node, Floor;
+
+    MmMdIndexLookups++;
+    Floor = NULL;
+    Node = Mdl->IndexRoot;
+    while (Node != NULL) {
+        MmMdIndexSteps++;
+        if (Node->FirstPage <= Page) {
+            Floor = Node;
+            Node = Node->IndexRight;
+        } else {
+            Node = Node->IndexLeft;
+        }
+    }
+
+    return Floor;
+}
+
+BOOLEAN
+MmMdpCanCoalesce (
+    IN PMEMORY_DESCRIPTOR Lower,
+    IN PMEMORY_DESCRIPTOR Upper
+    )
+
+/*++
+
+Routine Description:
+
+    Checks if two descriptors can be merged into one.
+
+Arguments:
+
+    Lower - Pointer to the lower descriptor.
+
+    Upper - Pointer to the upper descriptor.
+
+Return Value:
+
+    TRUE if Upper directly follows Lower and both describe the same kind
+    of memory.
+
+    FALSE otherwise.
+
+--*/
+
+{
+    if (Lower->FirstPage + Lower->PageCount != Upper->FirstPage
+        || Lower->MemoryType != Upper->MemoryType
+        || Lower->Attributes != Upper->Attributes) {
+        return FALSE;
+    }
+
+    //
+    // Mapped descriptors must also be virtually contiguous.
+    //
+    if (Lower->VirtualFirstPage == 0 && Upper->VirtualFirstPage == 0) {
+        return TRUE;
+    }
+
+    return Lower->VirtualFirstPage != 0 && Lower->VirtualFirstPage + Lower->PageCount == Upper->VirtualFirstPage;
+}
+
+PMEMORY_DESCRIPTOR
+MmMdCoalesceDescriptor (
+    IN PMEMORY_DESCRIPTOR_LIST Mdl,
+    IN PMEMORY_DESCRIPTOR      Descriptor
+    )
+
+/*++
+
+Routine Description:
+
+    Merges a descriptor with its neighbours in a MDL where possible.
+
+Arguments:
+
+    Mdl - Pointer to the MDL.
+
+    Descriptor - Pointer to the descriptor.
+
+Return Value:
+
+    Pointer to the descriptor that now covers Descriptor's pages.
+
+--*/
+
+{
+    PMEMORY_DESCRIPTOR Neighbour;
+
+    //
+    // Absorb the following descriptor.
+    //
+    if (Descriptor->ListEntry.Flink != Mdl->Head) {
+        Neighbour = CONTAINING_RECORD(Descriptor->ListEntry.Flink, MEMORY_DESCRIPTOR, ListEntry);
+        if (MmMdpCanCoalesce(Descriptor, Neighbour)) {
+            Descriptor->PageCount += Neighbour->PageCount;
+            MmMdRemoveDescriptorFromList(Mdl, Neighbour);
+            MmMdFreeDescriptor(Neighbour);
+            MmMdUpdateDescriptor(Mdl, Descriptor);
+        }
+    }
+
+    //
+    // Fold into the preceding descriptor.
+    //
+    if (Descriptor->ListEntry.Blink != Mdl->Head) {
+        Neighbour = CONTAINING_RECORD(Descriptor->ListEntry.Blink, MEMORY_DESCRIPTOR, ListEntry);
+        if (MmMdpCanCoalesce(Neighbour, Descriptor)) {
+            Neighbour->PageCount += Descriptor->PageCount;
+            MmMdRemoveDescriptorFromList(Mdl, Descriptor);
+            MmMdFreeDescriptor(Descriptor);
+            MmMdUpdateDescriptor(Mdl, Neighbour);
+            Descriptor = Neighbour;
+        }
+    }
+
+    return Descriptor;
+}
+
+ULONG
+MmMdCompactList (
+    IN PMEMORY_DESCRIPTOR_LIST Mdl
+    )
+
+/*++
+
+Routine Description:
+
+    Merges every run of adjacent, compatible descriptors in a MDL.
+
+Arguments:
+
+    Mdl - Pointer to the MDL.
+
+Return Value:
+
+    The number of descriptors released.
+
+--*/
+
+{
+    ULONG Count;
+    PLIST_ENTRY Entry;
+    PMEMORY_DESCRIPTOR Descriptor, Next;
+
+    Count = 0;
+    Entry = Mdl->Head->Flink;
+    while (Entry != Mdl->Head) {
+        Descriptor = CONTAINING_RECORD(Entry, MEMORY_DESCRIPTOR, ListEntry);
+        while (Descriptor->ListEntry.Flink != Mdl->Head) {
+            Next = CONTAINING_RECORD(Descriptor->ListEntry.Flink, MEMORY_DESCRIPTOR, ListEntry);
+            if (!MmMdpCanCoalesce(Descriptor, Next)) {
+                break;
+            }
+
+            Descriptor->PageCount += Next->PageCount;
+            MmMdRemoveDescriptorFromList(Mdl, Next);
+            MmMdFreeDescriptor(Next);
+            Count++;
+        }
+
+        MmMdUpdateDescriptor(Mdl, Descriptor);
+        Entry = Descriptor->ListEntry.Flink;
+    }
+
+    return Count;
+}
+
+VOID
+MmMdAddDescriptorToList (
+    IN PMEMORY_DESCRIPTOR_LIST Mdl,
+    IN PMEMORY_DESCRIPTOR      Descriptor,
+    IN ULONG                   Flags
+    )
+
+/*++
+
+Routine Description:
+
+    Inserts a descriptor into a MDL, keeping it ordered by first page.
+
+Arguments:
+
+    Mdl - Pointer to the MDL.
+
+    Descriptor - Pointer to the descriptor. It must not overlap any
+        descriptor already in Mdl.
+
+    Flags - MM_MD_FLAG_COALESCE to merge the descriptor with its
+        neighbours. Descriptor may be freed in that case.
+
+Return Value:
+
+    None.
+
+--*/
+
+{
+    PMEMORY_DESCRIPTOR Previous;
+
+    //
+    // Link the descriptor in after its predecessor.
+    //
+    Previous = MmMdpIndexFindFloor(Mdl, Descriptor->FirstPage);
+    if (Previous != NULL) {
+        InsertHeadList(&Previous->ListEntry, &Descriptor->ListEntry);
+    } else {
+        InsertHeadList(Mdl->Head, &Descriptor->ListEntry);
+    }
+
+    MmMdIndexSeed ^= MmMdIndexSeed << 13;
+    MmMdIndexSeed ^= MmMdIndexSeed >> 17;
+    MmMdIndexSeed ^= MmMdIndexSeed << 5;
+    Descriptor->IndexPriority = MmMdIndexSeed;
+    Mdl->IndexRoot = MmMdpIndexInsert(Mdl->IndexRoot, Descriptor);
+    Mdl->DescriptorCount++;
+
+    if (CHECK_FLAG(Flags, MM_MD_FLAG_COALESCE)) {
+        MmMdCoalesceDescriptor(Mdl, Descriptor);
+    }
+}
+
+VOID
+MmMdUpdateDescriptor (
+    IN PMEMORY_DESCRIPTOR_LIST Mdl,
+    IN PMEMORY_DESCRIPTOR      Descriptor
+    )
+
+/*++
+
+Routine Description:
+
+    Updates a MDL's index after a descriptor in it was resized.
+
+Arguments:
+
+    Mdl - Pointer to the MDL.
+
+    Descriptor - Pointer to the descriptor. Its first page may have changed,
+        but it must not have moved past any other descriptor in Mdl.
+
+Return Value:
+
+    None.
+
+--*/
+
+{
+    MmMdpIndexRefresh(Mdl->IndexRoot, Descriptor);
+}
 
 VOID
 MmMdRemoveDescriptorFromList (
     IN PMEMORY_DESCRIPTOR_LIST Mdl,
-    IN PMEMORY_DESCRIPTOR      Descriptor
+    IN PMEMORY_DESCRIPTOR      Descriptor
+    )
+
+/*++
+
+Routine Description:
+
+    Removes a descriptor from a MDL.
+
+Arguments:
+
+    Mdl - Pointer to the MDL to remove Descriptor from.
+
+    Descriptor - Pointer to the descriptor to remove from Mdl.
+
+Return Value:
+
+    None.
+
+--*/
+
+{
+    Mdl->IndexRoot = MmMdpIndexRemove(Mdl->IndexRoot, Descriptor);
+    Mdl->DescriptorCount--;
+    RemoveEntryList(&Descriptor->ListEntry);
+
+    if (Mdl->Current == &Descriptor->ListEntry) {
+        Mdl->Current = NULL;
+    }
+}
+
+PMEMORY_DESCRIPTOR
+MmMdFindDescriptor (
+    IN PMEMORY_DESCRIPTOR_LIST Mdl,
+    IN ULONG_PTR               Page
+    )
+
+/*++
+
+Routine Description:
+
+    Finds the descriptor in a MDL that contains a page.
+
+Arguments:
+
+    Mdl - Pointer to the MDL.
+
+    Page - The page to look up.
+
+Return Value:
+
+    Pointer to the descriptor if found.
+
+    NULL if no descriptor in Mdl contains Page.
+
+--*/
+
+{
+    PMEMORY_DESCRIPTOR Descriptor;
+
+    Descriptor = MmMdpIndexFindFloor(Mdl, Page);
+    if (Descriptor == NULL || Page - Descriptor->FirstPage >= Descriptor->PageCount) {
+        return NULL;
+    }
+
+    return Descriptor;
+}
+
+PMEMORY_DESCRIPTOR
+MmMdpFindFirstFit (
+    IN  PMEMORY_DESCRIPTOR Node,
+    IN  ULONG_PTR          PageCount,
+    IN  ULONG_PTR          MinimumPage,
+    IN  ULONG_PTR          LimitPage,
+    IN  ULONG_PTR          Alignment,
+    OUT ULONG_PTR          *FirstPage
+    )
+
+/*++
+
+Routine Description:
+
+    Searches an index subtree for the lowest run of pages within a range.
+
+Arguments:
+
+    Node - Pointer to the subtree root, or NULL.
+
+    PageCount - The number of pages needed.
+
+    MinimumPage - The lowest page that may be used.
+
+    LimitPage - The page above the highest page that may be used.
+
+    Alignment - The alignment of the first page of the run, in pages.
+        Must be a power of two.
+
+    FirstPage - Pointer to a ULONG_PTR that receives the first page of the run.
+
+Return Value:
+
+    Pointer to the descriptor containing the run if found.
+
+    NULL if no run was found.
+
+--*/
+
+{
+    ULONG_PTR Start, End;
+    PMEMORY_DESCRIPTOR Descriptor;
+
+    while (Node != NULL && Node->IndexLargestPageCount >= PageCount) {
+        MmMdIndexSteps++;
+
+        //
+        // Nothing at or above this node is low enough.
+        //
+        if (Node->FirstPage >= LimitPage) {
+            Node = Node->IndexLeft;
+            continue;
+        }
+
+        //
+        // Lower descriptors are preferred, but only those that end above
+        // the minimum can hold the run.
+        //
+        if (Node->FirstPage > MinimumPage) {
+            Descriptor = MmMdpFindFirstFit(Node->IndexLeft, PageCount, MinimumPage, LimitPage, Alignment, FirstPage);
+            if (Descriptor != NULL) {
+                return Descriptor;
+            }
+        }
+
+        Start = ALIGN_UP(Node->FirstPage > MinimumPage ? Node->FirstPage : MinimumPage, Alignment);
+        End = Node->FirstPage + Node->PageCount;
+        if (End > LimitPage) {
+            End = LimitPage;
+        }
+
+        if (End > Start && End - Start >= PageCount) {
+            *FirstPage = Start;
+            return Node;
+        }
+
+        Node = Node->IndexRight;
+    }
+
+    return NULL;
+}
+
+PMEMORY_DESCRIPTOR
+MmMdFindFirstFit (
+    IN  PMEMORY_DESCRIPTOR_LIST Mdl,
+    IN  ULONG_PTR               PageCount,
+    IN  ULONG_PTR               MinimumPage,
+    IN  ULONG_PTR               LimitPage,
+    IN  ULONG_PTR               Alignment,
+    OUT ULONG_PTR               *FirstPage
+    )
+
+/*++
+
+Routine Description:
+
+    Finds the lowest run of pages in a MDL that lies within a range.
+
+Arguments:
+
+    Mdl - Pointer to the MDL to search.
+
+    PageCount - The number of pages needed.
+
+    MinimumPage - The lowest page that may be used.
+
+    LimitPage - The page above the highest page that may be used.
+
+    Alignment - The alignment of the first page of the run, in pages.
+        Must be a power of two.
+
+    FirstPage - Pointer to a ULONG_PTR that receives the first page of the run.
+
+Return Value:
+
+    Pointer to the descriptor containing the run if found.
+
+    NULL if no run was found.
+
+--*/
+
+{
+    MmMdIndexLookups++;
+    return MmMdpFindFirstFit(Mdl->IndexRoot, PageCount, MinimumPage, LimitPage, Alignment, FirstPage);
+}
+
+NTSTATUS
+MmMdRemoveRegionFromList (
+    IN PMEMORY_DESCRIPTOR_LIST Mdl,
+    IN ULONG_PTR               FirstPage,
+    IN ULONG_PTR               PageCount
     )
 
 /*++
 
 Routine Description:
 
-    Removes a descriptor from a MDL.
+    Removes a range of pages from a MDL, trimming and splitting
+    descriptors as needed. Pages in the range that are not described
+    by Mdl are ignored.
 
 Arguments:
 
-    Mdl - Pointer to the MDL to remove Descriptor from.
+    Mdl - Pointer to the MDL.
 
-    Descriptor - Pointer to the descriptor to remove from Mdl.
+    FirstPage - The first page to remove.
+
+    PageCount - The number of pages to remove.
+
+Return Value:
+
+    STATUS_SUCCESS if successful.
+
+    STATUS_NO_MEMORY if a descriptor had to be split and no descriptors
+    are available. Mdl is left unchanged in that case.
+
+--*/
+
+{
+    ULONG_PTR EndPage, DescriptorEnd;
+    PLIST_ENTRY Entry;
+    PMEMORY_DESCRIPTOR Descriptor, NewDescriptor;
+
+    EndPage = FirstPage + PageCount;
+    Descriptor = MmMdpIndexFindFloor(Mdl, FirstPage);
+    Entry = Descriptor != NULL ? &Descriptor->ListEntry : Mdl->Head->Flink;
+    while (Entry != Mdl->Head) {
+        Descriptor = CONTAINING_RECORD(Entry, MEMORY_DESCRIPTOR, ListEntry);
+        Entry = Entry->Flink;
+
+        DescriptorEnd = Descriptor->FirstPage + Descriptor->PageCount;
+        if (DescriptorEnd <= FirstPage) {
+            continue;
+        }
+
+        if (Descriptor->FirstPage >= EndPage) {
+            break;
+        }
+
+        //
+        // Split the descriptor around the range.
+        // This is only possible when the range lies within one descriptor.
+        //
+        if (Descriptor->FirstPage < FirstPage && DescriptorEnd > EndPage) {
+            NewDescriptor = MmMdInitDescriptor(
+                EndPage,
+                Descriptor->VirtualFirstPage != 0 ? Descriptor->VirtualFirstPage + (EndPage - Descriptor->FirstPage) : 0,
+                DescriptorEnd - EndPage,
+                Descriptor->Attributes,
+                Descriptor->MemoryType
+            );
+            if (NewDescriptor == NULL) {
+                return STATUS_NO_MEMORY;
+            }
+
+            Descriptor->PageCount = FirstPage - Descriptor->FirstPage;
+            MmMdUpdateDescriptor(Mdl, Descriptor);
+            MmMdAddDescriptorToList(Mdl, NewDescriptor, 0);
+            break;
+        }
+
+        //
+        // Trim the end of a descriptor that starts before the range.
+        //
+        if (Descriptor->FirstPage < FirstPage) {
+            Descriptor->PageCount = FirstPage - Descriptor->FirstPage;
+            MmMdUpdateDescriptor(Mdl, Descriptor);
+            continue;
+        }
+
+        //
+        // Trim the start of a descriptor that ends after the range.
+        //
+        if (DescriptorEnd > EndPage) {
+            if (Descriptor->VirtualFirstPage != 0) {
+                Descriptor->VirtualFirstPage += EndPage - Descriptor->FirstPage;
+            }
+
+            Descriptor->FirstPage = EndPage;
+            Descriptor->PageCount = DescriptorEnd - EndPage;
+            MmMdUpdateDescriptor(Mdl, Descriptor);
+            break;
+        }
+
+        //
+        // Drop descriptors inside the range.
+        //
+        MmMdRemoveDescriptorFromList(Mdl, Descriptor);
+        MmMdFreeDescriptor(Descriptor);
+    }
+
+    return STATUS_SUCCESS;
+}
+
+BOOLEAN
+MmMdpIsStaticDescriptor (
+    IN PMEMORY_DESCRIPTOR Descriptor
+    )
+
+/*++
+
+Routine Description:
+
+    Checks if a descriptor belongs to the static array.
+
+Arguments:
+
+    Descriptor - Pointer to the descriptor.
+
+Return Value:
+
+    TRUE if Descriptor is in the static array.
+
+    FALSE otherwise.
+
+--*/
+
+{
+    return (ULONG_PTR)Descriptor >= (ULONG_PTR)MmStaticMemoryDescriptors
+           && (ULONG_PTR)Descriptor < (ULONG_PTR)&MmStaticMemoryDescriptors[MAX_STATIC_DESCRIPTOR_COUNT];
+}
+
+BOOLEAN
+MmMdpIsPoolDescriptor (
+    IN PMEMORY_DESCRIPTOR Descriptor
+    )
+
+/*++
+
+Routine Description:
+
+    Checks if a descriptor belongs to the static array or a dynamic slab.
+
+Arguments:
+
+    Descriptor - Pointer to the descriptor.
 
 Return Value:
 
+    TRUE if Descriptor is a pool descriptor.
+
+    FALSE if Descriptor was allocated from the heap.
+
+--*/
+
+{
+    PLIST_ENTRY Entry;
+    PMM_MEMORY_DESCRIPTOR_SLAB Slab;
+
+    if (MmMdpIsStaticDescriptor(Descriptor)) {
+        return TRUE;
+    }
+
+    Entry = MmMemoryDescriptorSlabs.Flink;
+    while (Entry != &MmMemoryDescriptorSlabs) {
+        Slab = CONTAINING_RECORD(Entry, MM_MEMORY_DESCRIPTOR_SLAB, ListEntry);
+        if ((ULONG_PTR)Descriptor >= (ULONG_PTR)Slab->Descriptors
+            && (ULONG_PTR)Descriptor < (ULONG_PTR)&Slab->Descriptors[Slab->DescriptorCount]) {
+            return TRUE;
+        }
+
+        Entry = Entry->Flink;
+    }
+
+    return FALSE;
+}
+
+NTSTATUS
+MmMdpGrowDynamicDescriptors (
+    VOID
+    )
+
+/*++
+
+Routine Description:
+
+    Allocates a new slab of dynamic descriptors and makes it current.
+
+Arguments:
+
     None.
 
+Return Value:
+
+    STATUS_SUCCESS if successful.
+
+    Any other status value returned by MmPapAllocatePagesInRange.
+
 --*/
 
 {
-    PLIST_ENTRY Previous;
+    NTSTATUS Status;
+    PMM_MEMORY_DESCRIPTOR_SLAB Slab;
 
-    Previous = Descriptor->ListEntry.Blink;
-    RemoveEntryList(&Descriptor->ListEntry);
+    Slab = NULL;
+    Status = MmPapAllocatePagesInRange((PVOID *)&Slab, MM_DESCRIPTOR_SLAB_PAGES, MEMORY_TYPE_DESCRIPTOR_POOL, 0, NULL, 0);
+    if (!NT_SUCCESS(Status)) {
+        return Status;
+    }
 
     //
-    // Check if the removed descriptor was cached.
+    // Hand what is left of the previous slab to the free list.
     //
-    if (Mdl->Current != &Descriptor->ListEntry) {
-        return;
+    while (MmDynamicMemoryDescriptorsUsed < MmDynamicMemoryDescriptorCount) {
+        InsertHeadList(&MmFreeGlobalMemoryDescriptorsList, &MmDynamicMemoryDescriptors[MmDynamicMemoryDescriptorsUsed++].ListEntry);
+        MmFreeGlobalMemoryDescriptorCount++;
     }
 
-    //
-    // Cache the previous descriptor if possible.
-    //
-    if (((ULONG_PTR)Previous < (ULONG_PTR)MmGlobalMemoryDescriptors
-         || (ULONG_PTR)Previous >= (ULONG_PTR)&MmGlobalMemoryDescriptors[MmGlobalMemoryDescriptorCount])
-        && Previous != Mdl->Head) {
-        Mdl->Current = Previous;
-    } else {
-        Mdl->Current = NULL;
+    Slab->PageCount = MM_DESCRIPTOR_SLAB_PAGES;
+    Slab->DescriptorCount = (MM_DESCRIPTOR_SLAB_PAGES * PAGE_SIZE - FIELD_OFFSET(MM_MEMORY_DESCRIPTOR_SLAB, Descriptors)) / sizeof(MEMORY_DESCRIPTOR);
+    RtlZeroMemory(Slab->Descriptors, Slab->DescriptorCount * sizeof(MEMORY_DESCRIPTOR));
+    InsertTailList(&MmMemoryDescriptorSlabs, &Slab->ListEntry);
+
+    MmDynamicMemoryDescriptors = Slab->Descriptors;
+    MmDynamicMemoryDescriptorCount = Slab->DescriptorCount;
+    MmDynamicMemoryDescriptorsUsed = 0;
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS
+MmMdReserveDescriptors (
+    IN ULONG Count
+    )
+
+/*++
+
+Routine Description:
+
+    Grows the descriptor pool until a number of descriptors are available.
+
+    Callers that change many descriptors inside one call tree reserve
+    them first, since the pool only grows at base level.
+
+Arguments:
+
+    Count - The number of descriptors needed.
+
+Return Value:
+
+    STATUS_SUCCESS if Count descriptors are available.
+
+    STATUS_NO_MEMORY if the pool cannot grow and too few are available.
+
+    Any other status value returned by MmPapAllocatePagesInRange.
+
+--*/
+
+{
+    NTSTATUS Status;
+
+    while (!MmMdCanInitDescriptors(Count)) {
+        if (!MmDynamicMemoryDescriptorsEnabled) {
+            return STATUS_NO_MEMORY;
+        }
+
+        Status = MmMdpGrowDynamicDescriptors();
+        if (!NT_SUCCESS(Status)) {
+            return Status;
+        }
+    }
+
+    return STATUS_SUCCESS;
+}
+
+VOID
+MmMdpPurgeStaticDescriptors (
+    VOID
+    )
+
+/*++
+
+Routine Description:
+
+    Removes static descriptors from the free list.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    None.
+
+--*/
+
+{
+    PLIST_ENTRY Entry;
+    PMEMORY_DESCRIPTOR Descriptor;
+
+    Entry = MmFreeGlobalMemoryDescriptorsList.Flink;
+    while (Entry != &MmFreeGlobalMemoryDescriptorsList) {
+        Descriptor = CONTAINING_RECORD(Entry, MEMORY_DESCRIPTOR, ListEntry);
+        Entry = Entry->Flink;
+        if (MmMdpIsStaticDescriptor(Descriptor)) {
+            RemoveEntryList(&Descriptor->ListEntry);
+            MmFreeGlobalMemoryDescriptorCount--;
+        }
     }
 }
 
@@ -97,23 +1249,12 @@ Return Value:
 
 {
     //
-    // Free descriptor from static/dynamic MDL.
+    // Return pool descriptors to the free list.
     //
-    if ((MmDynamicMemoryDescriptors != NULL
-         && (ULONG_PTR)Descriptor >= (ULONG_PTR)MmDynamicMemoryDescriptors
-         && (ULONG_PTR)Descriptor < (ULONG_PTR)&MmDynamicMemoryDescriptors[MmDynamicMemoryDescriptorCount])
-        || ((ULONG_PTR)Descriptor >= (ULONG_PTR)MmStaticMemoryDescriptors
-            && (ULONG_PTR)Descriptor < (ULONG_PTR)&MmStaticMemoryDescriptors[MAX_STATIC_DESCRIPTOR_COUNT])) {
-        //
-        // Clear from static/dynamic MDL.
-        //
+    if (MmMdpIsPoolDescriptor(Descriptor)) {
         RtlZeroMemory(Descriptor, sizeof(*Descriptor));
-
-        //
-        // Add to free list.
-        //
         InsertHeadList(&MmFreeGlobalMemoryDescriptorsList, &Descriptor->ListEntry);
-
+        MmFreeGlobalMemoryDescriptorCount++;
         return STATUS_SUCCESS;
     }
 
@@ -151,10 +1292,18 @@ Return Value:
     Entry = Mdl->Head->Flink;
     while (Entry != Mdl->Head) {
         Descriptor = CONTAINING_RECORD(Entry, MEMORY_DESCRIPTOR, ListEntry);
-        MmMdRemoveDescriptorFromList(Mdl, Descriptor);
-        MmMdFreeDescriptor(Descriptor);
         Entry = Entry->Flink;
+        MmMdFreeDescriptor(Descriptor);
     }
+
+    //
+    // The whole list is gone, so there is no need to unlink descriptors
+    // from the index one at a time.
+    //
+    InitializeListHead(Mdl->Head);
+    Mdl->Current = NULL;
+    Mdl->IndexRoot = NULL;
+    Mdl->DescriptorCount = 0;
 }
 
 VOID
@@ -179,6 +1328,10 @@ Return Value:
 --*/
 
 {
+    PLIST_ENTRY MdlEntry, Entry;
+    PMEMORY_DESCRIPTOR_LIST Mdl;
+    PMEMORY_DESCRIPTOR Descriptor, NewDescriptor;
+
     //
     // Only free descriptors if executing at base level.
     //
@@ -186,10 +1339,104 @@ Return Value:
         return;
     }
 
+    if (!MmDynamicMemoryDescriptorsEnabled) {
+        return;
+    }
+
+    if (MmGlobalMemoryDescriptorsUsed == 0
+        && MmFreeGlobalMemoryDescriptorCount + MmDynamicMemoryDescriptorCount - MmDynamicMemoryDescriptorsUsed >= MM_DESCRIPTOR_POOL_RESERVE) {
+        return;
+    }
+
     //
-    // TODO: Finish implementing this routine.
+    // Make sure there are enough dynamic descriptors to replace every
+    // static one in use, plus a reserve for the next call. Growing may
+    // itself use or free static descriptors, so purge the free list again
+    // afterwards.
     //
+    MmMdpPurgeStaticDescriptors();
+    while (MmFreeGlobalMemoryDescriptorCount + MmDynamicMemoryDescriptorCount - MmDynamicMemoryDescriptorsUsed
+           < MmGlobalMemoryDescriptorsUsed + MM_DESCRIPTOR_POOL_RESERVE) {
+        if (!NT_SUCCESS(MmMdpGrowDynamicDescriptors())) {
+            DebugError(L"Failed to grow descriptor pool\r\n");
+            return;
+        }
+    }
+
+    MmMdpPurgeStaticDescriptors();
+    if (MmGlobalMemoryDescriptorsUsed == 0) {
+        return;
+    }
+
+    //
+    // Replace every static descriptor still on a list. The replacement
+    // takes the original's place in both the list and its index.
+    //
+    MdlEntry = MmMemoryDescriptorLists.Flink;
+    while (MdlEntry != &MmMemoryDescriptorLists) {
+        Mdl = CONTAINING_RECORD(MdlEntry, MEMORY_DESCRIPTOR_LIST, ListEntry);
+        MdlEntry = MdlEntry->Flink;
+
+        Entry = Mdl->Head->Flink;
+        while (Entry != Mdl->Head) {
+            Descriptor = CONTAINING_RECORD(Entry, MEMORY_DESCRIPTOR, ListEntry);
+            Entry = Entry->Flink;
+            if (!MmMdpIsStaticDescriptor(Descriptor)) {
+                continue;
+            }
 
+            NewDescriptor = MmMdInitDescriptor(
+                Descriptor->FirstPage,
+                Descriptor->VirtualFirstPage,
+                Descriptor->PageCount,
+                Descriptor->Attributes,
+                Descriptor->MemoryType
+            );
+            MmMdRemoveDescriptorFromList(Mdl, Descriptor);
+            MmMdAddDescriptorToList(Mdl, NewDescriptor, 0);
+        }
+    }
+
+    //
+    // Nothing refers to the static array any more.
+    //
     MmGlobalMemoryDescriptorsUsed = 0;
-    InitializeListHead(&MmFreeGlobalMemoryDescriptorsList);
+}
+
+VOID
+MmMdDestroyDynamicDescriptors (
+    VOID
+    )
+
+/*++
+
+Routine Description:
+
+    Returns every dynamic descriptor slab to the firmware. Any descriptor
+    that still lives in a slab becomes invalid.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    None.
+
+--*/
+
+{
+    PLIST_ENTRY Entry;
+    PMM_MEMORY_DESCRIPTOR_SLAB Slab;
+    ULONG_PTR PageCount;
+
+    Entry = MmMemoryDescriptorSlabs.Flink;
+    while (Entry != &MmMemoryDescriptorSlabs) {
+        Slab = CONTAINING_RECORD(Entry, MM_MEMORY_DESCRIPTOR_SLAB, ListEntry);
+        Entry = Entry->Flink;
+        PageCount = Slab->PageCount;
+        MmFwFreePages((ULONG_PTR)Slab >> PAGE_SHIFT, PageCount);
+    }
+
+    MmMdInitialize();
 }
@@ -15,43 +15,1206 @@ Module Name:
 --*/
 
 #include "mm.h"
-#if defined(_EFI)
-#include "efilib.h"
-#endif
 
+//
+// Physical pages are tracked in three lists. MmMdlFirmwareFree holds the
+// free memory in the firmware memory map; these pages still belong to the
+// firmware. MmMdlUnmappedUnallocated holds pages claimed from the firmware
+// that have not been handed out, and MmMdlUnmappedAllocated holds pages that
+// have. Pages are claimed from the firmware in batches, and freed pages are
+// kept until MmPaDestroy, so most allocations never call the firmware.
+//
+#define MM_FIRMWARE_CLAIM_PAGES 256
+
+//
+// Moving pages between lists takes at most this many new descriptors:
+// one to split the source descriptor and one for the destination.
+//
+#define MM_MOVE_DESCRIPTOR_COUNT 2
+
+//
+// Allocations without a range stay above the first megabyte.
+//
+#define MM_DEFAULT_MINIMUM_PAGE (0x100000 >> PAGE_SHIFT)
+#define MM_PAGE_LIMIT           (((ULONG_PTR)-1 >> PAGE_SHIFT) + 1)
+
+//
+// Physical memory constraints leave at most this many usable windows.
+//
+#define MM_MAX_CONSTRAINT_RANGES 4
+
+LIST_ENTRY MmFirmwareFreeHead, MmUnmappedUnallocatedHead, MmUnmappedAllocatedHead;
+MEMORY_DESCRIPTOR_LIST MmMdlFirmwareFree, MmMdlUnmappedUnallocated, MmMdlUnmappedAllocated;
+BOOLEAN MmFirmwareMapStale;
+
+//
+// Optional free page bitmaps for the large firmware free regions, sorted
+// by first page. Large and aligned requests scan these a word (64 pages)
+// at a time instead of walking descriptors.
+//
+PMM_PAGE_BITMAP MmPageBitmaps;
+ULONG MmPageBitmapCount;
+
+//
+// Pages retired through the BCD bad memory list. They stay claimed from
+// the firmware so that neither boot applications nor the OS are given them.
+//
+LIST_ENTRY MmBadMemoryHead;
+MEMORY_DESCRIPTOR_LIST MmMdlBadMemory;
+ULONGLONG MmBadMemoryPagesRemoved, MmBadMemoryRemovalTime;
+
+//
+// Usable physical page windows left by the BCD memory constraints, sorted
+// and disjoint. Only consulted when MmConstraintsActive is set, so
+// allocations pay nothing when there are no constraints.
+//
+MM_PAGE_RANGE MmConstraintRanges[MM_MAX_CONSTRAINT_RANGES];
+ULONG MmConstraintRangeCount;
+BOOLEAN MmConstraintsActive;
+
+VOID
+MmPapMarkPages (
+    IN ULONG_PTR FirstPage,
+    IN ULONG_PTR PageCount,
+    IN BOOLEAN   Free
+    )
+
+/*++
+
+Routine Description:
+
+    Updates the page bitmaps for a run of pages.
+
+Arguments:
+
+    FirstPage - The first page of the run.
+
+    PageCount - The number of pages in the run.
+
+    Free - TRUE if the pages are now free, FALSE if they are in use.
+
+Return Value:
+
+    None.
+
+--*/
+
+{
+    ULONG_PTR Start, End;
+    PMM_PAGE_BITMAP PageBitmap;
+
+    for (ULONG Index = 0; Index < MmPageBitmapCount; Index++) {
+        PageBitmap = &MmPageBitmaps[Index];
+        Start = FirstPage > PageBitmap->FirstPage ? FirstPage : PageBitmap->FirstPage;
+        End = PageBitmap->FirstPage + PageBitmap->Bitmap.SizeOfBitMap;
+        if (FirstPage + PageCount < End) {
+            End = FirstPage + PageCount;
+        }
+
+        if (Start >= End) {
+            continue;
+        }
+
+        if (Free) {
+            RtlClearBits(&PageBitmap->Bitmap, Start - PageBitmap->FirstPage, End - Start);
+        } else {
+            RtlSetBits(&PageBitmap->Bitmap, Start - PageBitmap->FirstPage, End - Start);
+        }
+    }
+}
+
+VOID
+MmPapRebuildPageBitmaps (
+    VOID
+    )
+
+/*++
+
+Routine Description:
+
+    Recomputes the page bitmaps from the free firmware and unallocated lists.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    None.
+
+--*/
+
+{
+    PLIST_ENTRY Entry;
+    PMEMORY_DESCRIPTOR Descriptor;
+
+    if (MmPageBitmapCount == 0) {
+        return;
+    }
+
+    for (ULONG Index = 0; Index < MmPageBitmapCount; Index++) {
+        RtlSetAllBits(&MmPageBitmaps[Index].Bitmap);
+    }
+
+    Entry = MmMdlFirmwareFree.Head->Flink;
+    while (Entry != MmMdlFirmwareFree.Head) {
+        Descriptor = CONTAINING_RECORD(Entry, MEMORY_DESCRIPTOR, ListEntry);
+        MmPapMarkPages(Descriptor->FirstPage, Descriptor->PageCount, TRUE);
+        Entry = Entry->Flink;
+    }
+
+    Entry = MmMdlUnmappedUnallocated.Head->Flink;
+    while (Entry != MmMdlUnmappedUnallocated.Head) {
+        Descriptor = CONTAINING_RECORD(Entry, MEMORY_DESCRIPTOR, ListEntry);
+        MmPapMarkPages(Descriptor->FirstPage, Descriptor->PageCount, TRUE);
+        Entry = Entry->Flink;
+    }
+}
+
+BOOLEAN
+MmPapFindBitmapRun (
+    IN  ULONG_PTR PageCount,
+    IN  ULONG_PTR MinimumPage,
+    IN  ULONG_PTR LimitPage,
+    IN  ULONG_PTR Alignment,
+    OUT ULONG_PTR *FirstPage
+    )
+
+/*++
+
+Routine Description:
+
+    Finds the lowest free run of pages within a range in the page bitmaps.
+
+Arguments:
+
+    PageCount - The number of pages needed.
+
+    MinimumPage - The lowest page that may be used.
+
+    LimitPage - The page above the highest page that may be used.
+
+    Alignment - The alignment of the first page of the run, in pages.
+
+    FirstPage - Pointer to a ULONG_PTR that receives the first page of the run.
+
+Return Value:
+
+    TRUE if a run was found.
+
+    FALSE otherwise.
+
+--*/
+
+{
+    ULONG_PTR Start, End, Index;
+    PMM_PAGE_BITMAP PageBitmap;
+
+    for (ULONG BitmapIndex = 0; BitmapIndex < MmPageBitmapCount; BitmapIndex++) {
+        PageBitmap = &MmPageBitmaps[BitmapIndex];
+        End = PageBitmap->FirstPage + PageBitmap->Bitmap.SizeOfBitMap;
+        if (PageBitmap->FirstPage >= LimitPage) {
+            break;
+        }
+
+        if (End <= MinimumPage) {
+            continue;
+        }
+
+        Start = MinimumPage > PageBitmap->FirstPage ? MinimumPage - PageBitmap->FirstPage : 0;
+        End = (LimitPage < End ? LimitPage : End) - PageBitmap->FirstPage;
+        Index = RtlFindClearBitsInRange(&PageBitmap->Bitmap, PageCount, Start, End, Alignment, PageBitmap->FirstPage);
+        if (Index != RTL_BITMAP_NOT_FOUND) {
+            *FirstPage = PageBitmap->FirstPage + Index;
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
+NTSTATUS
+MmPapRefreshFirmwareMap (
+    VOID
+    )
+
+/*++
+
+Routine Description:
+
+    Replaces the free firmware memory list with a new memory map snapshot.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    STATUS_SUCCESS if successful.
+
+    Any other status value returned by MmFwGetMemoryMap.
+
+--*/
+
+{
+    NTSTATUS Status;
+
+    MmMdFreeList(&MmMdlFirmwareFree);
+    MmFirmwareMapStale = FALSE;
+    Status = MmFwGetMemoryMap(&MmMdlFirmwareFree);
+    MmPapRebuildPageBitmaps();
+    return Status;
+}
+
+NTSTATUS
+MmPapAddUnallocatedPages (
+    IN ULONG_PTR FirstPage,
+    IN ULONG_PTR PageCount,
+    IN ULONG     Attributes
+    )
+
+/*++
+
+Routine Description:
+
+    Adds pages to the unallocated list, merging them with adjacent
+    descriptors where possible.
+
+Arguments:
+
+    FirstPage - The first page to add.
+
+    PageCount - The number of pages to add.
+
+    Attributes - The memory attributes of the pages.
+
+Return Value:
+
+    STATUS_SUCCESS if successful.
+
+    STATUS_NO_MEMORY if no descriptors are available.
+
+--*/
+
+{
+    PMEMORY_DESCRIPTOR Descriptor;
+
+    Descriptor = MmMdInitDescriptor(FirstPage, 0, PageCount, Attributes, MEMORY_TYPE_FREE);
+    if (Descriptor == NULL) {
+        return STATUS_NO_MEMORY;
+    }
+
+    MmMdAddDescriptorToList(&MmMdlUnmappedUnallocated, Descriptor, MM_MD_FLAG_COALESCE);
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS
+MmPapClaimFirmwarePages (
+    IN ULONG_PTR FirstPage,
+    IN ULONG_PTR PageCount,
+    IN ULONG     Attributes
+    )
+
+/*++
+
+Routine Description:
+
+    Claims free firmware pages and adds them to the unallocated list.
+
+Arguments:
+
+    FirstPage - The first page to claim.
+
+    PageCount - The number of pages to claim.
+
+    Attributes - The memory attributes of the pages.
+
+Return Value:
+
+    STATUS_SUCCESS if successful.
+
+    STATUS_NO_MEMORY if no descriptors are available.
+
+    Any other status value returned by MmFwAllocatePages.
+
+--*/
+
+{
+    NTSTATUS Status;
+
+    if (!MmMdCanInitDescriptors(MM_MOVE_DESCRIPTOR_COUNT)) {
+        return STATUS_NO_MEMORY;
+    }
+
+    Status = MmFwAllocatePages(FirstPage, PageCount);
+    if (!NT_SUCCESS(Status)) {
+        //
+        // The firmware has used these pages since the memory map was taken.
+        //
+        MmFirmwareMapStale = TRUE;
+        return Status;
+    }
+
+    Status = MmMdRemoveRegionFromList(&MmMdlFirmwareFree, FirstPage, PageCount);
+    if (NT_SUCCESS(Status)) {
+        Status = MmPapAddUnallocatedPages(FirstPage, PageCount, Attributes);
+    }
+
+    if (!NT_SUCCESS(Status)) {
+        MmFwFreePages(FirstPage, PageCount);
+        return Status;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS
+MmPapCarvePages (
+    IN ULONG_PTR   FirstPage,
+    IN ULONG_PTR   PageCount,
+    IN MEMORY_TYPE MemoryType
+    )
+
+/*++
+
+Routine Description:
+
+    Moves unallocated pages to the allocated list.
+
+Arguments:
+
+    FirstPage - The first page to allocate. The pages must all be
+        on the unallocated list.
+
+    PageCount - The number of pages to allocate.
+
+    MemoryType - The memory type of the allocation.
+
+Return Value:
+
+    STATUS_SUCCESS if successful.
+
+    STATUS_NO_MEMORY if no descriptors are available.
+
+--*/
+
+{
+    NTSTATUS Status;
+    PMEMORY_DESCRIPTOR Descriptor;
+
+    if (!MmMdCanInitDescriptors(MM_MOVE_DESCRIPTOR_COUNT)) {
+        return STATUS_NO_MEMORY;
+    }
+
+    Descriptor = MmMdFindDescriptor(&MmMdlUnmappedUnallocated, FirstPage);
+    Descriptor = MmMdInitDescriptor(FirstPage, 0, PageCount, Descriptor->Attributes, MemoryType);
+    if (Descriptor == NULL) {
+        return STATUS_NO_MEMORY;
+    }
+
+    Status = MmMdRemoveRegionFromList(&MmMdlUnmappedUnallocated, FirstPage, PageCount);
+    if (!NT_SUCCESS(Status)) {
+        MmMdFreeDescriptor(Descriptor);
+        return Status;
+    }
+
+    MmMdAddDescriptorToList(&MmMdlUnmappedAllocated, Descriptor, MM_MD_FLAG_COALESCE);
+    MmPapMarkPages(FirstPage, PageCount, FALSE);
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS
+MmPapAllocateFixedPages (
+    IN ULONG_PTR   FirstPage,
+    IN ULONG_PTR   PageCount,
+    IN MEMORY_TYPE MemoryType
+    )
+
+/*++
+
+Routine Description:
+
+    Allocates physical pages at a fixed address.
+
+Arguments:
+
+    FirstPage - The first page to allocate.
+
+    PageCount - The number of pages to allocate.
+
+    MemoryType - The memory type of the allocation.
+
+Return Value:
+
+    STATUS_SUCCESS if successful.
+
+    STATUS_NO_MEMORY if any of the pages are in use.
+
+    Any other status value returned by MmPapClaimFirmwarePages.
+
+--*/
+
+{
+    NTSTATUS Status;
+    ULONG_PTR Page, EndPage, ClaimEnd;
+    PMEMORY_DESCRIPTOR Descriptor;
+
+    //
+    // Claim any of the pages that still belong to the firmware.
+    //
+    EndPage = FirstPage + PageCount;
+    Page = FirstPage;
+    while (Page < EndPage) {
+        Descriptor = MmMdFindDescriptor(&MmMdlUnmappedUnallocated, Page);
+        if (Descriptor == NULL) {
+            Descriptor = MmMdFindDescriptor(&MmMdlFirmwareFree, Page);
+            if (Descriptor == NULL) {
+                return STATUS_NO_MEMORY;
+            }
+
+            ClaimEnd = EndPage - Page > MM_FIRMWARE_CLAIM_PAGES ? EndPage : Page + MM_FIRMWARE_CLAIM_PAGES;
+            if (ClaimEnd > Descriptor->FirstPage + Descriptor->PageCount) {
+                ClaimEnd = Descriptor->FirstPage + Descriptor->PageCount;
+            }
+
+            Status = MmPapClaimFirmwarePages(Page, ClaimEnd - Page, Descriptor->Attributes);
+            if (!NT_SUCCESS(Status)) {
+                return Status;
+            }
+
+            Descriptor = MmMdFindDescriptor(&MmMdlUnmappedUnallocated, Page);
+        }
+
+        Page = Descriptor->FirstPage + Descriptor->PageCount;
+    }
+
+    return MmPapCarvePages(FirstPage, PageCount, MemoryType);
+}
+
+NTSTATUS
+MmPapAllocatePhysicalPages (
+    IN  ULONG_PTR   PageCount,
+    IN  MEMORY_TYPE MemoryType,
+    IN  ULONG_PTR   MinimumPage,
+    IN  ULONG_PTR   LimitPage,
+    IN  ULONG_PTR   Alignment,
+    OUT ULONG_PTR   *FirstPage
+    )
+
+/*++
+
+Routine Description:
+
+    Allocates physical pages anywhere within a range.
+
+Arguments:
+
+    PageCount - The number of pages to allocate.
+
+    MemoryType - The memory type of the allocation.
+
+    MinimumPage - The lowest page that may be used.
+
+    LimitPage - The page above the highest page that may be used.
+
+    Alignment - The alignment of the first page, in pages. Must be a
+        power of two.
+
+    FirstPage - Pointer to a ULONG_PTR that receives the first allocated page.
+
+Return Value:
+
+    STATUS_SUCCESS if successful.
+
+    STATUS_NO_MEMORY if there is no free run of pages in the range.
+
+    Any other status value returned by MmPapClaimFirmwarePages.
+
+--*/
+
+{
+    NTSTATUS Status;
+    ULONG_PTR ClaimCount;
+    PMEMORY_DESCRIPTOR Descriptor;
+
+    //
+    // Large and aligned requests are served from the page bitmaps, which
+    // cover claimed and unclaimed pages alike. If the firmware refuses to
+    // give up the run, fall back to the lists.
+    //
+    if (MmPageBitmapCount != 0
+        && (PageCount >= MM_PAGE_BITMAP_MINIMUM_RUN || Alignment > 1)
+        && MmPapFindBitmapRun(PageCount, MinimumPage, LimitPage, Alignment, FirstPage)) {
+        Status = MmPapAllocateFixedPages(*FirstPage, PageCount, MemoryType);
+        if (NT_SUCCESS(Status)) {
+            return Status;
+        }
+    }
+
+    //
+    // Prefer pages that were already claimed from the firmware.
+    //
+    if (MmMdFindFirstFit(&MmMdlUnmappedUnallocated, PageCount, MinimumPage, LimitPage, Alignment, FirstPage) != NULL) {
+        return MmPapCarvePages(*FirstPage, PageCount, MemoryType);
+    }
+
+    Descriptor = MmMdFindFirstFit(&MmMdlFirmwareFree, PageCount, MinimumPage, LimitPage, Alignment, FirstPage);
+    if (Descriptor == NULL) {
+        return STATUS_NO_MEMORY;
+    }
+
+    //
+    // Claim a whole batch so that later allocations can be served from it.
+    //
+    ClaimCount = PageCount > MM_FIRMWARE_CLAIM_PAGES ? PageCount : MM_FIRMWARE_CLAIM_PAGES;
+    if (ClaimCount > Descriptor->FirstPage + Descriptor->PageCount - *FirstPage) {
+        ClaimCount = Descriptor->FirstPage + Descriptor->PageCount - *FirstPage;
+    }
+
+    Status = MmPapClaimFirmwarePages(*FirstPage, ClaimCount, Descriptor->Attributes);
+    if (!NT_SUCCESS(Status)) {
+        return Status;
+    }
+
+    return MmPapCarvePages(*FirstPage, PageCount, MemoryType);
+}
+
+BOOLEAN
+MmPapIsWithinConstraints (
+    IN ULONG_PTR FirstPage,
+    IN ULONG_PTR PageCount
+    )
+
+/*++
+
+Routine Description:
+
+    Checks whether a run of pages lies entirely inside one of the usable
+    windows left by the memory constraints.
+
+Arguments:
+
+    FirstPage - The first page of the run.
+
+    PageCount - The number of pages in the run.
+
+Return Value:
+
+    TRUE if the run may be allocated.
+
+    FALSE if any part of the run falls outside the windows.
+
+--*/
+
+{
+    ULONG_PTR WindowFirst, WindowLimit;
+
+    if (!MmConstraintsActive) {
+        return TRUE;
+    }
+
+    for (ULONG Index = 0; Index < MmConstraintRangeCount; Index++) {
+        WindowFirst = MmConstraintRanges[Index].FirstPage;
+        WindowLimit = WindowFirst + MmConstraintRanges[Index].PageCount;
+        if (FirstPage >= WindowFirst && FirstPage < WindowLimit) {
+            return PageCount <= WindowLimit - FirstPage;
+        }
+    }
+
+    return FALSE;
+}
+
+NTSTATUS
+MmPapAllocateConstrainedPages (
+    IN  ULONG_PTR   PageCount,
+    IN  MEMORY_TYPE MemoryType,
+    IN  ULONG_PTR   MinimumPage,
+    IN  ULONG_PTR   LimitPage,
+    IN  ULONG_PTR   Alignment,
+    OUT ULONG_PTR   *FirstPage
+    )
+
+/*++
+
+Routine Description:
+
+    Allocates physical pages anywhere within a range, keeping to the
+    usable windows left by the memory constraints. Fixed allocations are
+    checked against the same windows by MmPapIsWithinConstraints.
+
+Arguments:
+
+    PageCount - The number of pages to allocate.
+
+    MemoryType - The memory type of the allocation.
+
+    MinimumPage - The lowest page that may be used.
+
+    LimitPage - The page above the highest page that may be used.
+
+    Alignment - The alignment of the first page, in pages. Must be a
+        power of two.
+
+    FirstPage - Pointer to a ULONG_PTR that receives the first allocated page.
+
+Return Value:
+
+    STATUS_SUCCESS if successful.
+
+    STATUS_NO_MEMORY if there is no free run of pages in the range.
+
+    Any other status value returned by MmPapAllocatePhysicalPages.
+
+--*/
+
+{
+    NTSTATUS Status;
+    ULONG_PTR WindowFirst, WindowLimit;
+
+    if (!MmConstraintsActive) {
+        return MmPapAllocatePhysicalPages(PageCount, MemoryType, MinimumPage, LimitPage, Alignment, FirstPage);
+    }
+
+    //
+    // Intersect the range with each window in one pass. The windows are
+    // sorted, so the first fit found is also the lowest.
+    //
+    Status = STATUS_NO_MEMORY;
+    for (ULONG Index = 0; Index < MmConstraintRangeCount; Index++) {
+        WindowFirst = MmConstraintRanges[Index].FirstPage;
+        WindowLimit = WindowFirst + MmConstraintRanges[Index].PageCount;
+        if (WindowLimit <= MinimumPage) {
+            continue;
+        }
+
+        if (WindowFirst >= LimitPage) {
+            break;
+        }
+
+        WindowFirst = WindowFirst > MinimumPage ? WindowFirst : MinimumPage;
+        WindowLimit = WindowLimit < LimitPage ? WindowLimit : LimitPage;
+        if (WindowLimit - WindowFirst < PageCount) {
+            continue;
+        }
+
+        Status = MmPapAllocatePhysicalPages(PageCount, MemoryType, WindowFirst, WindowLimit, Alignment, FirstPage);
+        if (Status != STATUS_NO_MEMORY) {
+            break;
+        }
+    }
+
+    return Status;
+}
+
+NTSTATUS
+MmPapReleaseList (
+    IN PMEMORY_DESCRIPTOR_LIST Mdl
+    )
+
+/*++
+
+Routine Description:
+
+    Returns every page in a MDL to the firmware and empties the MDL.
+
+Arguments:
+
+    Mdl - Pointer to the MDL.
+
+Return Value:
+
+    STATUS_SUCCESS if successful.
+
+    Any other status value returned by MmFwFreePages.
+
+--*/
+
+{
+    NTSTATUS Status, ReturnStatus;
+    PLIST_ENTRY Entry;
+    PMEMORY_DESCRIPTOR Descriptor;
+
+    ReturnStatus = STATUS_SUCCESS;
+    Entry = Mdl->Head->Flink;
+    while (Entry != Mdl->Head) {
+        Descriptor = CONTAINING_RECORD(Entry, MEMORY_DESCRIPTOR, ListEntry);
+        Entry = Entry->Flink;
+
+        //
+        // Descriptor slabs are released last, since descriptors live in them.
+        //
+        if (Descriptor->MemoryType == MEMORY_TYPE_DESCRIPTOR_POOL) {
+            continue;
+        }
+
+        Status = MmFwFreePages(Descriptor->FirstPage, Descriptor->PageCount);
+        if (!NT_SUCCESS(Status)) {
+            ReturnStatus = Status;
+        }
+
+        MmMdRemoveDescriptorFromList(Mdl, Descriptor);
+        MmMdFreeDescriptor(Descriptor);
+    }
+
+    return ReturnStatus;
+}
+
+VOID
+MmPapInitializePageBitmaps (
+    VOID
+    )
+
+/*++
+
+Routine Description:
+
+    Creates free page bitmaps for the large firmware free regions. The
+    bitmaps are optional; if they cannot be allocated, every request is
+    served from the lists.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    None.
+
+--*/
+
+{
+    NTSTATUS Status;
+    ULONG Count;
+    ULONG_PTR Size;
+    PUCHAR Buffer;
+    PLIST_ENTRY Entry;
+    PMEMORY_DESCRIPTOR Descriptor;
+
+    //
+    // Size the bitmaps and their headers.
+    //
+    Count = 0;
+    Size = 0;
+    Entry = MmMdlFirmwareFree.Head->Flink;
+    while (Entry != MmMdlFirmwareFree.Head) {
+        Descriptor = CONTAINING_RECORD(Entry, MEMORY_DESCRIPTOR, ListEntry);
+        if (Descriptor->PageCount >= MM_PAGE_BITMAP_MINIMUM_PAGES) {
+            Count++;
+            Size += RTL_BITMAP_BUFFER_SIZE(Descriptor->PageCount);
+        }
+
+        Entry = Entry->Flink;
+    }
+
+    if (Count == 0) {
+        return;
+    }
+
+    Size += ALIGN_UP(Count * sizeof(MM_PAGE_BITMAP), sizeof(ULONGLONG));
+    Buffer = NULL;
+    Status = MmPapAllocatePagesInRange((PVOID *)&Buffer, ALIGN_UP(Size, PAGE_SIZE) >> PAGE_SHIFT, MEMORY_TYPE_PAGE_BITMAP, 0, NULL, 0);
+    if (!NT_SUCCESS(Status)) {
+        DebugError(L"Failed to allocate page bitmaps (Status=0x%x)\r\n", Status);
+        return;
+    }
+
+    //
+    // Claiming the pages above may have shrunk a region, but never adds
+    // one, so everything still fits. Pages cut off this way are still
+    // found through the lists.
+    //
+    MmPageBitmaps = (PMM_PAGE_BITMAP)Buffer;
+    Buffer += ALIGN_UP(Count * sizeof(MM_PAGE_BITMAP), sizeof(ULONGLONG));
+    Entry = MmMdlFirmwareFree.Head->Flink;
+    while (Entry != MmMdlFirmwareFree.Head && MmPageBitmapCount < Count) {
+        Descriptor = CONTAINING_RECORD(Entry, MEMORY_DESCRIPTOR, ListEntry);
+        Entry = Entry->Flink;
+        if (Descriptor->PageCount < MM_PAGE_BITMAP_MINIMUM_PAGES) {
+            continue;
+        }
+
+        MmPageBitmaps[MmPageBitmapCount].FirstPage = Descriptor->FirstPage;
+        RtlInitializeBitMap(&MmPageBitmaps[MmPageBitmapCount].Bitmap, (PULONGLONG)Buffer, Descriptor->PageCount);
+        Buffer += RTL_BITMAP_BUFFER_SIZE(Descriptor->PageCount);
+        MmPageBitmapCount++;
+    }
+
+    MmPapRebuildPageBitmaps();
+}
+
+NTSTATUS
+MmPaInitialize (
+    VOID
+    )
+
+/*++
+
+Routine Description:
+
+    Initializes the page allocator.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    STATUS_SUCCESS if successful.
+
+    Any other status value returned by MmFwGetMemoryMap.
+
+--*/
+
+{
+    NTSTATUS Status;
+
+    MmMdInitializeList(&MmMdlFirmwareFree, MDL_TYPE_PHYSICAL, &MmFirmwareFreeHead);
+    MmMdInitializeList(&MmMdlUnmappedUnallocated, MDL_TYPE_PHYSICAL, &MmUnmappedUnallocatedHead);
+    MmMdInitializeList(&MmMdlUnmappedAllocated, MDL_TYPE_PHYSICAL, &MmUnmappedAllocatedHead);
+    MmMdInitializeList(&MmMdlBadMemory, MDL_TYPE_PHYSICAL, &MmBadMemoryHead);
+    MmFirmwareMapStale = FALSE;
+    MmConstraintsActive = FALSE;
+    MmPageBitmaps = NULL;
+    MmPageBitmapCount = 0;
+
+    Status = MmFwGetMemoryMap(&MmMdlFirmwareFree);
+    if (!NT_SUCCESS(Status)) {
+        return Status;
+    }
+
+    MmPapInitializePageBitmaps();
+    return STATUS_SUCCESS;
+}
+
+VOID
+MmPapExcludeConstraintRange (
+    IN ULONG_PTR FirstPage,
+    IN ULONG_PTR LimitPage
+    )
+
+/*++
+
+Routine Description:
+
+    Removes a run of pages from the usable constraint windows.
+
+Arguments:
+
+    FirstPage - The first page to exclude.
+
+    LimitPage - The page after the last page to exclude.
+
+Return Value:
+
+    None.
+
+--*/
+
+{
+    ULONG Count;
+    ULONG_PTR WindowEnd;
+    MM_PAGE_RANGE Windows[MM_MAX_CONSTRAINT_RANGES];
+
+    //
+    // Each window loses its overlap with the run, and is split in two
+    // if the run falls in its middle.
+    //
+    Count = 0;
+    for (ULONG Index = 0; Index < MmConstraintRangeCount; Index++) {
+        WindowEnd = MmConstraintRanges[Index].FirstPage + MmConstraintRanges[Index].PageCount;
+        if (MmConstraintRanges[Index].FirstPage < FirstPage && Count < MM_MAX_CONSTRAINT_RANGES) {
+            Windows[Count].FirstPage = MmConstraintRanges[Index].FirstPage;
+            Windows[Count].PageCount = (WindowEnd < FirstPage ? WindowEnd : FirstPage) - Windows[Count].FirstPage;
+            Count++;
+        }
+
+        if (WindowEnd > LimitPage && Count < MM_MAX_CONSTRAINT_RANGES) {
+            Windows[Count].FirstPage = MmConstraintRanges[Index].FirstPage > LimitPage ? MmConstraintRanges[Index].FirstPage : LimitPage;
+            Windows[Count].PageCount = WindowEnd - Windows[Count].FirstPage;
+            Count++;
+        }
+    }
+
+    RtlCopyMemory(MmConstraintRanges, Windows, Count * sizeof(MM_PAGE_RANGE));
+    MmConstraintRangeCount = Count;
+}
+
+NTSTATUS
+BlpMmInitializeConstraints (
+    VOID
+    )
+
+/*++
+
+Routine Description:
+
+    This routine reads physical memory constraint requirements from the
+    application options and saves them for subsequent use by the page allocator.
+
+Arguments:
+
+    None
+
+Return Value:
+
+    NT Status code.
+
+--*/
+
+{
+    INT64 Value;
+
+    MmConstraintsActive = FALSE;
+    MmConstraintRanges[0].FirstPage = 0;
+    MmConstraintRanges[0].PageCount = MM_PAGE_LIMIT;
+    MmConstraintRangeCount = 1;
+
+    //
+    // Memory at or above the truncation address is never used.
+    //
+    if (NT_SUCCESS(BlGetBootOptionInteger(BlpApplicationEntry.Options, BCDE_LIBRARY_TYPE_TRUNCATE_PHYSICAL_MEMORY, &Value))
+        && (ULONGLONG)Value >> PAGE_SHIFT < MM_PAGE_LIMIT) {
+        MmPapExcludeConstraintRange((ULONGLONG)Value >> PAGE_SHIFT, MM_PAGE_LIMIT);
+        MmConstraintsActive = TRUE;
+    }
+
+    //
+    // Memory below the avoid address is never used either.
+    //
+    if (NT_SUCCESS(BlGetBootOptionInteger(BlpApplicationEntry.Options, BCDE_LIBRARY_TYPE_AVOID_LOW_PHYSICAL_MEMORY, &Value))
+        && Value != 0) {
+        MmPapExcludeConstraintRange(
+            0,
+            (ULONGLONG)Value >> PAGE_SHIFT < MM_PAGE_LIMIT - 1 ? ((ULONGLONG)Value + PAGE_MASK) >> PAGE_SHIFT : MM_PAGE_LIMIT
+        );
+        MmConstraintsActive = TRUE;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+VOID
+MmPapSortPages (
+    IN OUT PULONGLONG Pages,
+    IN     ULONG_PTR  Count
+    )
+
+/*++
+
+Routine Description:
+
+    Sorts an array of page numbers in place, using a heap sort so that
+    long lists take O(n log n) time and no extra memory.
+
+Arguments:
+
+    Pages - Pointer to the array.
+
+    Count - The number of pages in the array.
+
+Return Value:
+
+    None.
+
+--*/
+
+{
+    ULONGLONG Value;
+    ULONG_PTR Parent, Child, End;
+
+    if (Count < 2) {
+        return;
+    }
+
+    //
+    // Build a max heap, then repeatedly move its top to the end.
+    //
+    for (End = Count, Parent = Count / 2; End > 1;) {
+        if (Parent > 0) {
+            Parent--;
+        } else {
+            End--;
+            Value = Pages[0];
+            Pages[0] = Pages[End];
+            Pages[End] = Value;
+        }
+
+        for (ULONG_PTR Index = Parent; (Child = 2 * Index + 1) < End; Index = Child) {
+            if (Child + 1 < End && Pages[Child + 1] > Pages[Child]) {
+                Child++;
+            }
+
+            if (Pages[Index] >= Pages[Child]) {
+                break;
+            }
+
+            Value = Pages[Index];
+            Pages[Index] = Pages[Child];
+            Pages[Child] = Value;
+        }
+    }
+}
+
+NTSTATUS
+MmPapRetirePages (
+    IN PMEMORY_DESCRIPTOR_LIST Mdl,
+    IN ULONG_PTR               FirstPage,
+    IN ULONG_PTR               PageCount,
+    IN ULONG                   Attributes
+    )
+
+/*++
+
+Routine Description:
+
+    Moves free pages to the bad memory list.
+
+Arguments:
+
+    Mdl - The list the pages are on, either the free firmware memory
+        list or the unallocated list.
+
+    FirstPage - The first page to retire.
+
+    PageCount - The number of pages to retire.
+
+    Attributes - The memory attributes of the pages.
+
+Return Value:
+
+    STATUS_SUCCESS if successful.
+
+    STATUS_NO_MEMORY if no descriptors are available.
+
+    Any other status value returned by MmFwAllocatePages.
+
+--*/
+
+{
+    NTSTATUS Status;
+    PMEMORY_DESCRIPTOR Descriptor;
+
+    if (!MmMdCanInitDescriptors(MM_MOVE_DESCRIPTOR_COUNT)) {
+        return STATUS_NO_MEMORY;
+    }
+
+    //
+    // Free firmware pages are claimed first, so the firmware cannot hand
+    // them out either.
+    //
+    if (Mdl == &MmMdlFirmwareFree) {
+        Status = MmFwAllocatePages(FirstPage, PageCount);
+        if (!NT_SUCCESS(Status)) {
+            MmFirmwareMapStale = TRUE;
+            return Status;
+        }
+    }
+
+    Descriptor = MmMdInitDescriptor(FirstPage, 0, PageCount, Attributes, MEMORY_TYPE_UNUSABLE);
+    Status = MmMdRemoveRegionFromList(Mdl, FirstPage, PageCount);
+    if (!NT_SUCCESS(Status)) {
+        MmMdFreeDescriptor(Descriptor);
+        if (Mdl == &MmMdlFirmwareFree) {
+            MmFwFreePages(FirstPage, PageCount);
+        }
+
+        return Status;
+    }
+
+    MmMdAddDescriptorToList(&MmMdlBadMemory, Descriptor, MM_MD_FLAG_COALESCE);
+    MmPapMarkPages(FirstPage, PageCount, FALSE);
+    MmBadMemoryPagesRemoved += PageCount;
+    return STATUS_SUCCESS;
+}
 
 NTSTATUS
-BlpMmInitializeConstraints (
-    VOID
+MmPapRetireRanges (
+    IN PMEMORY_DESCRIPTOR_LIST Mdl,
+    IN PMM_PAGE_RANGE          Ranges,
+    IN ULONG_PTR               RangeCount
     )
 
 /*++
 
 Routine Description:
 
-    This routine reads physical memory constraint requirements from the
-    application options and saves them for subsequent use by the page allocator.
+    Retires every page of a MDL that falls in a set of ranges, walking the
+    MDL and the ranges together in one pass.
 
 Arguments:
 
-    None
+    Mdl - The list to remove pages from.
+
+    Ranges - Pointer to the ranges, sorted and not overlapping.
+
+    RangeCount - The number of ranges.
 
 Return Value:
 
-    NT Status code.
+    STATUS_SUCCESS if successful.
+
+    STATUS_NO_MEMORY if descriptors ran out.
 
 --*/
 
 {
+    NTSTATUS Status;
+    PLIST_ENTRY Entry, Previous;
+    PMEMORY_DESCRIPTOR Descriptor;
+    ULONG_PTR RangeIndex, RangeEnd, DescriptorEnd, Start, End;
 
-    NTSTATUS Status  = STATUS_SUCCESS;
+    RangeIndex = 0;
+    Entry = Mdl->Head->Flink;
+    while (Entry != Mdl->Head && RangeIndex < RangeCount) {
+        Descriptor = CONTAINING_RECORD(Entry, MEMORY_DESCRIPTOR, ListEntry);
+        DescriptorEnd = Descriptor->FirstPage + Descriptor->PageCount;
+        RangeEnd = Ranges[RangeIndex].FirstPage + Ranges[RangeIndex].PageCount;
 
-    // TODO IMPLEMENT
-   
+        //
+        // Advance whichever of the two ends first if they do not overlap.
+        //
+        if (RangeEnd <= Descriptor->FirstPage) {
+            RangeIndex++;
+            continue;
+        }
 
-    return Status;
-}
+        if (Ranges[RangeIndex].FirstPage >= DescriptorEnd) {
+            Entry = Entry->Flink;
+            continue;
+        }
 
+        Start = Ranges[RangeIndex].FirstPage > Descriptor->FirstPage ? Ranges[RangeIndex].FirstPage : Descriptor->FirstPage;
+        End = RangeEnd < DescriptorEnd ? RangeEnd : DescriptorEnd;
+
+        //
+        // Removing the overlap may trim, split, or free the descriptor, so
+        // pick the walk up again from the one before it.
+        //
+        Previous = Entry->Blink;
+        Status = MmPapRetirePages(Mdl, Start, End - Start, Descriptor->Attributes);
+        if (Status == STATUS_NO_MEMORY) {
+            return Status;
+        }
+
+        if (!NT_SUCCESS(Status)) {
+            //
+            // Leave pages the firmware will not give up, and move on.
+            //
+            DebugError(L"Failed to retire bad memory pages\r\n");
+            if (RangeEnd <= DescriptorEnd) {
+                RangeIndex++;
+            } else {
+                Entry = Entry->Flink;
+            }
+
+            continue;
+        }
+
+        Entry = Previous->Flink;
+    }
+
+    return STATUS_SUCCESS;
+}
 
 VOID
 BlMmRemoveBadMemory (
@@ -77,10 +1240,108 @@ Return Value:
 --*/
 
 {
+    NTSTATUS Status;
+    BOOLEAN AllowBadMemoryAccess;
+    PULONGLONG ListPages, Pages;
+    PMM_PAGE_RANGE Ranges;
+    ULONG_PTR PageCount, RangeCount;
+    ULONGLONG StartTime;
+
+    Pages = NULL;
+    Ranges = NULL;
+    StartTime = __rdtsc();
+    MmDescriptorCallTreeCount++;
+
+    Status = BlGetBootOptionBoolean(BlpApplicationEntry.Options, BCDE_LIBRARY_TYPE_ALLOW_BAD_MEMORY_ACCESS, &AllowBadMemoryAccess);
+    if (NT_SUCCESS(Status) && AllowBadMemoryAccess) {
+        goto Exit;
+    }
+
+    Status = BlGetBootOptionIntegerList(BlpApplicationEntry.Options, BCDE_LIBRARY_TYPE_BAD_MEMORY_LIST, &ListPages, &PageCount);
+    if (!NT_SUCCESS(Status) || PageCount == 0) {
+        goto Exit;
+    }
+
+    //
+    // Sort a copy of the list and merge it into runs, so that each
+    // contiguous run costs at most one descriptor split per list.
+    //
+    Pages = BlMmAllocateHeap(PageCount * sizeof(ULONGLONG));
+    Ranges = BlMmAllocateHeap(PageCount * sizeof(MM_PAGE_RANGE));
+    if (Pages == NULL || Ranges == NULL) {
+        DebugError(L"Failed to allocate bad memory list\r\n");
+        goto Exit;
+    }
+
+    RtlCopyMemory(Pages, ListPages, PageCount * sizeof(ULONGLONG));
+    MmPapSortPages(Pages, PageCount);
+
+    RangeCount = 0;
+    for (ULONG_PTR Index = 0; Index < PageCount; Index++) {
+        if (Pages[Index] >= MM_PAGE_LIMIT) {
+            break;
+        }
+
+        if (RangeCount != 0 && Pages[Index] <= Ranges[RangeCount - 1].FirstPage + Ranges[RangeCount - 1].PageCount) {
+            Ranges[RangeCount - 1].PageCount = Pages[Index] + 1 - Ranges[RangeCount - 1].FirstPage;
+            continue;
+        }
+
+        Ranges[RangeCount].FirstPage = Pages[Index];
+        Ranges[RangeCount].PageCount = 1;
+        RangeCount++;
+    }
+
+    //
+    // Reserve enough descriptors up front for every run to split a
+    // descriptor and start a new bad memory one, so the pass below never
+    // has to stop and grow the pool.
+    //
+    Status = MmMdReserveDescriptors(RangeCount * MM_MOVE_DESCRIPTOR_COUNT);
+    if (!NT_SUCCESS(Status)) {
+        DebugError(L"Failed to reserve descriptors for bad memory\r\n");
+    }
+
+    //
+    // Pages already allocated are left alone.
+    //
+    Status = MmPapRetireRanges(&MmMdlUnmappedUnallocated, Ranges, RangeCount);
+    if (NT_SUCCESS(Status)) {
+        Status = MmPapRetireRanges(&MmMdlFirmwareFree, Ranges, RangeCount);
+    }
+
+    //
+    // If the firmware refused some pages, its map has changed. Take a new
+    // one and retry, since the refused runs may still hold free pages.
+    //
+    if (NT_SUCCESS(Status) && MmFirmwareMapStale && NT_SUCCESS(MmPapRefreshFirmwareMap())) {
+        Status = MmPapRetireRanges(&MmMdlFirmwareFree, Ranges, RangeCount);
+    }
+
+    if (!NT_SUCCESS(Status)) {
+        DebugError(L"Ran out of descriptors removing bad memory\r\n");
+    }
 
-    // TODO IMPLEMENT
+Exit:
+    if (Pages != NULL) {
+        BlMmFreeHeap(Pages);
+    }
+
+    if (Ranges != NULL) {
+        BlMmFreeHeap(Ranges);
+    }
 
-    return;
+    MmMdFreeGlobalDescriptors();
+    MmDescriptorCallTreeCount--;
+    MmBadMemoryRemovalTime += __rdtsc() - StartTime;
+
+#if !defined(NDEBUG)
+    DebugInfo(
+        L"Bad memory: %d pages removed, %d cycles spent\r\n",
+        (ULONG)MmBadMemoryPagesRemoved,
+        (ULONG)MmBadMemoryRemovalTime
+    );
+#endif
 }
 
 NTSTATUS
@@ -89,7 +1350,8 @@ MmPapAllocatePagesInRange (
     IN     ULONG_PTR      PageCount,
     IN     ULONG          MemoryType,
     IN     ULONG          AllocationAttributes,
-    IN     PADDRESS_RANGE Range OPTIONAL
+    IN     PADDRESS_RANGE Range OPTIONAL,
+    IN     ULONG_PTR      Alignment
     )
 
 /*++
@@ -110,67 +1372,221 @@ Routine Description:
 
     Range - Pointer to the range descriptor or NULL.
 
+    Alignment - The alignment of the allocation in pages, or 0 for none.
+        Must be a power of two.
+
 Return Value:
 
     STATUS_SUCCESS if successful.
 
-    STATUS_INVALID_PARAMETER if any of Address, PageCount, or Range are invalid.
+    STATUS_INVALID_PARAMETER if any of Address, PageCount, Range, or
+    Alignment are invalid.
+
+    STATUS_NO_MEMORY if the pages are not available.
 
 --*/
 
 {
     NTSTATUS Status;
-    PVOID RequestedAddress;
-
-    (VOID) MemoryType;
+    ULONG_PTR FirstPage, MinimumPage, LimitPage;
+    BOOLEAN Refreshed;
 
     MmDescriptorCallTreeCount++;
 
     //
     // Validate arguments.
     //
-    if (Address == NULL || PageCount == 0 || (Range != NULL && Range->Minimum >= Range->Maximum)) {
+    if (Address == NULL || PageCount == 0 || (Range != NULL && Range->Minimum >= Range->Maximum)
+        || (Alignment & (Alignment - 1)) != 0) {
         DebugError(L"Invalid parameter\r\n");
         Status = STATUS_INVALID_PARAMETER;
         goto Exit;
     }
 
+    if (Alignment == 0) {
+        Alignment = 1;
+    }
+
     //
-    // Allocate physical pages.
+    // Allocate physical pages. With virtual translation, physical memory
+    // is identity mapped, so the pages are allocated the same way and
+    // then mapped if they were not already.
     //
-    if (MmTranslationType == TRANSLATION_TYPE_NONE) {
+    if (MmTranslationType == TRANSLATION_TYPE_NONE || MmTranslationType == TRANSLATION_TYPE_VIRTUAL) {
         //
-        // Use requested address if specified.
+        // Work out which pages may be used.
         //
-        if (AllocationAttributes & 0x40000) {
-            RequestedAddress = *Address;
+        if (Range != NULL) {
+            MinimumPage = (Range->Minimum >> PAGE_SHIFT) + ((Range->Minimum & PAGE_MASK) != 0 ? 1 : 0);
+            LimitPage = (Range->Maximum >> PAGE_SHIFT) + ((Range->Maximum & PAGE_MASK) == PAGE_MASK ? 1 : 0);
+        } else if (AllocationAttributes & MEMORY_ATTRIBUTE_ALLOCATION_FIXED) {
+            MinimumPage = 0;
+            LimitPage = MM_PAGE_LIMIT;
         } else {
-            RequestedAddress = NULL;
+            MinimumPage = MM_DEFAULT_MINIMUM_PAGE;
+            LimitPage = MM_PAGE_LIMIT;
+        }
+
+        if (AllocationAttributes & MEMORY_ATTRIBUTE_ALLOCATION_FIXED) {
+            FirstPage = (ULONG_PTR)*Address >> PAGE_SHIFT;
+            if (((ULONG_PTR)*Address & PAGE_MASK) != 0 || (FirstPage & (Alignment - 1)) != 0
+                || FirstPage < MinimumPage || FirstPage >= LimitPage || PageCount > LimitPage - FirstPage) {
+                DebugError(L"Invalid parameter\r\n");
+                Status = STATUS_INVALID_PARAMETER;
+                goto Exit;
+            }
+
+            //
+            // A fixed run must still keep to the constraint windows, so
+            // callers like the heap fall back to an allocation elsewhere.
+            //
+            if (!MmPapIsWithinConstraints(FirstPage, PageCount)) {
+                Status = STATUS_NO_MEMORY;
+                goto Exit;
+            }
         }
 
         //
-        // TODO: Don't use the firmware allocator.
+        // If the firmware refused to give up pages it had reported free,
+        // take a new memory map and try once more.
         //
-#if defined(_EFI)
-        Status = EfiAllocatePages(
-            AllocateAnyPages,
-            EfiLoaderData,
-            PageCount,
-            (EFI_PHYSICAL_ADDRESS *)&RequestedAddress
-        );
-#else
-        DebugError(L"Page allocation not supported\r\n");
-        Status = STATUS_NOT_SUPPORTED;
-#endif
+        Refreshed = FALSE;
+        while (TRUE) {
+            if (AllocationAttributes & MEMORY_ATTRIBUTE_ALLOCATION_FIXED) {
+                Status = MmPapAllocateFixedPages(FirstPage, PageCount, MemoryType);
+            } else {
+                Status = MmPapAllocateConstrainedPages(PageCount, MemoryType, MinimumPage, LimitPage, Alignment, &FirstPage);
+            }
+
+            if (NT_SUCCESS(Status) || !MmFirmwareMapStale || Refreshed) {
+                break;
+            }
+
+            Refreshed = TRUE;
+            Status = MmPapRefreshFirmwareMap();
+            if (!NT_SUCCESS(Status)) {
+                break;
+            }
+        }
+
+        if (!NT_SUCCESS(Status)) {
+            goto Exit;
+        }
+
+        if (MmTranslationType == TRANSLATION_TYPE_VIRTUAL) {
+            Status = MmArchMapPhysicalRange(FirstPage << PAGE_SHIFT, FirstPage << PAGE_SHIFT, PageCount << PAGE_SHIFT, 0);
+            if (!NT_SUCCESS(Status)) {
+                MmPapFreePages((PVOID)(FirstPage << PAGE_SHIFT), PageCount);
+                goto Exit;
+            }
+        }
+
+        *Address = (PVOID)(FirstPage << PAGE_SHIFT);
+        goto Exit;
+    }
+
+    DebugError(L"Invalid translation type\r\n");
+    Status = STATUS_NOT_SUPPORTED;
+
+Exit:
+    MmMdFreeGlobalDescriptors();
+    MmDescriptorCallTreeCount--;
+    return Status;
+}
+
+NTSTATUS
+MmPapFreePages (
+    IN PVOID     Address,
+    IN ULONG_PTR PageCount
+    )
 
+/*++
+
+Routine Description:
+
+    Frees pages allocated by MmPapAllocatePagesInRange.
+
+    The pages are kept for later allocations, and are returned to the
+    firmware by MmPaDestroy.
+
+Arguments:
+
+    Address - The address of the first page.
+
+    PageCount - The number of pages to free.
+
+Return Value:
+
+    STATUS_SUCCESS if successful.
+
+    STATUS_INVALID_PARAMETER if Address or PageCount are invalid, or if the
+    pages were not allocated by MmPapAllocatePagesInRange.
+
+    STATUS_NO_MEMORY if no descriptors are available.
+
+--*/
+
+{
+    NTSTATUS Status;
+    ULONG_PTR FirstPage, EndPage, Page;
+    ULONG Attributes;
+    PMEMORY_DESCRIPTOR Descriptor;
+
+    MmDescriptorCallTreeCount++;
+
+    //
+    // Validate arguments.
+    //
+    if (Address == NULL || ((ULONG_PTR)Address & PAGE_MASK) != 0 || PageCount == 0) {
+        DebugError(L"Invalid parameter\r\n");
+        Status = STATUS_INVALID_PARAMETER;
         goto Exit;
     }
 
     //
-    // TODO: Finish implementing this routine.
+    // Virtual addresses are identity mapped, and the mapping is kept.
     //
-    DebugError(L"Virtual page allocation not implemented\r\n");
-    Status = STATUS_NOT_IMPLEMENTED;
+    if (MmTranslationType == TRANSLATION_TYPE_NONE || MmTranslationType == TRANSLATION_TYPE_VIRTUAL) {
+        //
+        // Every page must have been allocated.
+        //
+        FirstPage = (ULONG_PTR)Address >> PAGE_SHIFT;
+        EndPage = FirstPage + PageCount;
+        Page = FirstPage;
+        while (Page < EndPage) {
+            Descriptor = MmMdFindDescriptor(&MmMdlUnmappedAllocated, Page);
+            if (Descriptor == NULL) {
+                DebugError(L"Pages at 0x%x were not allocated\r\n", Address);
+                Status = STATUS_INVALID_PARAMETER;
+                goto Exit;
+            }
+
+            Page = Descriptor->FirstPage + Descriptor->PageCount;
+        }
+
+        //
+        // Move the pages back to the unallocated list.
+        //
+        if (!MmMdCanInitDescriptors(MM_MOVE_DESCRIPTOR_COUNT)) {
+            Status = STATUS_NO_MEMORY;
+            goto Exit;
+        }
+
+        Attributes = MmMdFindDescriptor(&MmMdlUnmappedAllocated, FirstPage)->Attributes;
+        Status = MmMdRemoveRegionFromList(&MmMdlUnmappedAllocated, FirstPage, PageCount);
+        if (NT_SUCCESS(Status)) {
+            Status = MmPapAddUnallocatedPages(FirstPage, PageCount, Attributes);
+        }
+
+        if (NT_SUCCESS(Status)) {
+            MmPapMarkPages(FirstPage, PageCount, TRUE);
+        }
+
+        goto Exit;
+    }
+
+    DebugError(L"Invalid translation type\r\n");
+    Status = STATUS_NOT_SUPPORTED;
 
 Exit:
     MmMdFreeGlobalDescriptors();
@@ -185,7 +1601,7 @@ BlMmAllocatePagesInRange (
     IN     ULONG          MemoryType,
     IN     ULONG          AllocationAttributes,
     IN     PADDRESS_RANGE Range OPTIONAL,
-    IN     ULONG          Unknown
+    IN     ULONG          Alignment
     )
 
 /*++
@@ -194,6 +1610,14 @@ Routine Description:
 
     Allocates pages in the requested range.
 
+    With MEMORY_ATTRIBUTE_ALLOCATION_LARGE_PAGES, runs of at least one large
+    page are aligned so that they can be mapped with large pages.
+
+    With MEMORY_ATTRIBUTE_ALLOCATION_KERNEL_RANGE, the pages are also mapped
+    in the kernel range of the application address space, and their address
+    there is returned. Range then applies to the physical pages, and
+    MEMORY_ATTRIBUTE_ALLOCATION_FIXED to the virtual address.
+
 Arguments:
 
     Address - Pointer to the address to allocate at (receives the allocated address).
@@ -206,27 +1630,199 @@ Routine Description:
 
     Range - Pointer to the range descriptor or NULL.
 
-    Unknown - Ignored.
+    Alignment - The alignment of the allocation in pages, or 0 for none.
+
+Return Value:
+
+    STATUS_SUCCESS if successful.
+
+    STATUS_NOT_SUPPORTED if a kernel range allocation is requested without
+    virtual translation.
+
+    Any other status value returned by MmPapAllocatePagesInRange or
+    MmArchMapKernelRange.
+
+--*/
+
+{
+    NTSTATUS Status;
+    PVOID PhysicalAddress;
+    ULONG_PTR VirtualAddress;
+
+    if ((AllocationAttributes & MEMORY_ATTRIBUTE_ALLOCATION_LARGE_PAGES)
+        && Pages >= (MM_LARGE_PAGE_SIZE >> PAGE_SHIFT) && Alignment < (MM_LARGE_PAGE_SIZE >> PAGE_SHIFT)) {
+        Alignment = MM_LARGE_PAGE_SIZE >> PAGE_SHIFT;
+    }
+
+    if (!(AllocationAttributes & MEMORY_ATTRIBUTE_ALLOCATION_KERNEL_RANGE)) {
+        return MmPapAllocatePagesInRange(Address, Pages, MemoryType, AllocationAttributes, Range, Alignment);
+    }
+
+    if (MmTranslationType != TRANSLATION_TYPE_VIRTUAL) {
+        DebugError(L"Kernel range allocation requires virtual translation\r\n");
+        return STATUS_NOT_SUPPORTED;
+    }
+
+    //
+    // Allocate the physical pages anywhere, then map them.
+    //
+    PhysicalAddress = NULL;
+    Status = MmPapAllocatePagesInRange(
+        &PhysicalAddress,
+        Pages,
+        MemoryType,
+        AllocationAttributes & ~MEMORY_ATTRIBUTE_ALLOCATION_FIXED,
+        Range,
+        Alignment
+    );
+    if (!NT_SUCCESS(Status)) {
+        return Status;
+    }
+
+    VirtualAddress = (ULONG_PTR)*Address;
+    MmDescriptorCallTreeCount++;
+    Status = MmArchMapKernelRange(
+        &VirtualAddress,
+        (ULONG_PTR)PhysicalAddress,
+        (ULONGLONG)Pages << PAGE_SHIFT,
+        (AllocationAttributes & MEMORY_ATTRIBUTE_ALLOCATION_FIXED) ? TRUE : FALSE
+    );
+    MmMdFreeGlobalDescriptors();
+    MmDescriptorCallTreeCount--;
+    if (!NT_SUCCESS(Status)) {
+        MmPapFreePages(PhysicalAddress, Pages);
+        return Status;
+    }
+
+    *Address = (PVOID)VirtualAddress;
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS
+BlMmCompactMemoryMap (
+    VOID
+    )
+
+/*++
+
+Routine Description:
+
+    Merges adjacent descriptors of the same type and attributes in every
+    page allocator list. Meant to be called before control is passed to
+    another application, so it receives the shortest possible map.
+
+Arguments:
+
+    None.
 
 Return Value:
 
     STATUS_SUCCESS if successful.
 
-    Any other status value returned by MmPapAllocatePagesInRange.
+    STATUS_UNSUCCESSFUL if the page allocator is not initialized.
+
+--*/
+
+{
+    ULONG Count;
+
+    if (MmMdlFirmwareFree.Head == NULL) {
+        return STATUS_UNSUCCESSFUL;
+    }
+
+    Count = MmMdCompactList(&MmMdlFirmwareFree);
+    Count += MmMdCompactList(&MmMdlUnmappedUnallocated);
+    Count += MmMdCompactList(&MmMdlUnmappedAllocated);
+
+#if !defined(NDEBUG)
+    DebugInfo(L"Memory map compacted, %d descriptors released\r\n", Count);
+#else
+    (VOID) Count;
+#endif
+    return STATUS_SUCCESS;
+}
+
+VOID
+MmPaDestroy (
+    IN ULONG Phase
+    )
+
+/*++
+
+Routine Description:
+
+    Cleans up after the page allocator.
+
+Arguments:
+
+    Phase - Which phase of cleanup to perform.
+
+        Phase 0: Return every claimed page except descriptor slabs
+            to the firmware.
+
+        Phase 1: Also release the free firmware memory list and the
+            descriptor pool.
+
+Return Value:
+
+    None.
 
 --*/
 
 {
-    (VOID) Unknown;
+    if (MmMdlFirmwareFree.Head == NULL) {
+        return;
+    }
+
+    //
+    // The bitmaps are released along with everything else.
+    //
+    MmPageBitmapCount = 0;
+
+#if !defined(NDEBUG)
+    if (Phase == 0) {
+        DebugInfo(
+            L"Pages: %d firmware free, %d unallocated, %d allocated descriptors (%d of %d static used)\r\n",
+            MmMdlFirmwareFree.DescriptorCount,
+            MmMdlUnmappedUnallocated.DescriptorCount,
+            MmMdlUnmappedAllocated.DescriptorCount,
+            MmGlobalMemoryDescriptorsUsed,
+            MmGlobalMemoryDescriptorCount
+        );
+        DebugInfo(
+            L"Pages: %d descriptors free in the dynamic pool\r\n",
+            MmFreeGlobalMemoryDescriptorCount + MmDynamicMemoryDescriptorCount - MmDynamicMemoryDescriptorsUsed
+        );
+        DebugInfo(
+            L"Pages: %d descriptor lookups, %d steps each on average\r\n",
+            (ULONG)MmMdIndexLookups,
+            MmMdIndexLookups != 0 ? (ULONG)(MmMdIndexSteps / MmMdIndexLookups) : 0
+        );
+    }
 
-    if (!(AllocationAttributes & 0x210000)) {
-        return MmPapAllocatePagesInRange(Address, Pages, MemoryType, AllocationAttributes, Range);
+#endif
+    //
+    // Release claimed pages without regard for what they contain, merging
+    // descriptors first so the firmware sees as few calls as possible.
+    //
+    BlMmCompactMemoryMap();
+    MmPapReleaseList(&MmMdlUnmappedAllocated);
+    MmPapReleaseList(&MmMdlUnmappedUnallocated);
+    if (Phase == 0) {
+        return;
     }
 
+    MmMdFreeList(&MmMdlFirmwareFree);
+
     //
-    // TODO: Finish implementing this routine.
+    // Bad memory stays claimed so the firmware never hands it out again.
     //
+    MmMdFreeList(&MmMdlBadMemory);
 
-    DebugError(L"Virtual page allocation not implemented\r\n");
-    return STATUS_NOT_IMPLEMENTED;
+    //
+    // The remaining allocated descriptors describe the descriptor slabs
+    // and live in them, so they go away with the slabs.
+    //
+    MmMdDestroyDynamicDescriptors();
+    MmMdlFirmwareFree.Head = NULL;
 }
@@ -0,0 +1,525 @@
+/*++
+
+Copyright (c) 2025, Quinn Stephens, w1redch4d
+All rights reserved.
+Provided under the BSD 3-Clause license.
+
+Module Name:
+
+    mmsa.c
+
+Abstract:
+
+    Small allocation (slab) services.
+
+--*/
+
+#include "mm.h"
+
+#define SLAB_PAGE_SIGNATURE   0x42414c53 /* "SLAB" */
+#define SLAB_BITMAP_WORDS     4
+#define SLAB_SEGMENT_PAGES    16
+#define MAX_SLAB_SEGMENTS     64
+#define SLAB_OBJECT_OFFSET    ALIGN_UP(sizeof(MM_SLAB_PAGE), 16)
+
+//
+// Slab page header, stored at the start of every slab page.
+// A set bit in FreeBitmap marks a free object.
+//
+typedef struct {
+    LIST_ENTRY ListEntry;
+    ULONG      Signature;
+    USHORT     ClassIndex;
+    USHORT     FreeCount;
+    ULONGLONG  FreeBitmap[SLAB_BITMAP_WORDS];
+} MM_SLAB_PAGE, *PMM_SLAB_PAGE;
+
+typedef struct {
+    LIST_ENTRY                   PartialSlabs;
+    MEMORY_SLAB_CLASS_STATISTICS Statistics;
+} MM_SLAB_CLASS, *PMM_SLAB_CLASS;
+
+//
+// Object sizes for each slab class.
+//
+const USHORT MmSlabClassSizes[MM_SLAB_CLASS_COUNT] = {
+    16, 32, 48, 64, 96, 128, 192, 256
+};
+
+//
+// Maps a size in 16-byte units (rounded up) to its slab class.
+//
+const UCHAR MmSlabSizeToClass[(MM_SLAB_MAX_SIZE / 16) + 1] = {
+    0, 0, 1, 2, 3, 4, 4, 5, 5, 6, 6, 6, 6, 7, 7, 7, 7
+};
+
+MM_SLAB_CLASS MmSlabClasses[MM_SLAB_CLASS_COUNT];
+
+//
+// Base addresses of all slab segments, sorted in ascending order.
+//
+ULONG_PTR MmSlabSegments[MAX_SLAB_SEGMENTS];
+ULONG MmSlabSegmentCount;
+PVOID MmSlabFreePages;
+ULONG SapAllocationAttributes;
+BOOLEAN SapInitialized = FALSE;
+
+PMM_SLAB_PAGE
+MmSapAllocateSlabPage (
+    IN ULONG ClassIndex
+    )
+
+/*++
+
+Routine Description:
+
+    Takes a page from the slab page pool and formats it for a slab class.
+
+Arguments:
+
+    ClassIndex - The slab class to format the page for.
+
+Return Value:
+
+    Pointer to the slab page if successful.
+
+    NULL if unsuccessful.
+
+--*/
+
+{
+    NTSTATUS Status;
+    PVOID SegmentBase;
+    PMM_SLAB_PAGE SlabPage;
+    ULONG ObjectCount, Index;
+
+    //
+    // Refill the page pool with a new segment if needed.
+    //
+    if (MmSlabFreePages == NULL) {
+        if (MmSlabSegmentCount >= MAX_SLAB_SEGMENTS) {
+            return NULL;
+        }
+
+        SegmentBase = NULL;
+        Status = BlMmAllocatePagesInRange(
+            &SegmentBase,
+            SLAB_SEGMENT_PAGES,
+            MEMORY_TYPE_HEAP,
+            SapAllocationAttributes,
+            NULL,
+            0
+        );
+        if (!NT_SUCCESS(Status)) {
+            return NULL;
+        }
+
+        //
+        // Insert the segment into the sorted segment table.
+        //
+        Index = MmSlabSegmentCount;
+        while (Index > 0 && MmSlabSegments[Index - 1] > (ULONG_PTR)SegmentBase) {
+            MmSlabSegments[Index] = MmSlabSegments[Index - 1];
+            Index--;
+        }
+
+        MmSlabSegments[Index] = (ULONG_PTR)SegmentBase;
+        MmSlabSegmentCount++;
+
+        for (Index = SLAB_SEGMENT_PAGES; Index > 0; Index--) {
+            SlabPage = (PMM_SLAB_PAGE)((ULONG_PTR)SegmentBase + ((Index - 1) << PAGE_SHIFT));
+            *(PVOID *)SlabPage = MmSlabFreePages;
+            MmSlabFreePages = SlabPage;
+        }
+    }
+
+    SlabPage = MmSlabFreePages;
+    MmSlabFreePages = *(PVOID *)SlabPage;
+
+    //
+    // Mark every object as free.
+    //
+    ObjectCount = MmSlabClasses[ClassIndex].Statistics.ObjectsPerSlab;
+    RtlZeroMemory(SlabPage, sizeof(*SlabPage));
+    SlabPage->Signature = SLAB_PAGE_SIGNATURE;
+    SlabPage->ClassIndex = (USHORT)ClassIndex;
+    SlabPage->FreeCount = (USHORT)ObjectCount;
+    for (Index = 0; Index < SLAB_BITMAP_WORDS && ObjectCount > 0; Index++) {
+        if (ObjectCount >= 64) {
+            SlabPage->FreeBitmap[Index] = ~0ULL;
+            ObjectCount -= 64;
+        } else {
+            SlabPage->FreeBitmap[Index] = (1ULL << ObjectCount) - 1;
+            ObjectCount = 0;
+        }
+    }
+
+    MmSlabClasses[ClassIndex].Statistics.SlabCount++;
+    return SlabPage;
+}
+
+BOOLEAN
+MmSaIsSlabBuffer (
+    IN PVOID Buffer
+    )
+
+/*++
+
+Routine Description:
+
+    Determines whether a buffer was allocated by the slab allocator.
+
+Arguments:
+
+    Buffer - The buffer to check.
+
+Return Value:
+
+    TRUE if Buffer lies in a slab segment.
+
+    FALSE otherwise.
+
+--*/
+
+{
+    ULONG_PTR Address;
+    ULONG Low, High, Middle;
+
+    //
+    // Find the last segment that starts at or below Buffer.
+    //
+    Address = (ULONG_PTR)Buffer;
+    Low = 0;
+    High = MmSlabSegmentCount;
+    while (Low < High) {
+        Middle = (Low + High) / 2;
+        if (MmSlabSegments[Middle] <= Address) {
+            Low = Middle + 1;
+        } else {
+            High = Middle;
+        }
+    }
+
+    if (Low == 0 || Address - MmSlabSegments[Low - 1] >= (SLAB_SEGMENT_PAGES << PAGE_SHIFT)) {
+        return FALSE;
+    }
+
+#if !defined(NDEBUG)
+    if (((PMM_SLAB_PAGE)(Address & ~(ULONG_PTR)PAGE_MASK))->Signature != SLAB_PAGE_SIGNATURE) {
+        DebugError(L"Slab page for buffer 0x%x has no signature\r\n", Buffer);
+    }
+#endif
+
+    return TRUE;
+}
+
+ULONG_PTR
+MmSaGetBufferSize (
+    IN PVOID Buffer
+    )
+
+/*++
+
+Routine Description:
+
+    Finds the usable size of a slab buffer.
+
+Arguments:
+
+    Buffer - The buffer to check.
+
+Return Value:
+
+    The object size of the buffer's slab class.
+
+    0 if Buffer is not in a slab.
+
+--*/
+
+{
+    PMM_SLAB_PAGE SlabPage;
+
+    SlabPage = (PMM_SLAB_PAGE)((ULONG_PTR)Buffer & ~(ULONG_PTR)PAGE_MASK);
+    if (SlabPage->Signature != SLAB_PAGE_SIGNATURE || SlabPage->ClassIndex >= MM_SLAB_CLASS_COUNT) {
+        DebugError(L"Buffer 0x%x is not in a slab\r\n", Buffer);
+        return 0;
+    }
+
+    return MmSlabClasses[SlabPage->ClassIndex].Statistics.ObjectSize;
+}
+
+PVOID
+MmSaAllocate (
+    IN ULONG_PTR Size
+    )
+
+/*++
+
+Routine Description:
+
+    Allocates a small buffer from its size class.
+
+Arguments:
+
+    Size - The size, in bytes, to allocate. Must not exceed MM_SLAB_MAX_SIZE.
+
+Return Value:
+
+    Pointer to the allocated memory if successful.
+
+    NULL if unsuccessful.
+
+--*/
+
+{
+    ULONG ClassIndex, WordIndex, BitIndex;
+    PMM_SLAB_CLASS SlabClass;
+    PMM_SLAB_PAGE SlabPage;
+
+    if (!SapInitialized || Size > MM_SLAB_MAX_SIZE) {
+        return NULL;
+    }
+
+    ClassIndex = MmSlabSizeToClass[(Size + 15) >> 4];
+    SlabClass = &MmSlabClasses[ClassIndex];
+
+    //
+    // Use a partially-used slab if possible.
+    //
+    if (!IsListEmpty(&SlabClass->PartialSlabs)) {
+        SlabPage = CONTAINING_RECORD(SlabClass->PartialSlabs.Flink, MM_SLAB_PAGE, ListEntry);
+    } else {
+        SlabPage = MmSapAllocateSlabPage(ClassIndex);
+        if (SlabPage == NULL) {
+            SlabClass->Statistics.FallbackCount++;
+            return NULL;
+        }
+
+        InsertHeadList(&SlabClass->PartialSlabs, &SlabPage->ListEntry);
+    }
+
+    //
+    // Take the first free object.
+    //
+    WordIndex = 0;
+    while (SlabPage->FreeBitmap[WordIndex] == 0) {
+        WordIndex++;
+    }
+
+    BitIndex = __builtin_ctzll(SlabPage->FreeBitmap[WordIndex]);
+    SlabPage->FreeBitmap[WordIndex] &= ~(1ULL << BitIndex);
+
+    //
+    // Full slabs are not kept on any list.
+    //
+    SlabPage->FreeCount--;
+    if (SlabPage->FreeCount == 0) {
+        RemoveEntryList(&SlabPage->ListEntry);
+        InitializeListHead(&SlabPage->ListEntry);
+    }
+
+    SlabClass->Statistics.AllocationCount++;
+    SlabClass->Statistics.ActiveObjects++;
+    if (SlabClass->Statistics.ActiveObjects > SlabClass->Statistics.PeakActiveObjects) {
+        SlabClass->Statistics.PeakActiveObjects = SlabClass->Statistics.ActiveObjects;
+    }
+
+    return (PVOID)((ULONG_PTR)SlabPage + SLAB_OBJECT_OFFSET + (((WordIndex * 64) + BitIndex) * SlabClass->Statistics.ObjectSize));
+}
+
+NTSTATUS
+MmSaFree (
+    IN PVOID Buffer
+    )
+
+/*++
+
+Routine Description:
+
+    Frees a buffer allocated by MmSaAllocate.
+
+Arguments:
+
+    Buffer - The buffer to free.
+
+Return Value:
+
+    STATUS_SUCCESS if successful.
+
+    STATUS_INVALID_PARAMETER if Buffer is not an allocated slab object.
+
+--*/
+
+{
+    PMM_SLAB_PAGE SlabPage;
+    PMM_SLAB_CLASS SlabClass;
+    ULONG_PTR Offset;
+    ULONG ObjectIndex;
+    ULONGLONG Mask;
+
+    //
+    // Find the slab page from the buffer address.
+    //
+    SlabPage = (PMM_SLAB_PAGE)((ULONG_PTR)Buffer & ~(ULONG_PTR)PAGE_MASK);
+    if (SlabPage->Signature != SLAB_PAGE_SIGNATURE || SlabPage->ClassIndex >= MM_SLAB_CLASS_COUNT) {
+        DebugError(L"Buffer 0x%x is not in a slab\r\n", Buffer);
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    SlabClass = &MmSlabClasses[SlabPage->ClassIndex];
+    Offset = (ULONG_PTR)Buffer - (ULONG_PTR)SlabPage;
+    if (Offset < SLAB_OBJECT_OFFSET || (Offset - SLAB_OBJECT_OFFSET) % SlabClass->Statistics.ObjectSize != 0) {
+        DebugError(L"Buffer 0x%x is not a slab object\r\n", Buffer);
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    ObjectIndex = (ULONG)((Offset - SLAB_OBJECT_OFFSET) / SlabClass->Statistics.ObjectSize);
+    if (ObjectIndex >= SlabClass->Statistics.ObjectsPerSlab) {
+        DebugError(L"Buffer 0x%x is not a slab object\r\n", Buffer);
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    Mask = 1ULL << (ObjectIndex % 64);
+    if (SlabPage->FreeBitmap[ObjectIndex / 64] & Mask) {
+        DebugError(L"Buffer 0x%x is already free\r\n", Buffer);
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    SlabPage->FreeBitmap[ObjectIndex / 64] |= Mask;
+    SlabPage->FreeCount++;
+    SlabClass->Statistics.FreeCount++;
+    SlabClass->Statistics.ActiveObjects--;
+
+    //
+    // A previously full slab goes back on the partial list.
+    //
+    if (SlabPage->FreeCount == 1) {
+        InsertHeadList(&SlabClass->PartialSlabs, &SlabPage->ListEntry);
+    }
+
+    //
+    // Return empty slabs to the page pool, keeping one per class to avoid thrashing.
+    //
+    if (SlabPage->FreeCount == SlabClass->Statistics.ObjectsPerSlab
+        && SlabClass->PartialSlabs.Flink != SlabClass->PartialSlabs.Blink) {
+        RemoveEntryList(&SlabPage->ListEntry);
+        SlabPage->Signature = 0;
+        *(PVOID *)SlabPage = MmSlabFreePages;
+        MmSlabFreePages = SlabPage;
+        SlabClass->Statistics.SlabCount--;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS
+BlMmQuerySlabStatistics (
+    OUT    PMEMORY_SLAB_CLASS_STATISTICS Statistics,
+    IN OUT PULONG                        ClassCount
+    )
+
+/*++
+
+Routine Description:
+
+    Reports per-class slab allocator statistics.
+
+Arguments:
+
+    Statistics - Pointer to an array that receives one entry per slab class.
+
+    ClassCount - Pointer to the number of entries in Statistics (0 to get required count).
+
+Return Value:
+
+    STATUS_SUCCESS if successful.
+
+    STATUS_BUFFER_TOO_SMALL if ClassCount is too small.
+
+--*/
+
+{
+    if (*ClassCount < MM_SLAB_CLASS_COUNT) {
+        *ClassCount = MM_SLAB_CLASS_COUNT;
+        return STATUS_BUFFER_TOO_SMALL;
+    }
+
+    for (ULONG Index = 0; Index < MM_SLAB_CLASS_COUNT; Index++) {
+        RtlCopyMemory(&Statistics[Index], &MmSlabClasses[Index].Statistics, sizeof(*Statistics));
+    }
+
+    *ClassCount = MM_SLAB_CLASS_COUNT;
+    return STATUS_SUCCESS;
+}
+
+VOID
+MmSaDestroy (
+    VOID
+    )
+
+/*++
+
+Routine Description:
+
+    Destroys the slab allocator.
+
+    Slab segments are page runs, and are released in bulk by MmPaDestroy.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    None.
+
+--*/
+
+{
+    SapInitialized = FALSE;
+    MmSlabSegmentCount = 0;
+    MmSlabFreePages = NULL;
+}
+
+VOID
+MmSaInitialize (
+    IN ULONG AllocationAttributes
+    )
+
+/*++
+
+Routine Description:
+
+    Initializes the slab allocator.
+
+    Slab pages are allocated on first use.
+
+Arguments:
+
+    AllocationAttributes - Flags to refer to when allocating slab pages.
+
+Return Value:
+
+    None.
+
+--*/
+
+{
+    PMM_SLAB_CLASS SlabClass;
+
+    for (ULONG Index = 0; Index < MM_SLAB_CLASS_COUNT; Index++) {
+        SlabClass = &MmSlabClasses[Index];
+        InitializeListHead(&SlabClass->PartialSlabs);
+        RtlZeroMemory(&SlabClass->Statistics, sizeof(SlabClass->Statistics));
+        SlabClass->Statistics.ObjectSize = MmSlabClassSizes[Index];
+        SlabClass->Statistics.ObjectsPerSlab = (PAGE_SIZE - SLAB_OBJECT_OFFSET) / MmSlabClassSizes[Index];
+        if (SlabClass->Statistics.ObjectsPerSlab > SLAB_BITMAP_WORDS * 64) {
+            SlabClass->Statistics.ObjectsPerSlab = SLAB_BITMAP_WORDS * 64;
+        }
+    }
+
+    MmSlabSegmentCount = 0;
+    MmSlabFreePages = NULL;
+    SapAllocationAttributes = AllocationAttributes;
+    SapInitialized = TRUE;
+}
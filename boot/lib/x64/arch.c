@@ -21,6 +21,7 @@ Module Name:
 #endif
 #include "mm.h"
 #include "arch.h"
+#include <crtcpu.h>
 
 #define REQUIRED_XSAVE_FEATURES (CPUID_XSAVE_FEATURE_XSAVEOPT | CPUID_XSAVE_FEATURE_XSAVEC | CPUID_XSAVE_FEATURE_XGETBV_ECX1)
 
@@ -50,6 +51,14 @@ BOOLEAN ArchDisableNx = FALSE;
 ULONG ArchCr4BitsToClear = 0;
 ULONG ArchXCr0BitsToClear = 0;
 
+//
+// When PCIDs are enabled, ArchPcidCr3 holds the CR3 value each PCID was
+// last loaded with. TLB entries tagged with a PCID are only kept across a
+// switch if that PCID is reloaded with the same CR3.
+//
+BOOLEAN ArchPcidEnabled = FALSE;
+ULONG_PTR ArchPcidCr3[ARCH_PCID_COUNT];
+
 VOID
 ArchTrapNoProcess (
     VOID
@@ -214,6 +223,7 @@ Return Value:
 
 {
     BOOLEAN Have5LevelPaging, Need5LevelPaging;
+    ULONG_PTR Cr3;
 
     //
     // Check if 5-level paging is enabled.
@@ -241,7 +251,23 @@ Return Value:
             return;
         }
 
-        __writecr3(NewContext->Cr3);
+        if (!ArchPcidEnabled) {
+            __writecr3(NewContext->Cr3);
+            return;
+        }
+
+        //
+        // Load the context's PCID, and keep its TLB entries unless its
+        // page tables have changed since it was last loaded.
+        //
+        Cr3 = NewContext->Cr3 | NewContext->Pcid;
+        if (ArchPcidCr3[NewContext->Pcid] == NewContext->Cr3) {
+            Cr3 |= CR3_NOFLUSH;
+        } else {
+            ArchPcidCr3[NewContext->Pcid] = NewContext->Cr3;
+        }
+
+        __writecr3(Cr3);
         return;
     }
 
@@ -410,7 +436,7 @@ Return Value:
     if (!(Cr4 & CR4_OSXSAVE)) {
         Cr4 |= CR4_OSXSAVE;
         __writecr4(Cr4);
-        ArchCr4BitsToClear = CR4_OSXSAVE;
+        ArchCr4BitsToClear |= CR4_OSXSAVE;
     }
 
     //
@@ -424,6 +450,69 @@ Return Value:
     }
 }
 
+VOID
+ArchEnablePcids (
+    VOID
+    )
+
+/*++
+
+Routine Description:
+
+    Assigns each execution context its own PCID, so that switching between
+    the application and firmware contexts does not flush the TLB.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    None.
+
+--*/
+
+{
+    ULONG_PTR Cr4;
+
+    //
+    // PCIDs only help if the application context is in use and switches
+    // to a firmware context.
+    //
+    if (CurrentExecutionContext != &ApplicationExecutionContext
+        || !(BlPlatformFlags & PLATFORM_FLAG_FIRMWARE_EXECUTION_CONTEXT_SUPPORTED)) {
+        return;
+    }
+
+    //
+    // Once CR4.PCIDE is set, the low bits of CR3 are the PCID, so neither
+    // context may use them for anything else. Setting CR4.PCIDE also
+    // faults if the current CR3 has any of them set.
+    //
+    if (((ApplicationExecutionContext.Cr3 | FirmwareExecutionContext.Cr3 | __readcr3()) & CR3_PCID_MASK) != 0) {
+        return;
+    }
+
+    Cr4 = __readcr4();
+    if (!(Cr4 & CR4_PCIDE)) {
+        __writecr4(Cr4 | CR4_PCIDE);
+        ArchCr4BitsToClear |= CR4_PCIDE;
+    }
+
+    ApplicationExecutionContext.Pcid = ARCH_PCID_APPLICATION;
+    FirmwareExecutionContext.Pcid = ARCH_PCID_FIRMWARE;
+    for (ULONG Index = 0; Index < ARCH_PCID_COUNT; Index++) {
+        ArchPcidCr3[Index] = (ULONG_PTR)-1;
+    }
+
+    ArchPcidEnabled = TRUE;
+
+    //
+    // Reload the current context with its PCID.
+    //
+    ArchSetPagingContext(CurrentExecutionContext, NULL);
+}
+
 VOID
 ArchRestoreProcessorFeatures (
     IN BOOLEAN DisableNx
@@ -446,6 +535,12 @@ Return Value:
 --*/
 
 {
+    //
+    // Drop back to the baseline CRT routines first, since the optimized
+    // variants may depend on the state about to be disabled.
+    //
+    _crt_select_routines(0);
+
     //
     // Clear unwanted XCR0 bits.
     //
@@ -454,6 +549,16 @@ Return Value:
         ArchXCr0BitsToClear = 0;
     }
 
+    //
+    // Go back to PCID 0 before PCIDs are disabled.
+    //
+    if (ArchPcidEnabled) {
+        __writecr3(__readcr3() & ~(ULONG_PTR)CR3_PCID_MASK);
+        ApplicationExecutionContext.Pcid = 0;
+        FirmwareExecutionContext.Pcid = 0;
+        ArchPcidEnabled = FALSE;
+    }
+
     //
     // Clear unwanted CR4 bits.
     //
@@ -501,6 +606,7 @@ Return Value:
     ULONG CpuVendor;
     CPUID_DATA CpuIdData;
     ULONGLONG Efer;
+    BOOLEAN PcidSupported;
 
     //
     // Disable miscellaneous features.
@@ -514,6 +620,7 @@ Return Value:
     // Enable XSAVE features.
     //
     BlArchCpuId(CPUID_FUNCTION_GET_FEATURES, 0, &CpuIdData);
+    PcidSupported = (CpuIdData.Ecx & CPUID_FEATURE_ECX_PCID) ? TRUE : FALSE;
     if ((CpuIdData.Ecx & CPUID_FEATURE_ECX_XSAVE) && BlArchIsCpuIdFunctionSupported(CPUID_FUNCTION_GET_XSAVE_FEATURES)) {
         BlArchCpuId(CPUID_FUNCTION_GET_XSAVE_FEATURES, 0, &CpuIdData);
         if ((CpuIdData.Eax & REQUIRED_XSAVE_FEATURES) == REQUIRED_XSAVE_FEATURES) {
@@ -546,6 +653,73 @@ Return Value:
     // Enable the configured features.
     //
     ArchEnableProcessorFeatures();
+
+    //
+    // Use PCIDs for context switches if possible.
+    //
+    if (PcidSupported) {
+        ArchEnablePcids();
+    }
+}
+
+VOID
+ArchSelectCrtRoutines (
+    VOID
+    )
+
+/*++
+
+Routine Description:
+
+    Probes the processor once and selects the fastest C runtime routines
+    it can run. Until this is called, the runtime uses variants that work
+    on any x64 processor.
+
+    Must be called after ArchInitializeProcessorFeatures, which enables
+    the AVX state that the AVX2 routines depend on.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    None.
+
+--*/
+
+{
+    CPUID_DATA CpuIdData;
+    ULONG Features;
+    BOOLEAN AvxEnabled;
+
+    Features = 0;
+
+    //
+    // AVX is only usable if the OS has enabled its state in XCR0.
+    //
+    AvxEnabled = FALSE;
+    BlArchCpuId(CPUID_FUNCTION_GET_FEATURES, 0, &CpuIdData);
+    if ((CpuIdData.Ecx & CPUID_FEATURE_ECX_AVX) && (BlPlatformFlags & PLATFORM_FLAG_XSAVE_SUPPORTED)) {
+        AvxEnabled = (_xgetbv(0) & (XCR0_SSE | XCR0_AVX)) == (XCR0_SSE | XCR0_AVX) ? TRUE : FALSE;
+    }
+
+    if (BlArchIsCpuIdFunctionSupported(CPUID_FUNCTION_GET_STRUCTURED_FEATURES)) {
+        BlArchCpuId(CPUID_FUNCTION_GET_STRUCTURED_FEATURES, 0, &CpuIdData);
+        if (CpuIdData.Ebx & CPUID_STRUCTURED_FEATURE_EBX_ERMS) {
+            Features |= CRT_CPU_FEATURE_ERMS;
+        }
+
+        if (CpuIdData.Edx & CPUID_STRUCTURED_FEATURE_EDX_FSRM) {
+            Features |= CRT_CPU_FEATURE_FSRM;
+        }
+
+        if (AvxEnabled && (CpuIdData.Ebx & CPUID_STRUCTURED_FEATURE_EBX_AVX2)) {
+            Features |= CRT_CPU_FEATURE_AVX2;
+        }
+    }
+
+    _crt_select_routines(Features);
 }
 
 USHORT
@@ -817,6 +991,10 @@ Return Value:
 
 {
     NTSTATUS Status;
+#if !defined(NDEBUG)
+    const crt_routine_variant_t *Variants;
+    size_t VariantCount;
+#endif
 
     if (Phase == 0) {
         //
@@ -868,10 +1046,21 @@ Return Value:
         //
         ArchInitializeProcessorFeatures();
 
+        //
+        // Select runtime routines for this processor.
+        //
+        ArchSelectCrtRoutines();
+
         return STATUS_SUCCESS;
     }
 #if !defined(NDEBUG)
     DebugInfo(L"Initializing architecture services (phase 1/1)...\r\n");
+
+    Variants = _crt_get_routine_variants(&VariantCount);
+    DebugInfo(L"Runtime routines:\r\n");
+    for (ULONG_PTR Index = 0; Index < VariantCount; Index++) {
+        DebugPrint(L"    %s: %s\r\n", Variants[Index].routine, Variants[Index].variant);
+    }
 #endif
     //
     // Install trap vectors to handle breakpoints and exceptions.
@@ -915,41 +1104,3 @@ Return Value:
     //
     BlFwReboot();
 }
-
-BOOLEAN
-MmArchTranslateVirtualAddress (
-    IN  PVOID             VirtualAddress,
-    OUT PPHYSICAL_ADDRESS PhysicalAddress
-    )
-
-/*++
-
-Routine Description:
-
-    Translates a virtual address to its equivalent physical address.
-
-Arguments:
-
-    VirtualAddress - The virtual address to translate.
-
-    PhysicalAddress - Pointer to a PHYSICAL_ADDRESS tha receives the translated address.
-
-Return Value:
-
-    TRUE if successful.
-
-    FALSE if unsuccessful.
-
---*/
-
-{
-    //
-    // TODO: Implement this routine.
-    //
-
-    if (PhysicalAddress != NULL) {
-        PhysicalAddress->QuadPart = (ULONGLONG)VirtualAddress;
-    }
-
-    return TRUE;
-}
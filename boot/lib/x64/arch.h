@@ -39,8 +39,18 @@ Module Name:
 //
 // CR3 (Control Register 3) bits.
 //
-#define CR3_PWT (1 << 3)
-#define CR3_PCD (1 << 5)
+#define CR3_PWT       (1 << 3)
+#define CR3_PCD       (1 << 4)
+#define CR3_PCID_MASK 0xfff
+#define CR3_NOFLUSH   (1ULL << 63)
+
+//
+// PCIDs (Process-Context Identifiers) assigned to execution contexts.
+// The firmware keeps PCID 0, which is what its own CR3 value implies.
+//
+#define ARCH_PCID_FIRMWARE    0
+#define ARCH_PCID_APPLICATION 1
+#define ARCH_PCID_COUNT       2
 
 //
 // CR4 (Control Register 4) bits.
@@ -121,13 +131,39 @@ Module Name:
 //
 #define IA32_EFER_NXE (1 << 11)
 
+//
+// Page table entry bits.
+//
+#define PTE_PRESENT      (1ULL << 0)
+#define PTE_WRITE        (1ULL << 1)
+#define PTE_USER         (1ULL << 2)
+#define PTE_WRITETHROUGH (1ULL << 3)
+#define PTE_CACHEDISABLE (1ULL << 4)
+#define PTE_ACCESSED     (1ULL << 5)
+#define PTE_DIRTY        (1ULL << 6)
+#define PTE_LARGE        (1ULL << 7)
+#define PTE_GLOBAL       (1ULL << 8)
+#define PTE_NX           (1ULL << 63)
+#define PTE_ADDRESS_MASK 0x000ffffffffff000ULL
+
+//
+// 4-level paging geometry. Level 0 is the page table and level 3 the
+// PML4; a level N entry maps PAGING_LEVEL_SIZE(N) bytes.
+//
+#define PAGING_LEVEL_COUNT                 4
+#define PAGING_ENTRY_COUNT                 512
+#define PAGING_LEVEL_SHIFT(Level)          (PAGE_SHIFT + 9 * (Level))
+#define PAGING_LEVEL_SIZE(Level)           (1ULL << PAGING_LEVEL_SHIFT(Level))
+#define PAGING_LEVEL_INDEX(Address, Level) (((ULONGLONG)(Address) >> PAGING_LEVEL_SHIFT(Level)) & (PAGING_ENTRY_COUNT - 1))
+
 //
 // CPUID function IDs.
 //
-#define CPUID_FUNCTION_GET_VENDOR            0x00000000
-#define CPUID_FUNCTION_GET_FEATURES          0x00000001
-#define CPUID_FUNCTION_GET_XSAVE_FEATURES    0x0000000d
-#define CPUID_FUNCTION_GET_EXTENDED_FEATURES 0x80000001
+#define CPUID_FUNCTION_GET_VENDOR              0x00000000
+#define CPUID_FUNCTION_GET_FEATURES            0x00000001
+#define CPUID_FUNCTION_GET_STRUCTURED_FEATURES 0x00000007
+#define CPUID_FUNCTION_GET_XSAVE_FEATURES      0x0000000d
+#define CPUID_FUNCTION_GET_EXTENDED_FEATURES   0x80000001
 
 //
 // CPUID vendor strings.
@@ -141,9 +177,16 @@ Module Name:
 // CPUID feature bits.
 //
 
+#define CPUID_FEATURE_ECX_PCID  (1 << 17)
 #define CPUID_FEATURE_ECX_XSAVE (1 << 26)
+#define CPUID_FEATURE_ECX_AVX   (1 << 28)
 
-#define CPUID_EXTENDED_FEATURE_EDX_NX (1 << 20)
+#define CPUID_STRUCTURED_FEATURE_EBX_AVX2 (1 << 5)
+#define CPUID_STRUCTURED_FEATURE_EBX_ERMS (1 << 9)
+#define CPUID_STRUCTURED_FEATURE_EDX_FSRM (1 << 4)
+
+#define CPUID_EXTENDED_FEATURE_EDX_NX      (1 << 20)
+#define CPUID_EXTENDED_FEATURE_EDX_PAGE1GB (1 << 26)
 
 #define CPUID_XSAVE_FEATURE_XSAVEOPT    (1 << 0)
 #define CPUID_XSAVE_FEATURE_XSAVEC      (1 << 1)
@@ -199,6 +242,8 @@ typedef struct {
     NTSTATUS Status;
 } TXT_PRIVATE_SPACE, *PTXT_PRIVATE_SPACE;
 
+extern EXECUTION_CONTEXT ApplicationExecutionContext, FirmwareExecutionContext;
+
 //
 // Control register services.
 //
@@ -329,6 +374,12 @@ BlArchGetCpuVendor (
     VOID
     );
 
+VOID
+ArchSetPagingContext (
+    IN PEXECUTION_CONTEXT NewContext,
+    IN PEXECUTION_CONTEXT CurrentContext
+    );
+
 VOID
 BlpArchInstallTrapVectors (
     VOID
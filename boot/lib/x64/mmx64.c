@@ -0,0 +1,723 @@
+/*++
+
+Copyright (c) 2025, Quinn Stephens, w1redch4d
+All rights reserved.
+Provided under the BSD 3-Clause license.
+
+Module Name:
+
+    mmx64.c
+
+Abstract:
+
+    Address translation services for x64 processors.
+
+--*/
+
+#include "mm.h"
+#include "arch.h"
+
+//
+// Physical memory below this address is always identity mapped, so that
+// firmware data and MMIO in the first 4 GiB stay reachable.
+//
+#define MM_ARCH_IDENTITY_MINIMUM 0x100000000ULL
+
+//
+// Allocations in the kernel range are mapped here, in the top 8 TiB of
+// the address space.
+//
+#define MM_ARCH_KERNEL_RANGE_BASE  0xfffff80000000000ULL
+#define MM_ARCH_KERNEL_RANGE_LIMIT 0xffffffffffe00000ULL
+
+//
+// Page table pages come from a dedicated pool, refilled this many pages
+// at a time. A few pages are held back so that mapping a new pool chunk
+// can never run out of tables.
+//
+#define MM_PAGE_TABLE_POOL_PAGES   64
+#define MM_PAGE_TABLE_POOL_RESERVE PAGING_LEVEL_COUNT
+
+//
+// Number of entries in the translation cache. Must be a power of two.
+//
+#define MM_TRANSLATION_CACHE_SIZE 64
+#define MM_TRANSLATION_CACHE_INVALID ((ULONG_PTR)-1)
+
+PULONGLONG MmArchPml4;
+ULONG_PTR MmArchOriginalCr3;
+ULONGLONG MmArchIdentityLimit;
+ULONG_PTR MmArchKernelRangeNext;
+BOOLEAN MmArchLargePages1Gb, MmArchNxEnabled;
+
+ULONG_PTR MmArchPageTablePool;
+ULONG MmArchPageTablePoolCount, MmArchPageTablePoolUsed;
+PVOID MmArchFreePageTables;
+BOOLEAN MmArchPageTablePoolRefilling;
+
+//
+// Page table usage, for debugging.
+//
+ULONG MmArchPageTablePages;
+ULONG MmArchMappingCount[PAGING_LEVEL_COUNT - 1];
+
+//
+// Direct-mapped cache of recent translations, keyed by virtual page
+// number. It belongs to the address space whose CR3 is in
+// MmArchTranslationCacheCr3, and is flushed when that changes.
+//
+typedef struct {
+    ULONG_PTR VirtualPage;
+    ULONG_PTR PhysicalPage;
+} MM_TRANSLATION_CACHE_ENTRY;
+
+MM_TRANSLATION_CACHE_ENTRY MmArchTranslationCache[MM_TRANSLATION_CACHE_SIZE];
+ULONG_PTR MmArchTranslationCacheCr3;
+ULONGLONG MmArchTranslationCacheHits, MmArchTranslationCacheMisses;
+
+VOID
+MmArchFlushTranslationCache (
+    VOID
+    )
+
+/*++
+
+Routine Description:
+
+    Invalidates every entry in the translation cache.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    None.
+
+--*/
+
+{
+    for (ULONG Index = 0; Index < MM_TRANSLATION_CACHE_SIZE; Index++) {
+        MmArchTranslationCache[Index].VirtualPage = MM_TRANSLATION_CACHE_INVALID;
+    }
+
+    MmArchTranslationCacheCr3 = ApplicationExecutionContext.Cr3;
+}
+
+VOID
+MmArchpInvalidateTranslations (
+    IN ULONG_PTR VirtualAddress,
+    IN ULONGLONG Size
+    )
+
+/*++
+
+Routine Description:
+
+    Invalidates any cached translations for a range of virtual addresses.
+
+Arguments:
+
+    VirtualAddress - The first virtual address of the range.
+
+    Size - The number of bytes in the range.
+
+Return Value:
+
+    None.
+
+--*/
+
+{
+    ULONG_PTR VirtualPage;
+    ULONGLONG PageCount;
+    MM_TRANSLATION_CACHE_ENTRY *Entry;
+
+    PageCount = ALIGN_UP(Size, PAGE_SIZE) >> PAGE_SHIFT;
+    if (PageCount >= MM_TRANSLATION_CACHE_SIZE) {
+        MmArchFlushTranslationCache();
+        return;
+    }
+
+    VirtualPage = VirtualAddress >> PAGE_SHIFT;
+    for (ULONG Index = 0; Index < PageCount; Index++, VirtualPage++) {
+        Entry = &MmArchTranslationCache[VirtualPage & (MM_TRANSLATION_CACHE_SIZE - 1)];
+        if (Entry->VirtualPage == VirtualPage) {
+            Entry->VirtualPage = MM_TRANSLATION_CACHE_INVALID;
+        }
+    }
+}
+
+NTSTATUS
+MmArchpAllocatePageTable (
+    OUT PULONGLONG *Table
+    )
+
+/*++
+
+Routine Description:
+
+    Allocates a zeroed page table page from the page table pool.
+
+Arguments:
+
+    Table - Pointer to a PULONGLONG that receives the page table.
+
+Return Value:
+
+    STATUS_SUCCESS if successful.
+
+    STATUS_NO_MEMORY if the pool is empty and cannot be refilled.
+
+--*/
+
+{
+    NTSTATUS Status;
+    ULONG_PTR Chunk;
+    PVOID Page;
+
+    //
+    // Refill the pool before it runs dry. The rest of the old chunk goes
+    // on the free list, where the mapping of the new chunk can use it.
+    //
+    if (MmArchFreePageTables == NULL
+        && MmArchPageTablePoolCount - MmArchPageTablePoolUsed <= MM_PAGE_TABLE_POOL_RESERVE
+        && !MmArchPageTablePoolRefilling) {
+        while (MmArchPageTablePoolUsed < MmArchPageTablePoolCount) {
+            Page = (PVOID)(MmArchPageTablePool + (ULONG_PTR)MmArchPageTablePoolUsed++ * PAGE_SIZE);
+            *(PVOID *)Page = MmArchFreePageTables;
+            MmArchFreePageTables = Page;
+        }
+
+        MmArchPageTablePoolRefilling = TRUE;
+        Chunk = 0;
+        Status = MmPapAllocatePagesInRange((PVOID *)&Chunk, MM_PAGE_TABLE_POOL_PAGES, MEMORY_TYPE_PAGE_TABLE, 0, NULL, 0);
+        MmArchPageTablePoolRefilling = FALSE;
+        if (NT_SUCCESS(Status)) {
+            MmArchPageTablePool = Chunk;
+            MmArchPageTablePoolCount = MM_PAGE_TABLE_POOL_PAGES;
+            MmArchPageTablePoolUsed = 0;
+        }
+    }
+
+    if (MmArchFreePageTables != NULL) {
+        Page = MmArchFreePageTables;
+        MmArchFreePageTables = *(PVOID *)Page;
+    } else if (MmArchPageTablePoolUsed < MmArchPageTablePoolCount) {
+        Page = (PVOID)(MmArchPageTablePool + (ULONG_PTR)MmArchPageTablePoolUsed++ * PAGE_SIZE);
+    } else {
+        return STATUS_NO_MEMORY;
+    }
+
+    RtlZeroMemory(Page, PAGE_SIZE);
+    MmArchPageTablePages++;
+    *Table = Page;
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS
+MmArchpMapPage (
+    IN ULONG_PTR VirtualAddress,
+    IN ULONGLONG PhysicalAddress,
+    IN ULONG     Level,
+    IN ULONGLONG Flags
+    )
+
+/*++
+
+Routine Description:
+
+    Maps a single page of any size, creating page tables as needed.
+
+Arguments:
+
+    VirtualAddress - The virtual address of the page. Must be aligned to
+        the page size of Level.
+
+    PhysicalAddress - The physical address of the page. Must be aligned to
+        the page size of Level.
+
+    Level - The paging level of the entry that maps the page: 0 for a
+        4 KiB page, 1 for a 2 MiB page, or 2 for a 1 GiB page.
+
+    Flags - The page table entry bits for the mapping.
+
+Return Value:
+
+    STATUS_SUCCESS if successful.
+
+    STATUS_CONFLICTING_ADDRESSES if part of the page is already mapped
+        somewhere else.
+
+    Any other status value returned by MmArchpAllocatePageTable.
+
+--*/
+
+{
+    NTSTATUS Status;
+    PULONGLONG Table, NextTable;
+    ULONGLONG Entry, Offset;
+
+    Table = MmArchPml4;
+    for (ULONG TableLevel = PAGING_LEVEL_COUNT - 1; TableLevel > Level; TableLevel--) {
+        Entry = Table[PAGING_LEVEL_INDEX(VirtualAddress, TableLevel)];
+        if (!(Entry & PTE_PRESENT)) {
+            Status = MmArchpAllocatePageTable(&NextTable);
+            if (!NT_SUCCESS(Status)) {
+                return Status;
+            }
+
+            Table[PAGING_LEVEL_INDEX(VirtualAddress, TableLevel)] = (ULONG_PTR)NextTable | PTE_PRESENT | PTE_WRITE;
+            Table = NextTable;
+            continue;
+        }
+
+        //
+        // A larger page already covers this address. That is fine as long
+        // as it maps it to the same place.
+        //
+        if (Entry & PTE_LARGE) {
+            Offset = VirtualAddress & (PAGING_LEVEL_SIZE(TableLevel) - 1);
+            if ((Entry & PTE_ADDRESS_MASK & ~(PAGING_LEVEL_SIZE(TableLevel) - 1)) + Offset == PhysicalAddress) {
+                return STATUS_SUCCESS;
+            }
+
+            return STATUS_CONFLICTING_ADDRESSES;
+        }
+
+        Table = (PULONGLONG)(ULONG_PTR)(Entry & PTE_ADDRESS_MASK);
+    }
+
+    Entry = Table[PAGING_LEVEL_INDEX(VirtualAddress, Level)];
+    if (Entry & PTE_PRESENT) {
+        if ((Level == 0 || (Entry & PTE_LARGE)) && (Entry & PTE_ADDRESS_MASK) == PhysicalAddress) {
+            return STATUS_SUCCESS;
+        }
+
+        return STATUS_CONFLICTING_ADDRESSES;
+    }
+
+    Table[PAGING_LEVEL_INDEX(VirtualAddress, Level)] = PhysicalAddress | Flags | (Level != 0 ? PTE_LARGE : 0);
+    MmArchMappingCount[Level]++;
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS
+MmArchMapPhysicalRange (
+    IN ULONG_PTR VirtualAddress,
+    IN ULONGLONG PhysicalAddress,
+    IN ULONGLONG Size,
+    IN ULONG     Attributes
+    )
+
+/*++
+
+Routine Description:
+
+    Maps a range of physical memory into the application address space,
+    using the largest pages that fit.
+
+    Does nothing until MmArchInitialize has built the address space, since
+    the firmware identity maps everything until then.
+
+Arguments:
+
+    VirtualAddress - The page-aligned virtual address to map at.
+
+    PhysicalAddress - The page-aligned physical address to map.
+
+    Size - The number of bytes to map, rounded up to whole pages.
+
+    Attributes - MEMORY_ATTRIBUTE_* caching and protection attributes.
+
+Return Value:
+
+    STATUS_SUCCESS if successful.
+
+    STATUS_INVALID_PARAMETER if either address is not page-aligned.
+
+    Any other status value returned by MmArchpMapPage.
+
+--*/
+
+{
+    NTSTATUS Status;
+    ULONGLONG Flags, Remaining;
+    ULONG Level;
+
+    if (MmArchPml4 == NULL) {
+        return STATUS_SUCCESS;
+    }
+
+    if ((VirtualAddress & PAGE_MASK) != 0 || (PhysicalAddress & PAGE_MASK) != 0) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    Flags = PTE_PRESENT;
+    if (!(Attributes & MEMORY_ATTRIBUTE_WP)) {
+        Flags |= PTE_WRITE;
+    }
+
+    if (Attributes & (MEMORY_ATTRIBUTE_UC | MEMORY_ATTRIBUTE_UCE)) {
+        Flags |= PTE_CACHEDISABLE | PTE_WRITETHROUGH;
+    } else if (Attributes & MEMORY_ATTRIBUTE_WT) {
+        Flags |= PTE_WRITETHROUGH;
+    }
+
+    if ((Attributes & MEMORY_ATTRIBUTE_XP) && MmArchNxEnabled) {
+        Flags |= PTE_NX;
+    }
+
+    MmArchpInvalidateTranslations(VirtualAddress, Size);
+    Remaining = ALIGN_UP(Size, PAGE_SIZE);
+    while (Remaining != 0) {
+        //
+        // Pick the largest page that both addresses are aligned to and
+        // that does not run past the end of the range.
+        //
+        Level = MmArchLargePages1Gb ? 2 : 1;
+        while (Level != 0
+               && (((VirtualAddress | PhysicalAddress) & (PAGING_LEVEL_SIZE(Level) - 1)) != 0
+                   || Remaining < PAGING_LEVEL_SIZE(Level))) {
+            Level--;
+        }
+
+        Status = MmArchpMapPage(VirtualAddress, PhysicalAddress, Level, Flags);
+        if (!NT_SUCCESS(Status)) {
+            return Status;
+        }
+
+        VirtualAddress += PAGING_LEVEL_SIZE(Level);
+        PhysicalAddress += PAGING_LEVEL_SIZE(Level);
+        Remaining -= PAGING_LEVEL_SIZE(Level);
+    }
+
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS
+MmArchMapKernelRange (
+    IN OUT ULONG_PTR *VirtualAddress,
+    IN     ULONGLONG PhysicalAddress,
+    IN     ULONGLONG Size,
+    IN     BOOLEAN   Fixed
+    )
+
+/*++
+
+Routine Description:
+
+    Maps a range of physical memory into the kernel range of the
+    application address space.
+
+    Kernel range addresses are handed out in ascending order and are not
+    reused. Ranges of at least MM_LARGE_PAGE_SIZE bytes get an address with
+    the same offset into a large page as PhysicalAddress, so that they can
+    be mapped with large pages.
+
+Arguments:
+
+    VirtualAddress - Pointer to the virtual address to map at if Fixed is
+        TRUE. Receives the virtual address of the range.
+
+    PhysicalAddress - The page-aligned physical address to map.
+
+    Size - The number of bytes to map, rounded up to whole pages.
+
+    Fixed - Whether to map at VirtualAddress instead of picking an address.
+
+Return Value:
+
+    STATUS_SUCCESS if successful.
+
+    STATUS_NOT_SUPPORTED if the address space has not been built.
+
+    STATUS_INVALID_PARAMETER if a fixed range is not in the kernel range.
+
+    STATUS_NO_MEMORY if the kernel range is exhausted.
+
+    Any other status value returned by MmArchMapPhysicalRange.
+
+--*/
+
+{
+    NTSTATUS Status;
+    ULONG_PTR Address;
+
+    if (MmArchPml4 == NULL) {
+        return STATUS_NOT_SUPPORTED;
+    }
+
+    Size = ALIGN_UP(Size, PAGE_SIZE);
+    if (Fixed) {
+        Address = *VirtualAddress;
+        if (Address < MM_ARCH_KERNEL_RANGE_BASE || Address >= MM_ARCH_KERNEL_RANGE_LIMIT
+            || Size > MM_ARCH_KERNEL_RANGE_LIMIT - Address) {
+            return STATUS_INVALID_PARAMETER;
+        }
+    } else {
+        Address = MmArchKernelRangeNext;
+        if (Size >= MM_LARGE_PAGE_SIZE) {
+            Address = ALIGN_UP(Address, MM_LARGE_PAGE_SIZE) + (PhysicalAddress & (MM_LARGE_PAGE_SIZE - 1));
+        }
+
+        if (Address >= MM_ARCH_KERNEL_RANGE_LIMIT || Size > MM_ARCH_KERNEL_RANGE_LIMIT - Address) {
+            return STATUS_NO_MEMORY;
+        }
+    }
+
+    Status = MmArchMapPhysicalRange(Address, PhysicalAddress, Size, 0);
+    if (!NT_SUCCESS(Status)) {
+        return Status;
+    }
+
+    if (Address + Size > MmArchKernelRangeNext) {
+        MmArchKernelRangeNext = Address + Size;
+    }
+
+    *VirtualAddress = Address;
+    return STATUS_SUCCESS;
+}
+
+BOOLEAN
+MmArchTranslateVirtualAddress (
+    IN  PVOID             VirtualAddress,
+    OUT PPHYSICAL_ADDRESS PhysicalAddress
+    )
+
+/*++
+
+Routine Description:
+
+    Translates a virtual address to its equivalent physical address.
+
+Arguments:
+
+    VirtualAddress - The virtual address to translate.
+
+    PhysicalAddress - Pointer to a PHYSICAL_ADDRESS tha receives the translated address.
+
+Return Value:
+
+    TRUE if successful.
+
+    FALSE if unsuccessful.
+
+--*/
+
+{
+    PULONGLONG Table;
+    ULONGLONG Entry, Translation;
+    ULONG_PTR VirtualPage;
+    MM_TRANSLATION_CACHE_ENTRY *CacheEntry;
+
+    //
+    // Addresses are identity mapped until the address space is built, and
+    // below MmArchIdentityLimit afterwards.
+    //
+    if (MmArchPml4 == NULL || (ULONG_PTR)VirtualAddress < MmArchIdentityLimit) {
+        if (PhysicalAddress != NULL) {
+            PhysicalAddress->QuadPart = (ULONGLONG)VirtualAddress;
+        }
+
+        return TRUE;
+    }
+
+    //
+    // Try the cache before walking the page tables.
+    //
+    if (MmArchTranslationCacheCr3 != ApplicationExecutionContext.Cr3) {
+        MmArchFlushTranslationCache();
+    }
+
+    VirtualPage = (ULONG_PTR)VirtualAddress >> PAGE_SHIFT;
+    CacheEntry = &MmArchTranslationCache[VirtualPage & (MM_TRANSLATION_CACHE_SIZE - 1)];
+    if (CacheEntry->VirtualPage == VirtualPage) {
+        MmArchTranslationCacheHits++;
+        if (PhysicalAddress != NULL) {
+            PhysicalAddress->QuadPart = ((ULONGLONG)CacheEntry->PhysicalPage << PAGE_SHIFT) | ((ULONG_PTR)VirtualAddress & PAGE_MASK);
+        }
+
+        return TRUE;
+    }
+
+    MmArchTranslationCacheMisses++;
+    Table = MmArchPml4;
+    for (ULONG Level = PAGING_LEVEL_COUNT - 1;; Level--) {
+        Entry = Table[PAGING_LEVEL_INDEX(VirtualAddress, Level)];
+        if (!(Entry & PTE_PRESENT)) {
+            return FALSE;
+        }
+
+        if (Level == 0 || (Entry & PTE_LARGE)) {
+            Translation = (Entry & PTE_ADDRESS_MASK & ~(PAGING_LEVEL_SIZE(Level) - 1))
+                          + ((ULONG_PTR)VirtualAddress & (PAGING_LEVEL_SIZE(Level) - 1));
+            CacheEntry->VirtualPage = VirtualPage;
+            CacheEntry->PhysicalPage = Translation >> PAGE_SHIFT;
+            if (PhysicalAddress != NULL) {
+                PhysicalAddress->QuadPart = Translation;
+            }
+
+            return TRUE;
+        }
+
+        Table = (PULONGLONG)(ULONG_PTR)(Entry & PTE_ADDRESS_MASK);
+    }
+}
+
+NTSTATUS
+MmArchInitialize (
+    VOID
+    )
+
+/*++
+
+Routine Description:
+
+    Builds the application address space and switches to it.
+
+    All physical memory in the memory map, and at least the first 4 GiB,
+    is identity mapped with the largest pages available.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    STATUS_SUCCESS if successful.
+
+    STATUS_NOT_SUPPORTED if 5-level paging is active.
+
+    Any other status value returned by MmFwGetPageLimit,
+    MmArchpAllocatePageTable or MmArchMapPhysicalRange.
+
+--*/
+
+{
+    NTSTATUS Status;
+    CPUID_DATA CpuIdData;
+    PULONGLONG Pml4;
+    ULONG_PTR LimitPage;
+    ULONGLONG IdentityLimit;
+
+    if (BlArchIsFiveLevelPagingActive()) {
+        //
+        // TODO: Build 5-level page tables.
+        //
+        DebugError(L"5-level paging not implemented\r\n");
+        return STATUS_NOT_SUPPORTED;
+    }
+
+    //
+    // Check which page sizes and protections are available.
+    //
+    MmArchLargePages1Gb = FALSE;
+    if (BlArchIsCpuIdFunctionSupported(CPUID_FUNCTION_GET_EXTENDED_FEATURES)) {
+        BlArchCpuId(CPUID_FUNCTION_GET_EXTENDED_FEATURES, 0, &CpuIdData);
+        MmArchLargePages1Gb = (CpuIdData.Edx & CPUID_EXTENDED_FEATURE_EDX_PAGE1GB) ? TRUE : FALSE;
+    }
+
+    MmArchNxEnabled = (__readmsr(IA32_EFER) & IA32_EFER_NXE) ? TRUE : FALSE;
+
+    //
+    // Identity map everything in the firmware memory map, not just free
+    // memory, so that the image and firmware data stay reachable.
+    //
+    Status = MmFwGetPageLimit(&LimitPage);
+    if (!NT_SUCCESS(Status)) {
+        return Status;
+    }
+
+    Status = MmArchpAllocatePageTable(&Pml4);
+    if (!NT_SUCCESS(Status)) {
+        return Status;
+    }
+
+    MmArchPml4 = Pml4;
+    IdentityLimit = (ULONGLONG)LimitPage << PAGE_SHIFT;
+    if (IdentityLimit < MM_ARCH_IDENTITY_MINIMUM) {
+        IdentityLimit = MM_ARCH_IDENTITY_MINIMUM;
+    }
+
+    Status = MmArchMapPhysicalRange(0, 0, IdentityLimit, 0);
+    if (!NT_SUCCESS(Status)) {
+        MmArchPml4 = NULL;
+        return Status;
+    }
+
+    MmArchIdentityLimit = IdentityLimit;
+    MmArchKernelRangeNext = MM_ARCH_KERNEL_RANGE_BASE;
+
+#if !defined(NDEBUG)
+    DebugInfo(
+        L"Paging: %d page table pages, %d 1 GiB, %d 2 MiB and %d 4 KiB mappings\r\n",
+        MmArchPageTablePages,
+        MmArchMappingCount[2],
+        MmArchMappingCount[1],
+        MmArchMappingCount[0]
+    );
+#endif
+
+    //
+    // Switch the application context to the new address space.
+    //
+    MmArchOriginalCr3 = ApplicationExecutionContext.Cr3;
+    ApplicationExecutionContext.Cr3 = (ULONG_PTR)MmArchPml4;
+    if (CurrentExecutionContext == &ApplicationExecutionContext) {
+        ArchSetPagingContext(&ApplicationExecutionContext, NULL);
+    }
+
+    MmArchFlushTranslationCache();
+
+    return STATUS_SUCCESS;
+}
+
+VOID
+MmArchDestroy (
+    VOID
+    )
+
+/*++
+
+Routine Description:
+
+    Switches the application context back to the address space it started
+    with, so that the page tables can be released.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    None.
+
+--*/
+
+{
+    if (MmArchPml4 == NULL) {
+        return;
+    }
+
+#if !defined(NDEBUG)
+    DebugInfo(
+        L"Paging: %d translation cache hits, %d misses\r\n",
+        (ULONG)MmArchTranslationCacheHits,
+        (ULONG)MmArchTranslationCacheMisses
+    );
+#endif
+
+    ApplicationExecutionContext.Cr3 = MmArchOriginalCr3;
+    if (CurrentExecutionContext == &ApplicationExecutionContext) {
+        ArchSetPagingContext(&ApplicationExecutionContext, NULL);
+    }
+
+    MmArchPml4 = NULL;
+    MmArchIdentityLimit = 0;
+    MmArchKernelRangeNext = 0;
+    MmArchFlushTranslationCache();
+    MmArchPageTablePoolCount = 0;
+    MmArchPageTablePoolUsed = 0;
+    MmArchFreePageTables = NULL;
+}
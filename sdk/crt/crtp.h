@@ -0,0 +1,109 @@
+/*++
+
+Copyright (c) 2025, Quinn Stephens, w1redch4d
+All rights reserved.
+Provided under the BSD 3-Clause license.
+
+Module Name:
+
+    crtp.h
+
+Abstract:
+
+    Private C runtime definitions.
+
+--*/
+
+#pragma once
+
+#ifndef __CRTP_H
+#define __CRTP_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <wchar.h>
+#include <crtcpu.h>
+
+//
+// Word-sized accesses to byte buffers. __crt_uword_t may be unaligned.
+//
+typedef size_t __attribute__((__may_alias__)) __crt_word_t;
+typedef size_t __attribute__((__may_alias__, __aligned__(1))) __crt_uword_t;
+
+#define __CRT_WORD_SIZE sizeof(size_t)
+#define __CRT_WORD_MASK (__CRT_WORD_SIZE - 1)
+
+//
+// Routine dispatch table. Every entry starts out as a variant that runs
+// on any processor of the target architecture, and is replaced when
+// _crt_select_routines is given the features for a faster one.
+//
+typedef struct {
+    void *(*memset)(void *s, int c, size_t n);
+    void *(*memcpy)(void *dest, const void *src, size_t n);
+    void *(*memmove)(void *dest, const void *src, size_t n);
+    int (*memcmp)(const void *s1, const void *s2, size_t n);
+    void *(*memchr)(const void *s, int c, size_t n);
+    int (*wmemcmp)(const wchar_t *s1, const wchar_t *s2, size_t n);
+    wchar_t *(*wmemchr)(const wchar_t *wcs, wchar_t wc, size_t n);
+    size_t (*wcslen)(const wchar_t *s);
+    size_t (*wcsnlen)(const wchar_t *s, size_t maxlen);
+    int (*wcscmp)(const wchar_t *s1, const wchar_t *s2);
+    wchar_t *(*wcschr)(const wchar_t *wcs, wchar_t wc);
+    wchar_t *(*wcsrchr)(const wchar_t *wcs, wchar_t wc);
+} __crt_dispatch_table_t;
+
+extern __crt_dispatch_table_t __crt_dispatch;
+
+//
+// Portable variants.
+//
+void *__memset_generic(void *s, int c, size_t n);
+void *__memcpy_generic(void *dest, const void *src, size_t n);
+void *__memmove_generic(void *dest, const void *src, size_t n);
+int __memcmp_generic(const void *s1, const void *s2, size_t n);
+void *__memchr_generic(const void *s, int c, size_t n);
+int __wmemcmp_generic(const wchar_t *s1, const wchar_t *s2, size_t n);
+wchar_t *__wmemchr_generic(const wchar_t *wcs, wchar_t wc, size_t n);
+size_t __wcslen_generic(const wchar_t *s);
+size_t __wcsnlen_generic(const wchar_t *s, size_t maxlen);
+int __wcscmp_generic(const wchar_t *s1, const wchar_t *s2);
+wchar_t *__wcschr_generic(const wchar_t *wcs, wchar_t wc);
+wchar_t *__wcsrchr_generic(const wchar_t *wcs, wchar_t wc);
+
+//
+// REP MOVSB/STOSB variants.
+//
+#if defined(__x86_64__) || defined(__i386__)
+void *__memset_erms(void *s, int c, size_t n);
+void *__memcpy_erms(void *dest, const void *src, size_t n);
+void *__memcpy_fsrm(void *dest, const void *src, size_t n);
+void *__memmove_erms(void *dest, const void *src, size_t n);
+void *__memmove_fsrm(void *dest, const void *src, size_t n);
+#endif
+
+//
+// Vector variants. The wide-character kernels assume 16-bit wchar_t, as
+// used by UEFI.
+//
+#if defined(__x86_64__)
+int __memcmp_sse2(const void *s1, const void *s2, size_t n);
+int __memcmp_avx2(const void *s1, const void *s2, size_t n);
+void *__memchr_sse2(const void *s, int c, size_t n);
+void *__memchr_avx2(const void *s, int c, size_t n);
+#endif
+
+#if defined(__x86_64__) && __SIZEOF_WCHAR_T__ == 2
+#define __CRT_WCHAR_VECTOR 1
+int __wmemcmp_sse2(const wchar_t *s1, const wchar_t *s2, size_t n);
+int __wmemcmp_avx2(const wchar_t *s1, const wchar_t *s2, size_t n);
+wchar_t *__wmemchr_sse2(const wchar_t *wcs, wchar_t wc, size_t n);
+wchar_t *__wmemchr_avx2(const wchar_t *wcs, wchar_t wc, size_t n);
+size_t __wcslen_sse2(const wchar_t *s);
+size_t __wcsnlen_sse2(const wchar_t *s, size_t maxlen);
+int __wcscmp_sse2(const wchar_t *s1, const wchar_t *s2);
+wchar_t *__wcschr_sse2(const wchar_t *wcs, wchar_t wc);
+wchar_t *__wcsrchr_sse2(const wchar_t *wcs, wchar_t wc);
+#endif
+
+#endif // __CRTP_H
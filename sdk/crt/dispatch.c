@@ -0,0 +1,155 @@
+/*++
+
+Copyright (c) 2025, Quinn Stephens, w1redch4d
+All rights reserved.
+Provided under the BSD 3-Clause license.
+
+Module Name:
+
+    dispatch.c
+
+Abstract:
+
+    Processor-specific routine selection.
+
+--*/
+
+#include "crtp.h"
+
+enum {
+    __CRT_ROUTINE_MEMSET,
+    __CRT_ROUTINE_MEMCPY,
+    __CRT_ROUTINE_MEMMOVE,
+    __CRT_ROUTINE_MEMCMP,
+    __CRT_ROUTINE_MEMCHR,
+    __CRT_ROUTINE_WMEMCMP,
+    __CRT_ROUTINE_WMEMCHR,
+    __CRT_ROUTINE_WCSLEN,
+    __CRT_ROUTINE_WCSNLEN,
+    __CRT_ROUTINE_WCSCMP,
+    __CRT_ROUTINE_WCSCHR,
+    __CRT_ROUTINE_WCSRCHR,
+    __CRT_ROUTINE_COUNT
+};
+
+/*
+ * SSE2 is part of the x64 baseline, so its variants are usable before any
+ * features are reported.
+ */
+#if defined(__x86_64__)
+#define __BASELINE_VECTOR      L"sse2"
+#define __BASELINE(routine)    __##routine##_sse2
+#else
+#define __BASELINE_VECTOR      L"generic"
+#define __BASELINE(routine)    __##routine##_generic
+#endif
+
+#if defined(__CRT_WCHAR_VECTOR)
+#define __BASELINE_WCHAR       L"sse2"
+#define __BASELINE_W(routine)  __##routine##_sse2
+#else
+#define __BASELINE_WCHAR       L"generic"
+#define __BASELINE_W(routine)  __##routine##_generic
+#endif
+
+/*
+ * The baseline selection. _crt_select_routines starts from it every time, so
+ * a later call with fewer features also withdraws earlier upgrades.
+ */
+#define __CRT_BASELINE_DISPATCH {                                       \
+    .memset = __memset_generic,                                         \
+    .memcpy = __memcpy_generic,                                         \
+    .memmove = __memmove_generic,                                       \
+    .memcmp = __BASELINE(memcmp),                                       \
+    .memchr = __BASELINE(memchr),                                       \
+    .wmemcmp = __BASELINE_W(wmemcmp),                                   \
+    .wmemchr = __BASELINE_W(wmemchr),                                   \
+    .wcslen = __BASELINE_W(wcslen),                                     \
+    .wcsnlen = __BASELINE_W(wcsnlen),                                   \
+    .wcscmp = __BASELINE_W(wcscmp),                                     \
+    .wcschr = __BASELINE_W(wcschr),                                     \
+    .wcsrchr = __BASELINE_W(wcsrchr)                                    \
+}
+
+#define __CRT_BASELINE_VARIANTS {                                       \
+    [__CRT_ROUTINE_MEMSET] = { L"memset", L"generic" },                 \
+    [__CRT_ROUTINE_MEMCPY] = { L"memcpy", L"generic" },                 \
+    [__CRT_ROUTINE_MEMMOVE] = { L"memmove", L"generic" },               \
+    [__CRT_ROUTINE_MEMCMP] = { L"memcmp", __BASELINE_VECTOR },          \
+    [__CRT_ROUTINE_MEMCHR] = { L"memchr", __BASELINE_VECTOR },          \
+    [__CRT_ROUTINE_WMEMCMP] = { L"wmemcmp", __BASELINE_WCHAR },         \
+    [__CRT_ROUTINE_WMEMCHR] = { L"wmemchr", __BASELINE_WCHAR },         \
+    [__CRT_ROUTINE_WCSLEN] = { L"wcslen", __BASELINE_WCHAR },           \
+    [__CRT_ROUTINE_WCSNLEN] = { L"wcsnlen", __BASELINE_WCHAR },         \
+    [__CRT_ROUTINE_WCSCMP] = { L"wcscmp", __BASELINE_WCHAR },           \
+    [__CRT_ROUTINE_WCSCHR] = { L"wcschr", __BASELINE_WCHAR },           \
+    [__CRT_ROUTINE_WCSRCHR] = { L"wcsrchr", __BASELINE_WCHAR }          \
+}
+
+__crt_dispatch_table_t __crt_dispatch = __CRT_BASELINE_DISPATCH;
+
+static const __crt_dispatch_table_t __crt_baseline_dispatch = __CRT_BASELINE_DISPATCH;
+
+static crt_routine_variant_t __crt_variants[__CRT_ROUTINE_COUNT] = __CRT_BASELINE_VARIANTS;
+
+static const crt_routine_variant_t __crt_baseline_variants[__CRT_ROUTINE_COUNT] = __CRT_BASELINE_VARIANTS;
+
+void
+_crt_select_routines (
+    unsigned int features
+    )
+
+{
+    size_t i;
+
+    __crt_dispatch = __crt_baseline_dispatch;
+    for (i = 0; i < __CRT_ROUTINE_COUNT; i++) {
+        __crt_variants[i] = __crt_baseline_variants[i];
+    }
+
+#if defined(__x86_64__) || defined(__i386__)
+    if (features & CRT_CPU_FEATURE_ERMS) {
+        __crt_dispatch.memset = __memset_erms;
+        __crt_variants[__CRT_ROUTINE_MEMSET].variant = L"erms";
+    }
+
+    if (features & CRT_CPU_FEATURE_FSRM) {
+        __crt_dispatch.memcpy = __memcpy_fsrm;
+        __crt_dispatch.memmove = __memmove_fsrm;
+        __crt_variants[__CRT_ROUTINE_MEMCPY].variant = L"fsrm";
+        __crt_variants[__CRT_ROUTINE_MEMMOVE].variant = L"fsrm";
+    } else if (features & CRT_CPU_FEATURE_ERMS) {
+        __crt_dispatch.memcpy = __memcpy_erms;
+        __crt_dispatch.memmove = __memmove_erms;
+        __crt_variants[__CRT_ROUTINE_MEMCPY].variant = L"erms";
+        __crt_variants[__CRT_ROUTINE_MEMMOVE].variant = L"erms";
+    }
+#endif
+
+#if defined(__x86_64__)
+    if (features & CRT_CPU_FEATURE_AVX2) {
+        __crt_dispatch.memcmp = __memcmp_avx2;
+        __crt_dispatch.memchr = __memchr_avx2;
+        __crt_variants[__CRT_ROUTINE_MEMCMP].variant = L"avx2";
+        __crt_variants[__CRT_ROUTINE_MEMCHR].variant = L"avx2";
+#if defined(__CRT_WCHAR_VECTOR)
+        __crt_dispatch.wmemcmp = __wmemcmp_avx2;
+        __crt_dispatch.wmemchr = __wmemchr_avx2;
+        __crt_variants[__CRT_ROUTINE_WMEMCMP].variant = L"avx2";
+        __crt_variants[__CRT_ROUTINE_WMEMCHR].variant = L"avx2";
+#endif
+    }
+#endif
+
+    (void)features;
+}
+
+const crt_routine_variant_t *
+_crt_get_routine_variants (
+    size_t *count
+    )
+
+{
+    *count = __CRT_ROUTINE_COUNT;
+    return __crt_variants;
+}
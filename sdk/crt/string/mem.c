@@ -15,82 +15,209 @@ Module Name:
 --*/
 
 #include <string.h>
+#include "crtp.h"
 
-void *
-memset (
+/*
+ * REP MOVSB/STOSB beat word loops once the processor has enhanced REP
+ * string support and the buffer is large enough to hide the startup cost.
+ * Fast short REP MOVSB lowers that cost for copies.
+ */
+#define __MEM_REP_THRESHOLD       256
+#define __MEM_REP_SHORT_THRESHOLD 32
+
+#if defined(__x86_64__) || defined(__i386__)
+static inline void
+__mem_rep_movsb (
+    void       *dest,
+    const void *src,
+    size_t     n
+    )
+
+{
+    asm volatile("rep movsb" : "+D"(dest), "+S"(src), "+c"(n) : : "memory");
+}
+
+static inline void
+__mem_rep_stosb (
     void   *s,
     int    c,
     size_t n
     )
 
 {
-    void *ptr;
+    asm volatile("rep stosb" : "+D"(s), "+c"(n) : "a"(c) : "memory");
+}
+#endif
+
+static void
+__mem_copy_forward (
+    unsigned char       *d,
+    const unsigned char *s,
+    size_t              n
+    )
+
+{
+    size_t w0, w1, w2, w3;
+
+    if (n >= 2 * __CRT_WORD_SIZE) {
+        /* Align the destination */
+        while ((uintptr_t)d & __CRT_WORD_MASK) {
+            *d++ = *s++;
+            n--;
+        }
+
+        /* Read each block before writing it, so that dest < src overlap is safe */
+        while (n >= 4 * __CRT_WORD_SIZE) {
+            w0 = ((const __crt_uword_t *)s)[0];
+            w1 = ((const __crt_uword_t *)s)[1];
+            w2 = ((const __crt_uword_t *)s)[2];
+            w3 = ((const __crt_uword_t *)s)[3];
+            ((__crt_word_t *)d)[0] = w0;
+            ((__crt_word_t *)d)[1] = w1;
+            ((__crt_word_t *)d)[2] = w2;
+            ((__crt_word_t *)d)[3] = w3;
+            d += 4 * __CRT_WORD_SIZE;
+            s += 4 * __CRT_WORD_SIZE;
+            n -= 4 * __CRT_WORD_SIZE;
+        }
+
+        while (n >= __CRT_WORD_SIZE) {
+            *(__crt_word_t *)d = *(const __crt_uword_t *)s;
+            d += __CRT_WORD_SIZE;
+            s += __CRT_WORD_SIZE;
+            n -= __CRT_WORD_SIZE;
+        }
+    }
 
-    ptr = s;
     while (n--) {
-        *(char *)s = (char)c;
-        s = (char *)s + 1;
+        *d++ = *s++;
+    }
+}
+
+static void
+__mem_copy_backward (
+    unsigned char       *d,
+    const unsigned char *s,
+    size_t              n
+    )
+
+{
+    size_t w0, w1, w2, w3;
+
+    d += n;
+    s += n;
+
+    if (n >= 2 * __CRT_WORD_SIZE) {
+        /* Align the end of the destination */
+        while ((uintptr_t)d & __CRT_WORD_MASK) {
+            *--d = *--s;
+            n--;
+        }
+
+        /* Read each block before writing it, so that dest > src overlap is safe */
+        while (n >= 4 * __CRT_WORD_SIZE) {
+            d -= 4 * __CRT_WORD_SIZE;
+            s -= 4 * __CRT_WORD_SIZE;
+            w3 = ((const __crt_uword_t *)s)[3];
+            w2 = ((const __crt_uword_t *)s)[2];
+            w1 = ((const __crt_uword_t *)s)[1];
+            w0 = ((const __crt_uword_t *)s)[0];
+            ((__crt_word_t *)d)[3] = w3;
+            ((__crt_word_t *)d)[2] = w2;
+            ((__crt_word_t *)d)[1] = w1;
+            ((__crt_word_t *)d)[0] = w0;
+            n -= 4 * __CRT_WORD_SIZE;
+        }
+
+        while (n >= __CRT_WORD_SIZE) {
+            d -= __CRT_WORD_SIZE;
+            s -= __CRT_WORD_SIZE;
+            *(__crt_word_t *)d = *(const __crt_uword_t *)s;
+            n -= __CRT_WORD_SIZE;
+        }
     }
 
-    return ptr;
+    while (n--) {
+        *--d = *--s;
+    }
 }
 
 void *
-memcpy (
-    void       *dest,
-    const void *src,
-    size_t     n
+__memset_generic (
+    void   *s,
+    int    c,
+    size_t n
     )
 
 {
-    void *ptr;
+    unsigned char *d;
+    size_t pattern;
+
+    d = s;
+    if (n >= 2 * __CRT_WORD_SIZE) {
+        /* Align the destination */
+        while ((uintptr_t)d & __CRT_WORD_MASK) {
+            *d++ = (unsigned char)c;
+            n--;
+        }
+
+        /* Replicate the byte across a word */
+        pattern = (unsigned char)c * ((size_t)-1 / 0xff);
+        while (n >= 4 * __CRT_WORD_SIZE) {
+            ((__crt_word_t *)d)[0] = pattern;
+            ((__crt_word_t *)d)[1] = pattern;
+            ((__crt_word_t *)d)[2] = pattern;
+            ((__crt_word_t *)d)[3] = pattern;
+            d += 4 * __CRT_WORD_SIZE;
+            n -= 4 * __CRT_WORD_SIZE;
+        }
+
+        while (n >= __CRT_WORD_SIZE) {
+            *(__crt_word_t *)d = pattern;
+            d += __CRT_WORD_SIZE;
+            n -= __CRT_WORD_SIZE;
+        }
+    }
 
-    ptr = dest;
     while (n--) {
-        *(char *)dest = *(char *)src;
-        dest = (char *)dest + 1;
-        src = (char *)src + 1;
+        *d++ = (unsigned char)c;
     }
 
-    return ptr;
+    return s;
 }
 
 void *
-memmove (
+__memcpy_generic (
     void       *dest,
     const void *src,
     size_t     n
     )
 
 {
-    void *ptr;
+    __mem_copy_forward(dest, src, n);
+    return dest;
+}
 
-    ptr = dest;
+void *
+__memmove_generic (
+    void       *dest,
+    const void *src,
+    size_t     n
+    )
 
-    /* Check for overlap */
-    if (src >= dest || ((char *)src + n) <= (char *)dest) {
-        /* Low-to-high copy */
-        while (n--) {
-            *(char *)dest = *(char *)src;
-            dest = (char *)dest + 1;
-            src = (char *)src + 1;
-        }
+{
+    /* Low-to-high copy, safe unless dest is inside the source */
+    if ((uintptr_t)dest - (uintptr_t)src >= n) {
+        __mem_copy_forward(dest, src, n);
     } else {
-        /* High-to-low copy */
-        dest = (char *)dest + n;
-        src = (char *)src + n;
-        while (n--) {
-            dest = (char *)dest - 1;
-            src = (char *)src - 1;
-            *(char *)dest = *(char *)src;
-        }
+        __mem_copy_backward(dest, src, n);
     }
 
-    return ptr;
+    return dest;
 }
 
 int
-memcmp (
+__memcmp_generic (
     const void *s1,
     const void *s2,
     size_t     n
@@ -108,3 +235,162 @@ memcmp (
 
     return 0;
 }
+
+void *
+__memchr_generic (
+    const void *s,
+    int        c,
+    size_t     n
+    )
+
+{
+    while (n--) {
+        if (*(unsigned char *)s == (unsigned char)c) {
+            return (void *)s;
+        }
+
+        s = (unsigned char *)s + 1;
+    }
+
+    return NULL;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+void *
+__memset_erms (
+    void   *s,
+    int    c,
+    size_t n
+    )
+
+{
+    if (n < __MEM_REP_THRESHOLD) {
+        return __memset_generic(s, c, n);
+    }
+
+    __mem_rep_stosb(s, c, n);
+    return s;
+}
+
+void *
+__memcpy_erms (
+    void       *dest,
+    const void *src,
+    size_t     n
+    )
+
+{
+    if (n < __MEM_REP_THRESHOLD) {
+        __mem_copy_forward(dest, src, n);
+    } else {
+        __mem_rep_movsb(dest, src, n);
+    }
+
+    return dest;
+}
+
+void *
+__memcpy_fsrm (
+    void       *dest,
+    const void *src,
+    size_t     n
+    )
+
+{
+    if (n < __MEM_REP_SHORT_THRESHOLD) {
+        __mem_copy_forward(dest, src, n);
+    } else {
+        __mem_rep_movsb(dest, src, n);
+    }
+
+    return dest;
+}
+
+void *
+__memmove_erms (
+    void       *dest,
+    const void *src,
+    size_t     n
+    )
+
+{
+    /* REP MOVSB copies low to high, so it is only used without harmful overlap */
+    if ((uintptr_t)dest - (uintptr_t)src >= n && n >= __MEM_REP_THRESHOLD) {
+        __mem_rep_movsb(dest, src, n);
+        return dest;
+    }
+
+    return __memmove_generic(dest, src, n);
+}
+
+void *
+__memmove_fsrm (
+    void       *dest,
+    const void *src,
+    size_t     n
+    )
+
+{
+    if ((uintptr_t)dest - (uintptr_t)src >= n && n >= __MEM_REP_SHORT_THRESHOLD) {
+        __mem_rep_movsb(dest, src, n);
+        return dest;
+    }
+
+    return __memmove_generic(dest, src, n);
+}
+#endif
+
+void *
+memset (
+    void   *s,
+    int    c,
+    size_t n
+    )
+
+{
+    return __crt_dispatch.memset(s, c, n);
+}
+
+void *
+memcpy (
+    void       *dest,
+    const void *src,
+    size_t     n
+    )
+
+{
+    return __crt_dispatch.memcpy(dest, src, n);
+}
+
+void *
+memmove (
+    void       *dest,
+    const void *src,
+    size_t     n
+    )
+
+{
+    return __crt_dispatch.memmove(dest, src, n);
+}
+
+int
+memcmp (
+    const void *s1,
+    const void *s2,
+    size_t     n
+    )
+
+{
+    return __crt_dispatch.memcmp(s1, s2, n);
+}
+
+void *
+memchr (
+    const void *s,
+    int        c,
+    size_t     n
+    )
+
+{
+    return __crt_dispatch.memchr(s, c, n);
+}
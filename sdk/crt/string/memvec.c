@@ -0,0 +1,379 @@
+/*++
+
+Copyright (c) 2025, Quinn Stephens, w1redch4d
+All rights reserved.
+Provided under the BSD 3-Clause license.
+
+Module Name:
+
+    memvec.c
+
+Abstract:
+
+    SSE2 and AVX2 memory comparison and search kernels.
+
+    Loads never reach outside the buffers passed in. A tail shorter than
+    one vector is handled with a final load that ends at the last element
+    and overlaps elements that were already checked, so no load can cross
+    into an unmapped page.
+
+--*/
+
+#include "crtp.h"
+
+#if defined(__x86_64__)
+
+#include <immintrin.h>
+
+#define __AVX2 __attribute__((__target__("avx2")))
+
+static inline int
+__memcmp_scalar (
+    const unsigned char *p1,
+    const unsigned char *p2,
+    size_t              n
+    )
+
+{
+    while (n--) {
+        if (*p1 != *p2) {
+            return *p1 - *p2;
+        }
+
+        p1++;
+        p2++;
+    }
+
+    return 0;
+}
+
+int
+__memcmp_sse2 (
+    const void *s1,
+    const void *s2,
+    size_t     n
+    )
+
+{
+    const unsigned char *p1, *p2;
+    unsigned int mask;
+    size_t offset;
+
+    p1 = s1;
+    p2 = s2;
+    if (n < 16) {
+        return __memcmp_scalar(p1, p2, n);
+    }
+
+    offset = 0;
+    for (;;) {
+        mask = _mm_movemask_epi8(_mm_cmpeq_epi8(
+            _mm_loadu_si128((const __m128i *)(p1 + offset)),
+            _mm_loadu_si128((const __m128i *)(p2 + offset))
+        ));
+
+        if (mask != 0xffff) {
+            offset += __builtin_ctz(~mask);
+            return p1[offset] - p2[offset];
+        }
+
+        if (offset + 16 == n) {
+            return 0;
+        }
+
+        /* The last block overlaps bytes that are already known to match */
+        offset += 16;
+        if (n - offset < 16) {
+            offset = n - 16;
+        }
+    }
+}
+
+int __AVX2
+__memcmp_avx2 (
+    const void *s1,
+    const void *s2,
+    size_t     n
+    )
+
+{
+    const unsigned char *p1, *p2;
+    unsigned int mask;
+    size_t offset;
+
+    p1 = s1;
+    p2 = s2;
+    if (n < 32) {
+        return __memcmp_sse2(p1, p2, n);
+    }
+
+    offset = 0;
+    for (;;) {
+        mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(
+            _mm256_loadu_si256((const __m256i *)(p1 + offset)),
+            _mm256_loadu_si256((const __m256i *)(p2 + offset))
+        ));
+
+        if (mask != 0xffffffff) {
+            offset += __builtin_ctz(~mask);
+            return p1[offset] - p2[offset];
+        }
+
+        if (offset + 32 == n) {
+            return 0;
+        }
+
+        offset += 32;
+        if (n - offset < 32) {
+            offset = n - 32;
+        }
+    }
+}
+
+void *
+__memchr_sse2 (
+    const void *s,
+    int        c,
+    size_t     n
+    )
+
+{
+    const unsigned char *p;
+    __m128i needle;
+    unsigned int mask;
+    size_t offset;
+
+    p = s;
+    if (n < 16) {
+        while (n--) {
+            if (*p == (unsigned char)c) {
+                return (void *)p;
+            }
+
+            p++;
+        }
+
+        return NULL;
+    }
+
+    needle = _mm_set1_epi8((char)c);
+    offset = 0;
+    for (;;) {
+        mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(p + offset)), needle));
+        if (mask != 0) {
+            return (void *)(p + offset + __builtin_ctz(mask));
+        }
+
+        if (offset + 16 == n) {
+            return NULL;
+        }
+
+        /* The last block overlaps bytes that are already known not to match */
+        offset += 16;
+        if (n - offset < 16) {
+            offset = n - 16;
+        }
+    }
+}
+
+void * __AVX2
+__memchr_avx2 (
+    const void *s,
+    int        c,
+    size_t     n
+    )
+
+{
+    const unsigned char *p;
+    __m256i needle;
+    unsigned int mask;
+    size_t offset;
+
+    p = s;
+    if (n < 32) {
+        return __memchr_sse2(p, c, n);
+    }
+
+    needle = _mm256_set1_epi8((char)c);
+    offset = 0;
+    for (;;) {
+        mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(p + offset)), needle));
+        if (mask != 0) {
+            return (void *)(p + offset + __builtin_ctz(mask));
+        }
+
+        if (offset + 32 == n) {
+            return NULL;
+        }
+
+        offset += 32;
+        if (n - offset < 32) {
+            offset = n - 32;
+        }
+    }
+}
+
+#if defined(__CRT_WCHAR_VECTOR)
+
+/*
+ * The 16-bit kernels count in elements. _mm_movemask_epi8 yields two bits
+ * per element, so bit indices are halved.
+ */
+
+int
+__wmemcmp_sse2 (
+    const wchar_t *s1,
+    const wchar_t *s2,
+    size_t        n
+    )
+
+{
+    unsigned int mask;
+    size_t offset;
+
+    if (n < 8) {
+        return __wmemcmp_generic(s1, s2, n);
+    }
+
+    offset = 0;
+    for (;;) {
+        mask = _mm_movemask_epi8(_mm_cmpeq_epi16(
+            _mm_loadu_si128((const __m128i *)(s1 + offset)),
+            _mm_loadu_si128((const __m128i *)(s2 + offset))
+        ));
+
+        if (mask != 0xffff) {
+            offset += __builtin_ctz(~mask) / 2;
+            return s1[offset] - s2[offset];
+        }
+
+        if (offset + 8 == n) {
+            return 0;
+        }
+
+        offset += 8;
+        if (n - offset < 8) {
+            offset = n - 8;
+        }
+    }
+}
+
+int __AVX2
+__wmemcmp_avx2 (
+    const wchar_t *s1,
+    const wchar_t *s2,
+    size_t        n
+    )
+
+{
+    unsigned int mask;
+    size_t offset;
+
+    if (n < 16) {
+        return __wmemcmp_sse2(s1, s2, n);
+    }
+
+    offset = 0;
+    for (;;) {
+        mask = _mm256_movemask_epi8(_mm256_cmpeq_epi16(
+            _mm256_loadu_si256((const __m256i *)(s1 + offset)),
+            _mm256_loadu_si256((const __m256i *)(s2 + offset))
+        ));
+
+        if (mask != 0xffffffff) {
+            offset += __builtin_ctz(~mask) / 2;
+            return s1[offset] - s2[offset];
+        }
+
+        if (offset + 16 == n) {
+            return 0;
+        }
+
+        offset += 16;
+        if (n - offset < 16) {
+            offset = n - 16;
+        }
+    }
+}
+
+wchar_t *
+__wmemchr_sse2 (
+    const wchar_t *s,
+    wchar_t       c,
+    size_t        n
+    )
+
+{
+    __m128i needle;
+    unsigned int mask;
+    size_t offset;
+
+    if (n < 8) {
+        while (n--) {
+            if (*s == c) {
+                return (wchar_t *)s;
+            }
+
+            s++;
+        }
+
+        return NULL;
+    }
+
+    needle = _mm_set1_epi16((short)c);
+    offset = 0;
+    for (;;) {
+        mask = _mm_movemask_epi8(_mm_cmpeq_epi16(_mm_loadu_si128((const __m128i *)(s + offset)), needle));
+        if (mask != 0) {
+            return (wchar_t *)(s + offset + __builtin_ctz(mask) / 2);
+        }
+
+        if (offset + 8 == n) {
+            return NULL;
+        }
+
+        offset += 8;
+        if (n - offset < 8) {
+            offset = n - 8;
+        }
+    }
+}
+
+wchar_t * __AVX2
+__wmemchr_avx2 (
+    const wchar_t *s,
+    wchar_t       c,
+    size_t        n
+    )
+
+{
+    __m256i needle;
+    unsigned int mask;
+    size_t offset;
+
+    if (n < 16) {
+        return __wmemchr_sse2(s, c, n);
+    }
+
+    needle = _mm256_set1_epi16((short)c);
+    offset = 0;
+    for (;;) {
+        mask = _mm256_movemask_epi8(_mm256_cmpeq_epi16(_mm256_loadu_si256((const __m256i *)(s + offset)), needle));
+        if (mask != 0) {
+            return (wchar_t *)(s + offset + __builtin_ctz(mask) / 2);
+        }
+
+        if (offset + 16 == n) {
+            return NULL;
+        }
+
+        offset += 16;
+        if (n - offset < 16) {
+            offset = n - 16;
+        }
+    }
+}
+
+#endif
+
+#endif
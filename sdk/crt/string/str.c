@@ -129,6 +129,178 @@ strrchr (
     return (char *)last;
 }
 
+/*
+ * Two-way string matching (Crochemore and Perrin). The needle is split
+ * at a critical factorization, which lets the search run in linear time
+ * with constant space. The end of the haystack is found incrementally, so
+ * a long haystack is never scanned further than needed.
+ *
+ * Adapted from the twoway_strstr routine of musl libc, which is provided
+ * under the following license:
+ *
+ * Copyright (c) 2005-2020 Rich Felker, et al.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#define __BYTESET_ADD(set, b) \
+    ((set)[(size_t)(b) / (8 * sizeof(*(set)))] |= (size_t)1 << ((size_t)(b) % (8 * sizeof(*(set)))))
+#define __BYTESET_HAS(set, b) \
+    (((set)[(size_t)(b) / (8 * sizeof(*(set)))] >> ((size_t)(b) % (8 * sizeof(*(set))))) & 1)
+
+static char *
+__strstr_twoway (
+    const unsigned char *h,
+    const unsigned char *n
+    )
+
+{
+    const unsigned char *z;
+    size_t l, ip, jp, k, p, ms, p0, mem, mem0, grow, len;
+    size_t byteset[256 / (8 * sizeof(size_t))] = { 0 };
+    size_t shift[256];
+
+    /*
+     * Compute the needle length, failing if the haystack is shorter, and
+     * record the last position of each needle byte for the bad-character
+     * shift.
+     */
+    for (l = 0; n[l] != 0 && h[l] != 0; l++) {
+        __BYTESET_ADD(byteset, n[l]);
+        shift[n[l]] = l + 1;
+    }
+
+    if (n[l] != 0) {
+        return NULL;
+    }
+
+    /* Compute the maximal suffix */
+    ip = (size_t)-1;
+    jp = 0;
+    k = p = 1;
+    while (jp + k < l) {
+        if (n[ip + k] == n[jp + k]) {
+            if (k == p) {
+                jp += p;
+                k = 1;
+            } else {
+                k++;
+            }
+        } else if (n[ip + k] > n[jp + k]) {
+            jp += k;
+            k = 1;
+            p = jp - ip;
+        } else {
+            ip = jp++;
+            k = p = 1;
+        }
+    }
+
+    ms = ip;
+    p0 = p;
+
+    /* And with the opposite comparison */
+    ip = (size_t)-1;
+    jp = 0;
+    k = p = 1;
+    while (jp + k < l) {
+        if (n[ip + k] == n[jp + k]) {
+            if (k == p) {
+                jp += p;
+                k = 1;
+            } else {
+                k++;
+            }
+        } else if (n[ip + k] < n[jp + k]) {
+            jp += k;
+            k = 1;
+            p = jp - ip;
+        } else {
+            ip = jp++;
+            k = p = 1;
+        }
+    }
+
+    if (ip + 1 > ms + 1) {
+        ms = ip;
+    } else {
+        p = p0;
+    }
+
+    /* Periodic needles remember how much of the left half already matched */
+    if (memcmp(n, n + p, ms + 1) != 0) {
+        mem0 = 0;
+        p = (ms > l - ms - 1 ? ms : l - ms - 1) + 1;
+    } else {
+        mem0 = l - p;
+    }
+
+    mem = 0;
+    z = h;
+    for (;;) {
+        /* Make sure at least l characters of haystack are left */
+        if ((size_t)(z - h) < l) {
+            grow = l | 63;
+            len = strnlen((const char *)z, grow);
+            z += len;
+            if (len < grow && (size_t)(z - h) < l) {
+                return NULL;
+            }
+        }
+
+        /*
+         * Skip ahead by the last byte of the window. A byte the needle does
+         * not contain moves the window past it entirely. A shift of one is
+         * left to the comparison below, which moves at least as far.
+         */
+        if (__BYTESET_HAS(byteset, h[l - 1])) {
+            k = l - shift[h[l - 1]];
+            if (k > 1) {
+                h += k > mem ? k : mem;
+                mem = 0;
+                continue;
+            }
+        } else {
+            h += l;
+            mem = 0;
+            continue;
+        }
+
+        /* Compare the right half */
+        for (k = (ms + 1 > mem ? ms + 1 : mem); n[k] != 0 && n[k] == h[k]; k++);
+        if (n[k] != 0) {
+            h += k - ms;
+            mem = 0;
+            continue;
+        }
+
+        /* Compare the left half */
+        for (k = ms + 1; k > mem && n[k - 1] == h[k - 1]; k--);
+        if (k <= mem) {
+            return (char *)h;
+        }
+
+        h += p;
+        mem = mem0;
+    }
+}
+
 char *
 strstr (
     const char *haystack,
@@ -142,12 +314,10 @@ strstr (
         return (char *)haystack;
     }
 
-    pos = haystack;
-    while ((pos = strchr(pos, *needle)) != NULL) {
-        if (strcmp(pos, needle) == 0) {
-            return (char *)pos;
-        }
+    pos = strchr(haystack, *needle);
+    if (pos == NULL || needle[1] == '\0') {
+        return (char *)pos;
     }
 
-    return NULL;
+    return __strstr_twoway((const unsigned char *)pos, (const unsigned char *)needle);
 }
@@ -15,6 +15,7 @@ Module Name:
 --*/
 
 #include <wchar.h>
+#include "crtp.h"
 
 wchar_t *
 wmemset (
@@ -83,7 +84,7 @@ wmemmove (
 }
 
 int
-wmemcmp (
+__wmemcmp_generic (
     const wchar_t *s1,
     const wchar_t *s2,
     size_t        n
@@ -101,3 +102,44 @@ wmemcmp (
 
     return 0;
 }
+
+wchar_t *
+__wmemchr_generic (
+    const wchar_t *wcs,
+    wchar_t       wc,
+    size_t        n
+    )
+
+{
+    while (n--) {
+        if (*wcs == wc) {
+            return (wchar_t *)wcs;
+        }
+
+        wcs++;
+    }
+
+    return NULL;
+}
+
+int
+wmemcmp (
+    const wchar_t *s1,
+    const wchar_t *s2,
+    size_t        n
+    )
+
+{
+    return __crt_dispatch.wmemcmp(s1, s2, n);
+}
+
+wchar_t *
+wmemchr (
+    const wchar_t *wcs,
+    wchar_t       wc,
+    size_t        n
+    )
+
+{
+    return __crt_dispatch.wmemchr(wcs, wc, n);
+}
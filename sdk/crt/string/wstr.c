@@ -18,9 +18,10 @@ Module Name:
 #include <errno.h>
 #include <stdint.h>
 #include <wchar.h>
+#include "crtp.h"
 
 size_t
-wcslen (
+__wcslen_generic (
     const wchar_t *s
     )
 
@@ -36,7 +37,7 @@ wcslen (
 }
 
 size_t
-wcsnlen (
+__wcsnlen_generic (
     const wchar_t *s,
     size_t        maxlen
     )
@@ -53,7 +54,7 @@ wcsnlen (
 }
 
 int
-wcscmp (
+__wcscmp_generic (
     const wchar_t *s1,
     const wchar_t *s2
     )
@@ -96,7 +97,7 @@ wcsncmp (
 }
 
 wchar_t *
-wcschr (
+__wcschr_generic (
     const wchar_t *wcs,
     wchar_t       wc
     )
@@ -114,7 +115,7 @@ wcschr (
 }
 
 wchar_t *
-wcsrchr (
+__wcsrchr_generic (
     const wchar_t *wcs,
     wchar_t       wc
     )
@@ -132,6 +133,229 @@ wcsrchr (
     return (wchar_t *)last;
 }
 
+size_t
+wcslen (
+    const wchar_t *s
+    )
+
+{
+    return __crt_dispatch.wcslen(s);
+}
+
+size_t
+wcsnlen (
+    const wchar_t *s,
+    size_t        maxlen
+    )
+
+{
+    return __crt_dispatch.wcsnlen(s, maxlen);
+}
+
+int
+wcscmp (
+    const wchar_t *s1,
+    const wchar_t *s2
+    )
+
+{
+    return __crt_dispatch.wcscmp(s1, s2);
+}
+
+wchar_t *
+wcschr (
+    const wchar_t *wcs,
+    wchar_t       wc
+    )
+
+{
+    return __crt_dispatch.wcschr(wcs, wc);
+}
+
+wchar_t *
+wcsrchr (
+    const wchar_t *wcs,
+    wchar_t       wc
+    )
+
+{
+    return __crt_dispatch.wcsrchr(wcs, wc);
+}
+
+/*
+ * Two-way string matching (Crochemore and Perrin). The needle is split
+ * at a critical factorization, which lets the search run in linear time
+ * with constant space. The end of the haystack is found incrementally, so
+ * a long haystack is never scanned further than needed.
+ *
+ * Adapted from the twoway_wcsstr routine of musl libc, which is provided
+ * under the following license:
+ *
+ * Copyright (c) 2005-2020 Rich Felker, et al.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#define __BYTESET_ADD(set, b) \
+    ((set)[(size_t)(b) / (8 * sizeof(*(set)))] |= (size_t)1 << ((size_t)(b) % (8 * sizeof(*(set)))))
+#define __BYTESET_HAS(set, b) \
+    (((set)[(size_t)(b) / (8 * sizeof(*(set)))] >> ((size_t)(b) % (8 * sizeof(*(set))))) & 1)
+
+static wchar_t *
+__wcsstr_twoway (
+    const wchar_t *h,
+    const wchar_t *n
+    )
+
+{
+    const wchar_t *z;
+    size_t l, ip, jp, k, p, ms, p0, mem, mem0, grow, len;
+    size_t byteset[256 / (8 * sizeof(size_t))] = { 0 };
+    size_t shift[256];
+
+    /*
+     * Compute the needle length, failing if the haystack is shorter, and
+     * record the last position of each low byte for the bad-character
+     * shift. Characters that share a low byte share an entry, which only
+     * makes the shift more cautious.
+     */
+    for (l = 0; n[l] != 0 && h[l] != 0; l++) {
+        __BYTESET_ADD(byteset, n[l] & 0xff);
+        shift[n[l] & 0xff] = l + 1;
+    }
+
+    if (n[l] != 0) {
+        return NULL;
+    }
+
+    /* Compute the maximal suffix */
+    ip = (size_t)-1;
+    jp = 0;
+    k = p = 1;
+    while (jp + k < l) {
+        if (n[ip + k] == n[jp + k]) {
+            if (k == p) {
+                jp += p;
+                k = 1;
+            } else {
+                k++;
+            }
+        } else if (n[ip + k] > n[jp + k]) {
+            jp += k;
+            k = 1;
+            p = jp - ip;
+        } else {
+            ip = jp++;
+            k = p = 1;
+        }
+    }
+
+    ms = ip;
+    p0 = p;
+
+    /* And with the opposite comparison */
+    ip = (size_t)-1;
+    jp = 0;
+    k = p = 1;
+    while (jp + k < l) {
+        if (n[ip + k] == n[jp + k]) {
+            if (k == p) {
+                jp += p;
+                k = 1;
+            } else {
+                k++;
+            }
+        } else if (n[ip + k] < n[jp + k]) {
+            jp += k;
+            k = 1;
+            p = jp - ip;
+        } else {
+            ip = jp++;
+            k = p = 1;
+        }
+    }
+
+    if (ip + 1 > ms + 1) {
+        ms = ip;
+    } else {
+        p = p0;
+    }
+
+    /* Periodic needles remember how much of the left half already matched */
+    if (wmemcmp(n, n + p, ms + 1) != 0) {
+        mem0 = 0;
+        p = (ms > l - ms - 1 ? ms : l - ms - 1) + 1;
+    } else {
+        mem0 = l - p;
+    }
+
+    mem = 0;
+    z = h;
+    for (;;) {
+        /* Make sure at least l characters of haystack are left */
+        if ((size_t)(z - h) < l) {
+            grow = l | 63;
+            len = wcsnlen(z, grow);
+            z += len;
+            if (len < grow && (size_t)(z - h) < l) {
+                return NULL;
+            }
+        }
+
+        /*
+         * Skip ahead by the last character of the window. A character the
+         * needle does not contain moves the window past it entirely. A
+         * shift of one is left to the comparison below, which moves at
+         * least as far.
+         */
+        if (__BYTESET_HAS(byteset, h[l - 1] & 0xff)) {
+            k = l - shift[h[l - 1] & 0xff];
+            if (k > 1) {
+                h += k > mem ? k : mem;
+                mem = 0;
+                continue;
+            }
+        } else {
+            h += l;
+            mem = 0;
+            continue;
+        }
+
+        /* Compare the right half */
+        for (k = (ms + 1 > mem ? ms + 1 : mem); n[k] != 0 && n[k] == h[k]; k++);
+        if (n[k] != 0) {
+            h += k - ms;
+            mem = 0;
+            continue;
+        }
+
+        /* Compare the left half */
+        for (k = ms + 1; k > mem && n[k - 1] == h[k - 1]; k--);
+        if (k <= mem) {
+            return (wchar_t *)h;
+        }
+
+        h += p;
+        mem = mem0;
+    }
+}
+
 wchar_t *
 wcsstr (
     const wchar_t *haystack,
@@ -145,14 +369,12 @@ wcsstr (
         return (wchar_t *)haystack;
     }
 
-    pos = haystack;
-    while ((pos = wcschr(pos, *needle)) != NULL) {
-        if (wcscmp(pos, needle) == 0) {
-            return (wchar_t *)pos;
-        }
+    pos = wcschr(haystack, *needle);
+    if (pos == NULL || needle[1] == L'\0') {
+        return (wchar_t *)pos;
     }
 
-    return NULL;
+    return __wcsstr_twoway(pos, needle);
 }
 
 size_t
@@ -0,0 +1,232 @@
+/*++
+
+Copyright (c) 2025, Quinn Stephens, w1redch4d
+All rights reserved.
+Provided under the BSD 3-Clause license.
+
+Module Name:
+
+    wstrvec.c
+
+Abstract:
+
+    SSE2 wide-character string kernels.
+
+    The length of the string is not known in advance, so the kernels only
+    use loads that cannot cross a page boundary. Single-string kernels use
+    aligned loads and ignore lanes before the start of the string, falling
+    back to the generic routines for strings that are not wchar_t-aligned,
+    which would put characters across lanes. wcscmp
+    uses unaligned loads and falls back to single elements near the end of
+    a page.
+
+--*/
+
+#include "crtp.h"
+
+#if defined(__CRT_WCHAR_VECTOR)
+
+#include <emmintrin.h>
+
+#define __PAGE_SIZE 4096
+
+#define __WCS_ALIGNED(s) (((uintptr_t)(s) & (sizeof(wchar_t) - 1)) == 0)
+
+static inline unsigned int
+__wcs_zero_mask (
+    const wchar_t *p
+    )
+
+{
+    return _mm_movemask_epi8(_mm_cmpeq_epi16(_mm_load_si128((const __m128i *)p), _mm_setzero_si128()));
+}
+
+size_t
+__wcslen_sse2 (
+    const wchar_t *s
+    )
+
+{
+    const wchar_t *p;
+    unsigned int mask;
+
+    if (!__WCS_ALIGNED(s)) {
+        return __wcslen_generic(s);
+    }
+
+    p = (const wchar_t *)((uintptr_t)s & ~(uintptr_t)15);
+    mask = __wcs_zero_mask(p) >> ((uintptr_t)s & 15);
+    if (mask != 0) {
+        return __builtin_ctz(mask) / 2;
+    }
+
+    for (;;) {
+        p += 8;
+        mask = __wcs_zero_mask(p);
+        if (mask != 0) {
+            return (size_t)(p - s) + __builtin_ctz(mask) / 2;
+        }
+    }
+}
+
+size_t
+__wcsnlen_sse2 (
+    const wchar_t *s,
+    size_t        maxlen
+    )
+
+{
+    const wchar_t *p;
+    unsigned int mask;
+    size_t len;
+
+    if (!__WCS_ALIGNED(s)) {
+        return __wcsnlen_generic(s, maxlen);
+    }
+
+    if (maxlen == 0) {
+        return 0;
+    }
+
+    p = (const wchar_t *)((uintptr_t)s & ~(uintptr_t)15);
+    mask = __wcs_zero_mask(p) >> ((uintptr_t)s & 15);
+    len = 0;
+    for (;;) {
+        if (mask != 0) {
+            len += __builtin_ctz(mask) / 2;
+            return len < maxlen ? len : maxlen;
+        }
+
+        p += 8;
+        len = (size_t)(p - s);
+        if (len >= maxlen) {
+            return maxlen;
+        }
+
+        mask = __wcs_zero_mask(p);
+    }
+}
+
+wchar_t *
+__wcschr_sse2 (
+    const wchar_t *s,
+    wchar_t       c
+    )
+
+{
+    const wchar_t *p, *match;
+    __m128i needle, v;
+    unsigned int mask;
+    unsigned int shift;
+
+    if (!__WCS_ALIGNED(s)) {
+        return __wcschr_generic(s, c);
+    }
+
+    needle = _mm_set1_epi16((short)c);
+    p = (const wchar_t *)((uintptr_t)s & ~(uintptr_t)15);
+    shift = (uintptr_t)s & 15;
+    for (;;) {
+        v = _mm_load_si128((const __m128i *)p);
+        mask = _mm_movemask_epi8(_mm_or_si128(
+            _mm_cmpeq_epi16(v, _mm_setzero_si128()),
+            _mm_cmpeq_epi16(v, needle)
+        ));
+
+        /* Ignore lanes before the start of the string */
+        mask = (mask >> shift) << shift;
+        if (mask != 0) {
+            match = p + __builtin_ctz(mask) / 2;
+            return *match == c ? (wchar_t *)match : NULL;
+        }
+
+        p += 8;
+        shift = 0;
+    }
+}
+
+wchar_t *
+__wcsrchr_sse2 (
+    const wchar_t *s,
+    wchar_t       c
+    )
+
+{
+    const wchar_t *p, *last;
+    __m128i needle, v;
+    unsigned int zmask, cmask;
+    unsigned int shift;
+
+    if (!__WCS_ALIGNED(s)) {
+        return __wcsrchr_generic(s, c);
+    }
+
+    needle = _mm_set1_epi16((short)c);
+    p = (const wchar_t *)((uintptr_t)s & ~(uintptr_t)15);
+    shift = (uintptr_t)s & 15;
+    last = NULL;
+    for (;;) {
+        v = _mm_load_si128((const __m128i *)p);
+        zmask = _mm_movemask_epi8(_mm_cmpeq_epi16(v, _mm_setzero_si128()));
+        cmask = _mm_movemask_epi8(_mm_cmpeq_epi16(v, needle));
+        zmask = (zmask >> shift) << shift;
+        cmask = (cmask >> shift) << shift;
+
+        if (zmask != 0) {
+            /* Keep matches up to and including the terminator */
+            cmask &= zmask ^ (zmask - 1);
+            if (cmask != 0) {
+                last = p + (31 - __builtin_clz(cmask)) / 2;
+            }
+
+            return (wchar_t *)last;
+        }
+
+        if (cmask != 0) {
+            last = p + (31 - __builtin_clz(cmask)) / 2;
+        }
+
+        p += 8;
+        shift = 0;
+    }
+}
+
+int
+__wcscmp_sse2 (
+    const wchar_t *s1,
+    const wchar_t *s2
+    )
+
+{
+    __m128i a, b;
+    unsigned int mask;
+    unsigned int index;
+
+    for (;;) {
+        /* A 16-byte load must not cross into the next page */
+        if (((uintptr_t)s1 & (__PAGE_SIZE - 1)) > __PAGE_SIZE - 16
+            || ((uintptr_t)s2 & (__PAGE_SIZE - 1)) > __PAGE_SIZE - 16) {
+            if (*s1 != *s2 || *s1 == 0) {
+                return *s1 - *s2;
+            }
+
+            s1++;
+            s2++;
+            continue;
+        }
+
+        a = _mm_loadu_si128((const __m128i *)s1);
+        b = _mm_loadu_si128((const __m128i *)s2);
+        mask = ~_mm_movemask_epi8(_mm_cmpeq_epi16(a, b)) & 0xffff;
+        mask |= _mm_movemask_epi8(_mm_cmpeq_epi16(a, _mm_setzero_si128()));
+        if (mask != 0) {
+            index = __builtin_ctz(mask) / 2;
+            return s1[index] - s2[index];
+        }
+
+        s1 += 8;
+        s2 += 8;
+    }
+}
+
+#endif
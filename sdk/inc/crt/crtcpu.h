@@ -0,0 +1,57 @@
+/*++
+
+Copyright (c) 2025, Quinn Stephens, w1redch4d
+All rights reserved.
+Provided under the BSD 3-Clause license.
+
+Module Name:
+
+    crtcpu.h
+
+Abstract:
+
+    Processor-specific C runtime routine selection.
+
+--*/
+
+#if !defined(_MSC_VER) || _MSC_VER > 1000
+#pragma once
+#endif
+
+#ifndef __CRTCPU_H
+#define __CRTCPU_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define __need_size_t
+#define __need_wchar_t
+#include <stddef.h>
+
+//
+// Processor features that optimized routines can depend on.
+// CRT_CPU_FEATURE_AVX2 must only be reported once the OS has enabled
+// AVX state in XCR0. Each call to _crt_select_routines replaces the previous
+// selection, so passing 0 returns every routine to its baseline variant.
+//
+#define CRT_CPU_FEATURE_ERMS 0x00000001
+#define CRT_CPU_FEATURE_FSRM 0x00000002
+#define CRT_CPU_FEATURE_AVX2 0x00000004
+
+//
+// The variant currently selected for a routine.
+//
+typedef struct {
+    const wchar_t *routine;
+    const wchar_t *variant;
+} crt_routine_variant_t;
+
+void _crt_select_routines(unsigned int features);
+const crt_routine_variant_t *_crt_get_routine_variants(size_t *count);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // __CRTCPU_H
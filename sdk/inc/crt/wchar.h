@@ -55,6 +55,7 @@ wchar_t *wmemset(wchar_t *wcs, wchar_t wc, size_t n);
 wchar_t *wmemcpy(wchar_t *dest, const wchar_t *src, size_t n);
 wchar_t *wmemmove(wchar_t *dest, const wchar_t *src, size_t n);
 int wmemcmp(const wchar_t *s1, const wchar_t *s2, size_t n);
+wchar_t *wmemchr(const wchar_t *wcs, wchar_t wc, size_t n);
 
 //
 // String services.
@@ -230,6 +230,81 @@ Return Value:
     return Entry;
 }
 
+//
+// Bitmap services.
+//
+
+typedef struct {
+    ULONG_PTR  SizeOfBitMap;
+    PULONGLONG Buffer;
+} RTL_BITMAP, *PRTL_BITMAP;
+
+#define RTL_BITMAP_NOT_FOUND ((ULONG_PTR)-1)
+
+//
+// Size in bytes of the buffer needed for a bitmap of Bits bits.
+//
+#define RTL_BITMAP_BUFFER_SIZE(Bits) ((((Bits) + 63) / 64) * sizeof(ULONGLONG))
+
+VOID
+NTAPI
+RtlInitializeBitMap (
+    OUT PRTL_BITMAP BitMapHeader,
+    IN  PULONGLONG  BitMapBuffer,
+    IN  ULONG_PTR   SizeOfBitMap
+    );
+
+VOID
+NTAPI
+RtlClearAllBits (
+    IN PRTL_BITMAP BitMapHeader
+    );
+
+VOID
+NTAPI
+RtlSetAllBits (
+    IN PRTL_BITMAP BitMapHeader
+    );
+
+VOID
+NTAPI
+RtlSetBits (
+    IN PRTL_BITMAP BitMapHeader,
+    IN ULONG_PTR   StartingIndex,
+    IN ULONG_PTR   NumberToSet
+    );
+
+VOID
+NTAPI
+RtlClearBits (
+    IN PRTL_BITMAP BitMapHeader,
+    IN ULONG_PTR   StartingIndex,
+    IN ULONG_PTR   NumberToClear
+    );
+
+BOOLEAN
+NTAPI
+RtlAreBitsClear (
+    IN PRTL_BITMAP BitMapHeader,
+    IN ULONG_PTR   StartingIndex,
+    IN ULONG_PTR   Length
+    );
+
+ULONG_PTR
+NTAPI
+RtlFindClearBitsInRange (
+    IN PRTL_BITMAP BitMapHeader,
+    IN ULONG_PTR   NumberToFind,
+    IN ULONG_PTR   StartingIndex,
+    IN ULONG_PTR   EndingIndex,
+    IN ULONG_PTR   Alignment,
+    IN ULONG_PTR   AlignmentOffset
+    );
+
+//
+// String services.
+//
+
 VOID
 NTAPI
 RtlInitAnsiString (
@@ -77,6 +77,7 @@ Module Name:
 #define STATUS_INVALID_PARAMETER                  ((NTSTATUS) 0xC000000DL)
 #define STATUS_NO_SUCH_DEVICE                     ((NTSTATUS) 0xC000000EL)
 #define STATUS_NO_MEMORY                          ((NTSTATUS) 0xC0000017L)
+#define STATUS_CONFLICTING_ADDRESSES              ((NTSTATUS) 0xC0000018L)
 #define STATUS_ACCESS_DENIED                      ((NTSTATUS) 0xC0000022L)
 #define STATUS_BUFFER_TOO_SMALL                   ((NTSTATUS) 0xC0000023L)
 #define STATUS_DISK_CORRUPT_ERROR                 ((NTSTATUS) 0xC0000032L)
@@ -0,0 +1,376 @@
+/*++
+
+Copyright (c) 2025, Quinn Stephens, w1redch4d
+All rights reserved.
+Provided under the BSD 3-Clause license.
+
+Module Name:
+
+    bitmap.c
+
+Abstract:
+
+    RTL bitmap routines.
+
+--*/
+
+#include <nt.h>
+#include <ntrtl.h>
+
+#define BITS_PER_WORD 64
+
+static ULONG_PTR
+RtlpFindNextBit (
+    IN PRTL_BITMAP BitMapHeader,
+    IN ULONG_PTR   StartingIndex,
+    IN ULONG_PTR   EndingIndex,
+    IN BOOLEAN     Set
+    )
+
+/*++
+
+Routine Description:
+
+    Finds the first bit in a range that is set or clear, looking at a
+    whole word at a time.
+
+Arguments:
+
+    BitMapHeader - Pointer to the bitmap.
+
+    StartingIndex - The first bit to look at.
+
+    EndingIndex - The bit after the last bit to look at.
+
+    Set - TRUE to look for a set bit, FALSE to look for a clear bit.
+
+Return Value:
+
+    The index of the bit if found.
+
+    EndingIndex if no such bit is in the range.
+
+--*/
+
+{
+    ULONGLONG Word;
+    ULONG_PTR Index;
+
+    Index = StartingIndex;
+    while (Index < EndingIndex) {
+        Word = BitMapHeader->Buffer[Index / BITS_PER_WORD];
+        if (!Set) {
+            Word = ~Word;
+        }
+
+        //
+        // Ignore the bits below Index.
+        //
+        Word &= ~0ULL << (Index % BITS_PER_WORD);
+        if (Word != 0) {
+            Index = (Index & ~(ULONG_PTR)(BITS_PER_WORD - 1)) + __builtin_ctzll(Word);
+            return Index < EndingIndex ? Index : EndingIndex;
+        }
+
+        Index = (Index | (BITS_PER_WORD - 1)) + 1;
+    }
+
+    return EndingIndex;
+}
+
+VOID
+NTAPI
+RtlInitializeBitMap (
+    OUT PRTL_BITMAP BitMapHeader,
+    IN  PULONGLONG  BitMapBuffer,
+    IN  ULONG_PTR   SizeOfBitMap
+    )
+
+/*++
+
+Routine Description:
+
+    Initializes a bitmap header. The buffer is not modified.
+
+Arguments:
+
+    BitMapHeader - Pointer to the bitmap header.
+
+    BitMapBuffer - Pointer to the bitmap's storage, which must hold at
+        least SizeOfBitMap bits rounded up to a whole ULONGLONG.
+
+    SizeOfBitMap - The number of bits in the bitmap.
+
+Return Value:
+
+    None.
+
+--*/
+
+{
+    BitMapHeader->SizeOfBitMap = SizeOfBitMap;
+    BitMapHeader->Buffer = BitMapBuffer;
+}
+
+VOID
+NTAPI
+RtlClearAllBits (
+    IN PRTL_BITMAP BitMapHeader
+    )
+
+/*++
+
+Routine Description:
+
+    Clears every bit in a bitmap.
+
+Arguments:
+
+    BitMapHeader - Pointer to the bitmap.
+
+Return Value:
+
+    None.
+
+--*/
+
+{
+    RtlZeroMemory(BitMapHeader->Buffer, RTL_BITMAP_BUFFER_SIZE(BitMapHeader->SizeOfBitMap));
+}
+
+VOID
+NTAPI
+RtlSetAllBits (
+    IN PRTL_BITMAP BitMapHeader
+    )
+
+/*++
+
+Routine Description:
+
+    Sets every bit in a bitmap.
+
+Arguments:
+
+    BitMapHeader - Pointer to the bitmap.
+
+Return Value:
+
+    None.
+
+--*/
+
+{
+    RtlFillMemory(BitMapHeader->Buffer, RTL_BITMAP_BUFFER_SIZE(BitMapHeader->SizeOfBitMap), 0xff);
+}
+
+VOID
+NTAPI
+RtlSetBits (
+    IN PRTL_BITMAP BitMapHeader,
+    IN ULONG_PTR   StartingIndex,
+    IN ULONG_PTR   NumberToSet
+    )
+
+/*++
+
+Routine Description:
+
+    Sets a run of bits in a bitmap.
+
+Arguments:
+
+    BitMapHeader - Pointer to the bitmap.
+
+    StartingIndex - The first bit to set.
+
+    NumberToSet - The number of bits to set.
+
+Return Value:
+
+    None.
+
+--*/
+
+{
+    ULONG_PTR Index, EndingIndex, Count;
+    ULONGLONG Mask;
+
+    Index = StartingIndex;
+    EndingIndex = StartingIndex + NumberToSet;
+    while (Index < EndingIndex) {
+        Count = BITS_PER_WORD - Index % BITS_PER_WORD;
+        if (Count > EndingIndex - Index) {
+            Count = EndingIndex - Index;
+        }
+
+        Mask = Count == BITS_PER_WORD ? ~0ULL : ((1ULL << Count) - 1) << (Index % BITS_PER_WORD);
+        BitMapHeader->Buffer[Index / BITS_PER_WORD] |= Mask;
+        Index += Count;
+    }
+}
+
+VOID
+NTAPI
+RtlClearBits (
+    IN PRTL_BITMAP BitMapHeader,
+    IN ULONG_PTR   StartingIndex,
+    IN ULONG_PTR   NumberToClear
+    )
+
+/*++
+
+Routine Description:
+
+    Clears a run of bits in a bitmap.
+
+Arguments:
+
+    BitMapHeader - Pointer to the bitmap.
+
+    StartingIndex - The first bit to clear.
+
+    NumberToClear - The number of bits to clear.
+
+Return Value:
+
+    None.
+
+--*/
+
+{
+    ULONG_PTR Index, EndingIndex, Count;
+    ULONGLONG Mask;
+
+    Index = StartingIndex;
+    EndingIndex = StartingIndex + NumberToClear;
+    while (Index < EndingIndex) {
+        Count = BITS_PER_WORD - Index % BITS_PER_WORD;
+        if (Count > EndingIndex - Index) {
+            Count = EndingIndex - Index;
+        }
+
+        Mask = Count == BITS_PER_WORD ? ~0ULL : ((1ULL << Count) - 1) << (Index % BITS_PER_WORD);
+        BitMapHeader->Buffer[Index / BITS_PER_WORD] &= ~Mask;
+        Index += Count;
+    }
+}
+
+BOOLEAN
+NTAPI
+RtlAreBitsClear (
+    IN PRTL_BITMAP BitMapHeader,
+    IN ULONG_PTR   StartingIndex,
+    IN ULONG_PTR   Length
+    )
+
+/*++
+
+Routine Description:
+
+    Checks if a run of bits in a bitmap is clear.
+
+Arguments:
+
+    BitMapHeader - Pointer to the bitmap.
+
+    StartingIndex - The first bit to check.
+
+    Length - The number of bits to check.
+
+Return Value:
+
+    TRUE if every bit in the run is clear.
+
+    FALSE otherwise.
+
+--*/
+
+{
+    return RtlpFindNextBit(BitMapHeader, StartingIndex, StartingIndex + Length, TRUE) == StartingIndex + Length;
+}
+
+ULONG_PTR
+NTAPI
+RtlFindClearBitsInRange (
+    IN PRTL_BITMAP BitMapHeader,
+    IN ULONG_PTR   NumberToFind,
+    IN ULONG_PTR   StartingIndex,
+    IN ULONG_PTR   EndingIndex,
+    IN ULONG_PTR   Alignment,
+    IN ULONG_PTR   AlignmentOffset
+    )
+
+/*++
+
+Routine Description:
+
+    Finds the lowest aligned run of clear bits within a range of a bitmap.
+
+    Set bits are skipped a word at a time, so long runs of allocated or
+    free bits cost one step per 64 bits.
+
+Arguments:
+
+    BitMapHeader - Pointer to the bitmap.
+
+    NumberToFind - The number of clear bits needed.
+
+    StartingIndex - The first bit that may be used.
+
+    EndingIndex - The bit after the last bit that may be used.
+
+    Alignment - The alignment of the first bit of the run. Must be a
+        power of two, or 0 for no alignment.
+
+    AlignmentOffset - Added to a bit index before checking its alignment.
+        Lets a bitmap that starts at an unaligned position be searched
+        for runs aligned in the space it describes.
+
+Return Value:
+
+    The index of the first bit of the run if found.
+
+    RTL_BITMAP_NOT_FOUND if no run was found.
+
+--*/
+
+{
+    ULONG_PTR Index, SetIndex;
+
+    if (EndingIndex > BitMapHeader->SizeOfBitMap) {
+        EndingIndex = BitMapHeader->SizeOfBitMap;
+    }
+
+    if (Alignment == 0) {
+        Alignment = 1;
+    }
+
+    AlignmentOffset &= Alignment - 1;
+
+    if (NumberToFind == 0) {
+        return RTL_BITMAP_NOT_FOUND;
+    }
+
+    Index = StartingIndex;
+    while (TRUE) {
+        //
+        // Move to the next aligned clear bit.
+        //
+        Index = RtlpFindNextBit(BitMapHeader, Index, EndingIndex, FALSE);
+        Index = ((Index + AlignmentOffset + Alignment - 1) & ~(Alignment - 1)) - AlignmentOffset;
+        if (Index >= EndingIndex || NumberToFind > EndingIndex - Index) {
+            return RTL_BITMAP_NOT_FOUND;
+        }
+
+        //
+        // Check the run, and skip past the first set bit in it if any.
+        //
+        SetIndex = RtlpFindNextBit(BitMapHeader, Index, Index + NumberToFind, TRUE);
+        if (SetIndex == Index + NumberToFind) {
+            return Index;
+        }
+
+        Index = SetIndex + 1;
+    }
+}
@@ -0,0 +1,576 @@
+/*++
+
+Copyright (c) 2025, Quinn Stephens, w1redch4d
+All rights reserved.
+Provided under the BSD 3-Clause license.
+
+Module Name:
+
+    crttest.c
+
+Abstract:
+
+    Host-side correctness test for the processor-specific CRT routines.
+
+    Every SSE2, AVX2, ERMS and FSRM variant is compared against the
+    generic variant of the same routine over random lengths, alignments
+    and contents. Buffers are placed between inaccessible guard pages so
+    that a kernel reading past the end of a page-terminated string or
+    buffer faults instead of passing by accident.
+
+--*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "crtp.h"
+
+#define TEST_ITERATIONS 20000
+#define TEST_MAX_LENGTH 600
+
+typedef int (*memcmp_fn)(const void *, const void *, size_t);
+typedef void *(*memchr_fn)(const void *, int, size_t);
+typedef int (*wmemcmp_fn)(const wchar_t *, const wchar_t *, size_t);
+typedef wchar_t *(*wmemchr_fn)(const wchar_t *, wchar_t, size_t);
+typedef size_t (*wcslen_fn)(const wchar_t *);
+typedef size_t (*wcsnlen_fn)(const wchar_t *, size_t);
+typedef int (*wcscmp_fn)(const wchar_t *, const wchar_t *);
+typedef wchar_t *(*wcschr_fn)(const wchar_t *, wchar_t);
+typedef void *(*memcpy_fn)(void *, const void *, size_t);
+typedef void *(*memset_fn)(void *, int, size_t);
+
+typedef struct {
+    const char *name;
+    void *fn;
+    int avx2;
+} variant_t;
+
+static size_t page_size;
+static int have_avx2;
+static unsigned long failures;
+static unsigned long long rng_state = 0x9e3779b97f4a7c15ULL;
+
+//
+// Two pages of data between two guard pages. page_end() is the first byte
+// of the trailing guard page.
+//
+static unsigned char *guarded[2];
+
+static unsigned int
+rng (
+    void
+    )
+
+{
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return (unsigned int)(rng_state >> 32);
+}
+
+static int
+sign (
+    int value
+    )
+
+{
+    return (value > 0) - (value < 0);
+}
+
+static unsigned char *
+page_end (
+    int which
+    )
+
+{
+    return guarded[which] + 3 * page_size;
+}
+
+static unsigned char *
+alloc_guarded (
+    void
+    )
+
+{
+    unsigned char *base;
+
+    base = mmap(NULL, 4 * page_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED) {
+        perror("mmap");
+        exit(2);
+    }
+
+    if (mprotect(base, page_size, PROT_NONE) != 0 || mprotect(base + 3 * page_size, page_size, PROT_NONE) != 0) {
+        perror("mprotect");
+        exit(2);
+    }
+
+    return base;
+}
+
+static void
+fail (
+    const char *routine,
+    const char *variant,
+    size_t length,
+    uintptr_t address
+    )
+
+{
+    if (failures++ < 20) {
+        printf("FAIL %s (%s): length %zu, address offset %#zx\n", routine, variant, length, (size_t)(address & (page_size - 1)));
+    }
+}
+
+//
+// Picks where a buffer of length bytes starts. Roughly a third of buffers
+// end exactly at the guard page, a third start at a random misalignment
+// inside the data pages, and the rest start right after the leading guard.
+//
+static unsigned char *
+place (
+    int which,
+    size_t length,
+    size_t align
+    )
+
+{
+    switch (rng() % 3) {
+    case 0:
+        return page_end(which) - length;
+
+    case 1:
+        return guarded[which] + page_size + (rng() % page_size) + (rng() % 64);
+
+    default:
+        return guarded[which] + page_size + (align ? rng() % align : 0);
+    }
+}
+
+static size_t
+random_length (
+    void
+    )
+
+{
+    switch (rng() % 4) {
+    case 0:
+        return rng() % 17;
+
+    case 1:
+        return rng() % 80;
+
+    default:
+        return rng() % TEST_MAX_LENGTH;
+    }
+}
+
+static void
+fill (
+    unsigned char *p,
+    size_t n,
+    unsigned int alphabet
+    )
+
+{
+    for (size_t i = 0; i < n; i++) {
+        p[i] = (unsigned char)(rng() % alphabet);
+    }
+}
+
+static void
+fill_wide (
+    wchar_t *p,
+    size_t n,
+    unsigned int alphabet
+    )
+
+{
+    //
+    // Keep both bytes interesting so that byte-wise and element-wise
+    // comparisons disagree on a bad kernel.
+    //
+    for (size_t i = 0; i < n; i++) {
+        p[i] = (wchar_t)(1 + rng() % alphabet) * 0x0101;
+    }
+}
+
+static void
+test_memcmp_memchr (
+    const variant_t *cmp,
+    size_t ncmp,
+    const variant_t *chr,
+    size_t nchr
+    )
+
+{
+    unsigned char *a, *b;
+    size_t n, k;
+    int expect, c;
+    void *found;
+
+    for (unsigned int it = 0; it < TEST_ITERATIONS; it++) {
+        n = random_length();
+        a = place(0, n, 64);
+        b = place(1, n, 64);
+        fill(a, n, 256);
+        memmove(b, a, n);
+        if (n != 0 && rng() % 4 != 0) {
+            k = rng() % n;
+            b[k] = (unsigned char)(b[k] + 1 + rng() % 255);
+        }
+
+        expect = sign(__memcmp_generic(a, b, n));
+        for (size_t v = 0; v < ncmp; v++) {
+            if (sign(((memcmp_fn)cmp[v].fn)(a, b, n)) != expect) {
+                fail("memcmp", cmp[v].name, n, (uintptr_t)a);
+            }
+        }
+
+        c = n != 0 && rng() % 2 ? a[rng() % n] : (int)rng();
+        found = __memchr_generic(a, c, n);
+        for (size_t v = 0; v < nchr; v++) {
+            if (((memchr_fn)chr[v].fn)(a, c, n) != found) {
+                fail("memchr", chr[v].name, n, (uintptr_t)a);
+            }
+        }
+    }
+}
+
+static void
+test_wmemcmp_wmemchr (
+    const variant_t *cmp,
+    size_t ncmp,
+    const variant_t *chr,
+    size_t nchr
+    )
+
+{
+    wchar_t *a, *b, c;
+    size_t n, k;
+    int expect;
+    wchar_t *found;
+
+    for (unsigned int it = 0; it < TEST_ITERATIONS; it++) {
+        n = random_length() / 2;
+        a = (wchar_t *)((uintptr_t)place(0, n * sizeof(wchar_t), 64) & ~(uintptr_t)1);
+        b = (wchar_t *)((uintptr_t)place(1, n * sizeof(wchar_t), 64) & ~(uintptr_t)1);
+        fill_wide(a, n, 200);
+        memmove(b, a, n * sizeof(wchar_t));
+        if (n != 0 && rng() % 4 != 0) {
+            k = rng() % n;
+            b[k] = (wchar_t)(b[k] + (rng() % 2 ? 1 : 0x100));
+        }
+
+        expect = sign(__wmemcmp_generic(a, b, n));
+        for (size_t v = 0; v < ncmp; v++) {
+            if (sign(((wmemcmp_fn)cmp[v].fn)(a, b, n)) != expect) {
+                fail("wmemcmp", cmp[v].name, n, (uintptr_t)a);
+            }
+        }
+
+        c = n != 0 && rng() % 2 ? a[rng() % n] : (wchar_t)rng();
+        found = __wmemchr_generic(a, c, n);
+        for (size_t v = 0; v < nchr; v++) {
+            if (((wmemchr_fn)chr[v].fn)(a, c, n) != found) {
+                fail("wmemchr", chr[v].name, n, (uintptr_t)a);
+            }
+        }
+    }
+}
+
+//
+// Builds a string of n characters. Strings that do not end at the guard
+// page have copies of the search character after the terminator, in the
+// same vector, which a kernel must not report.
+//
+static wchar_t *
+place_string (
+    int which,
+    size_t n,
+    wchar_t after
+    )
+
+{
+    unsigned char *p;
+    wchar_t *s;
+    size_t room;
+
+    p = place(which, (n + 1) * sizeof(wchar_t), 64);
+    if (rng() % 4 == 0) {
+        p = (unsigned char *)((uintptr_t)p | 1);
+        if ((size_t)(page_end(which) - p) < (n + 1) * sizeof(wchar_t)) {
+            p -= 2;
+        }
+    } else {
+        p = (unsigned char *)((uintptr_t)p & ~(uintptr_t)1);
+    }
+
+    s = (wchar_t *)p;
+    room = (size_t)(page_end(which) - p) / sizeof(wchar_t);
+    fill_wide(s, n, 40);
+    s[n] = 0;
+    for (size_t i = n + 1; i < room && i < n + 17; i++) {
+        s[i] = after;
+    }
+
+    return s;
+}
+
+static void
+test_wcs (
+    const variant_t *len,
+    size_t nlen,
+    const variant_t *nlen_v,
+    size_t nnlen,
+    const variant_t *cmp,
+    size_t ncmp,
+    const variant_t *chr,
+    size_t nchr,
+    const variant_t *rchr,
+    size_t nrchr
+    )
+
+{
+    wchar_t *s, *t, c;
+    size_t n, m, k, maxlen;
+    int expect;
+    wchar_t *found;
+
+    for (unsigned int it = 0; it < TEST_ITERATIONS; it++) {
+        n = random_length() / 2;
+        c = (wchar_t)(1 + rng() % 40) * 0x0101;
+        if (rng() % 8 == 0) {
+            c = 0;
+        }
+
+        s = place_string(0, n, c != 0 ? c : 0x4141);
+        for (size_t v = 0; v < nlen; v++) {
+            if (((wcslen_fn)len[v].fn)(s) != n) {
+                fail("wcslen", len[v].name, n, (uintptr_t)s);
+            }
+        }
+
+        maxlen = rng() % (n + 20);
+        for (size_t v = 0; v < nnlen; v++) {
+            if (((wcsnlen_fn)nlen_v[v].fn)(s, maxlen) != __wcsnlen_generic(s, maxlen)) {
+                fail("wcsnlen", nlen_v[v].name, n, (uintptr_t)s);
+            }
+        }
+
+        found = __wcschr_generic(s, c);
+        for (size_t v = 0; v < nchr; v++) {
+            if (((wcschr_fn)chr[v].fn)(s, c) != found) {
+                fail("wcschr", chr[v].name, n, (uintptr_t)s);
+            }
+        }
+
+        found = __wcsrchr_generic(s, c);
+        for (size_t v = 0; v < nrchr; v++) {
+            if (((wcschr_fn)rchr[v].fn)(s, c) != found) {
+                fail("wcsrchr", rchr[v].name, n, (uintptr_t)s);
+            }
+        }
+
+        //
+        // Compare against a copy, optionally changed or cut short.
+        //
+        m = n;
+        if (rng() % 3 == 0) {
+            m = rng() % (n + 1);
+        }
+
+        t = place_string(1, m, 0x4141);
+        memmove(t, s, m * sizeof(wchar_t));
+        if (m != 0 && rng() % 3 == 0) {
+            k = rng() % m;
+            t[k] = (wchar_t)(t[k] + (rng() % 2 ? 1 : 0x100));
+        }
+
+        expect = sign(__wcscmp_generic(s, t));
+        for (size_t v = 0; v < ncmp; v++) {
+            if (sign(((wcscmp_fn)cmp[v].fn)(s, t)) != expect) {
+                fail("wcscmp", cmp[v].name, n, (uintptr_t)s);
+            }
+        }
+    }
+}
+
+static void
+test_copy (
+    const variant_t *cpy,
+    size_t ncpy,
+    const variant_t *mov,
+    size_t nmov,
+    const variant_t *set,
+    size_t nset
+    )
+
+{
+    static unsigned char original[3 * TEST_MAX_LENGTH], expect[3 * TEST_MAX_LENGTH];
+    unsigned char *area, *d, *s;
+    size_t n, src, dst;
+    int c;
+
+    //
+    // Overlapping moves happen inside one area that ends at the guard page.
+    //
+    area = page_end(0) - sizeof(expect);
+    for (unsigned int it = 0; it < TEST_ITERATIONS; it++) {
+        n = random_length();
+        src = rng() % (2 * TEST_MAX_LENGTH);
+        dst = rng() % 2 ? src + rng() % 64 - 32 : rng() % (2 * TEST_MAX_LENGTH);
+        if (dst > 2 * TEST_MAX_LENGTH) {
+            dst = src;
+        }
+
+        fill(original, sizeof(original), 256);
+        memcpy(expect, original, sizeof(original));
+        __memmove_generic(expect + dst, expect + src, n);
+        for (size_t v = 0; v < nmov; v++) {
+            memcpy(area, original, sizeof(original));
+            ((memcpy_fn)mov[v].fn)(area + dst, area + src, n);
+            if (memcmp(area, expect, sizeof(expect)) != 0) {
+                fail("memmove", mov[v].name, n, (uintptr_t)(area + dst));
+            }
+        }
+
+        //
+        // memcpy only has to handle disjoint buffers, so copy between the
+        // two guarded regions.
+        //
+        d = place(1, n, 64);
+        s = place(0, n, 64);
+        memcpy(s, original, n);
+        for (size_t v = 0; v < ncpy; v++) {
+            memset(d, 0xcc, n);
+            ((memcpy_fn)cpy[v].fn)(d, s, n);
+            if (memcmp(d, original, n) != 0) {
+                fail("memcpy", cpy[v].name, n, (uintptr_t)d);
+            }
+        }
+
+        c = (int)rng();
+        __memset_generic(expect, c, n);
+        for (size_t v = 0; v < nset; v++) {
+            memset(d, ~c, n);
+            ((memset_fn)set[v].fn)(d, c, n);
+            if (memcmp(d, expect, n) != 0) {
+                fail("memset", set[v].name, n, (uintptr_t)d);
+            }
+        }
+    }
+}
+
+//
+// The selection has to follow the reported features in both directions.
+//
+static void
+test_dispatch (
+    void
+    )
+
+{
+    const crt_routine_variant_t *variants;
+    size_t count;
+
+    _crt_select_routines(CRT_CPU_FEATURE_ERMS | CRT_CPU_FEATURE_FSRM | CRT_CPU_FEATURE_AVX2);
+    if (__crt_dispatch.memcmp != __memcmp_avx2 || __crt_dispatch.memcpy != __memcpy_fsrm
+        || __crt_dispatch.memset != __memset_erms || __crt_dispatch.wmemchr != __wmemchr_avx2) {
+        fail("_crt_select_routines", "all", 0, 0);
+    }
+
+    _crt_select_routines(CRT_CPU_FEATURE_ERMS);
+    if (__crt_dispatch.memcmp != __memcmp_sse2 || __crt_dispatch.memcpy != __memcpy_erms
+        || __crt_dispatch.memmove != __memmove_erms || __crt_dispatch.wmemchr != __wmemchr_sse2) {
+        fail("_crt_select_routines", "erms", 0, 0);
+    }
+
+    _crt_select_routines(0);
+    if (__crt_dispatch.memset != __memset_generic || __crt_dispatch.memcpy != __memcpy_generic
+        || __crt_dispatch.memchr != __memchr_sse2 || __crt_dispatch.wcsrchr != __wcsrchr_sse2) {
+        fail("_crt_select_routines", "baseline", 0, 0);
+    }
+
+    variants = _crt_get_routine_variants(&count);
+    for (size_t i = 0; i < count; i++) {
+        if (variants[i].variant[0] == L'a' || variants[i].variant[0] == L'e' || variants[i].variant[0] == L'f') {
+            fail("_crt_get_routine_variants", "baseline", i, 0);
+        }
+    }
+}
+
+//
+// AVX2 variants are listed last in each table so they can be left out on
+// processors without AVX2.
+//
+static size_t
+usable_variants (
+    const variant_t *v,
+    size_t n
+    )
+
+{
+    while (n != 0 && v[n - 1].avx2 && !have_avx2) {
+        n--;
+    }
+
+    return n;
+}
+
+#define VARIANTS(table) table, usable_variants(table, sizeof(table) / sizeof(table[0]))
+
+int
+main (
+    void
+    )
+
+{
+    static const variant_t memcmp_variants[] = { { "sse2", __memcmp_sse2, 0 }, { "avx2", __memcmp_avx2, 1 } };
+    static const variant_t memchr_variants[] = { { "sse2", __memchr_sse2, 0 }, { "avx2", __memchr_avx2, 1 } };
+    static const variant_t wmemcmp_variants[] = { { "sse2", __wmemcmp_sse2, 0 }, { "avx2", __wmemcmp_avx2, 1 } };
+    static const variant_t wmemchr_variants[] = { { "sse2", __wmemchr_sse2, 0 }, { "avx2", __wmemchr_avx2, 1 } };
+    static const variant_t wcslen_variants[] = { { "sse2", __wcslen_sse2, 0 } };
+    static const variant_t wcsnlen_variants[] = { { "sse2", __wcsnlen_sse2, 0 } };
+    static const variant_t wcscmp_variants[] = { { "sse2", __wcscmp_sse2, 0 } };
+    static const variant_t wcschr_variants[] = { { "sse2", __wcschr_sse2, 0 } };
+    static const variant_t wcsrchr_variants[] = { { "sse2", __wcsrchr_sse2, 0 } };
+    static const variant_t memcpy_variants[] = { { "erms", __memcpy_erms, 0 }, { "fsrm", __memcpy_fsrm, 0 } };
+    static const variant_t memmove_variants[] = { { "erms", __memmove_erms, 0 }, { "fsrm", __memmove_fsrm, 0 } };
+    static const variant_t memset_variants[] = { { "erms", __memset_erms, 0 } };
+
+    page_size = (size_t)sysconf(_SC_PAGESIZE);
+    have_avx2 = __builtin_cpu_supports("avx2");
+    guarded[0] = alloc_guarded();
+    guarded[1] = alloc_guarded();
+    if (!have_avx2) {
+        printf("AVX2 not supported, skipping AVX2 variants\n");
+    }
+
+    test_memcmp_memchr(VARIANTS(memcmp_variants), VARIANTS(memchr_variants));
+    test_wmemcmp_wmemchr(VARIANTS(wmemcmp_variants), VARIANTS(wmemchr_variants));
+    test_wcs(
+        VARIANTS(wcslen_variants),
+        VARIANTS(wcsnlen_variants),
+        VARIANTS(wcscmp_variants),
+        VARIANTS(wcschr_variants),
+        VARIANTS(wcsrchr_variants)
+    );
+    test_copy(
+        VARIANTS(memcpy_variants),
+        VARIANTS(memmove_variants),
+        VARIANTS(memset_variants)
+    );
+    test_dispatch();
+
+    if (failures != 0) {
+        printf("%lu failures\n", failures);
+        return 1;
+    }
+
+    printf("all variants match\n");
+    return 0;
+}
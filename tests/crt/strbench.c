@@ -0,0 +1,246 @@
+/*++
+
+Copyright (c) 2025, Quinn Stephens, w1redch4d
+All rights reserved.
+Provided under the BSD 3-Clause license.
+
+Module Name:
+
+    strbench.c
+
+Abstract:
+
+    Host-side benchmark for strstr and wcsstr.
+
+    Boot options are passed around as long command-line strings that are
+    searched one option at a time. Each case times the CRT routine against
+    a naive quadratic search on such strings, and on a repetitive haystack
+    that is the worst case for the naive search. The results of both are
+    compared, so a wrong match fails the run.
+
+--*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define BENCH_OPTION_COUNT 256
+#define BENCH_REPEAT_LENGTH 65536
+#define BENCH_MIN_NANOSECONDS 200000000ULL
+
+char *crt_strstr(const char *haystack, const char *needle);
+wchar_t *crt_wcsstr(const wchar_t *haystack, const wchar_t *needle);
+
+typedef char *(*strstr_fn)(const char *, const char *);
+typedef wchar_t *(*wcsstr_fn)(const wchar_t *, const wchar_t *);
+
+static const char *option_names[] = {
+    "/NOEXECUTE=OPTIN", "/DEBUGPORT=COM1", "/BAUDRATE=115200", "/HAL=HALACPI.DLL",
+    "/KERNEL=NTKRNLMP.EXE", "/BOOTLOG", "/SOS", "/MAXMEM=4096", "/NUMPROC=8",
+    "/TRUNCATEMEMORY=0x100000000", "/AVOIDLOWMEMORY=0x1000000", "/REDIRECT",
+};
+
+static int failures;
+
+static char *
+naive_strstr (
+    const char *haystack,
+    const char *needle
+    )
+
+{
+    size_t i;
+
+    for (; *haystack != '\0'; haystack++) {
+        for (i = 0; needle[i] != '\0' && haystack[i] == needle[i]; i++);
+        if (needle[i] == '\0') {
+            return (char *)haystack;
+        }
+    }
+
+    return *needle == '\0' ? (char *)haystack : NULL;
+}
+
+static wchar_t *
+naive_wcsstr (
+    const wchar_t *haystack,
+    const wchar_t *needle
+    )
+
+{
+    size_t i;
+
+    for (; *haystack != L'\0'; haystack++) {
+        for (i = 0; needle[i] != L'\0' && haystack[i] == needle[i]; i++);
+        if (needle[i] == L'\0') {
+            return (wchar_t *)haystack;
+        }
+    }
+
+    return *needle == L'\0' ? (wchar_t *)haystack : NULL;
+}
+
+static unsigned long long
+now (
+    void
+    )
+
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + (unsigned long long)ts.tv_nsec;
+}
+
+//
+// Runs a search until enough time has passed and returns nanoseconds per
+// call. The volatile sink keeps the calls from being optimized out.
+//
+static volatile const void *sink;
+
+static double
+time_strstr (
+    strstr_fn fn,
+    const char *haystack,
+    const char *needle
+    )
+
+{
+    unsigned long long start, elapsed, calls;
+
+    calls = 0;
+    start = now();
+    do {
+        for (int i = 0; i < 16; i++) {
+            sink = fn(haystack, needle);
+        }
+
+        calls += 16;
+        elapsed = now() - start;
+    } while (elapsed < BENCH_MIN_NANOSECONDS);
+
+    return (double)elapsed / (double)calls;
+}
+
+static double
+time_wcsstr (
+    wcsstr_fn fn,
+    const wchar_t *haystack,
+    const wchar_t *needle
+    )
+
+{
+    unsigned long long start, elapsed, calls;
+
+    calls = 0;
+    start = now();
+    do {
+        for (int i = 0; i < 16; i++) {
+            sink = fn(haystack, needle);
+        }
+
+        calls += 16;
+        elapsed = now() - start;
+    } while (elapsed < BENCH_MIN_NANOSECONDS);
+
+    return (double)elapsed / (double)calls;
+}
+
+static void
+widen (
+    wchar_t *dest,
+    const char *src
+    )
+
+{
+    while ((*dest++ = (wchar_t)(unsigned char)*src++) != L'\0');
+}
+
+static void
+bench (
+    const char *name,
+    const char *haystack,
+    const char *needle
+    )
+
+{
+    wchar_t *whaystack, *wneedle;
+    double crt, naive, wcrt, wnaive;
+
+    whaystack = malloc((strlen(haystack) + 1) * sizeof(wchar_t));
+    wneedle = malloc((strlen(needle) + 1) * sizeof(wchar_t));
+    if (whaystack == NULL || wneedle == NULL) {
+        perror("malloc");
+        exit(2);
+    }
+
+    widen(whaystack, haystack);
+    widen(wneedle, needle);
+    if (crt_strstr(haystack, needle) != naive_strstr(haystack, needle)
+        || crt_wcsstr(whaystack, wneedle) != naive_wcsstr(whaystack, wneedle)) {
+        printf("FAIL %s: result differs from the naive search\n", name);
+        failures++;
+    }
+
+    crt = time_strstr(crt_strstr, haystack, needle);
+    naive = time_strstr(naive_strstr, haystack, needle);
+    wcrt = time_wcsstr(crt_wcsstr, whaystack, wneedle);
+    wnaive = time_wcsstr(naive_wcsstr, whaystack, wneedle);
+    printf("%-28s strstr %10.0f ns (naive %10.0f)   wcsstr %10.0f ns (naive %10.0f)\n", name, crt, naive, wcrt, wnaive);
+
+    free(whaystack);
+    free(wneedle);
+}
+
+int
+main (
+    void
+    )
+
+{
+    char *options, *repeat, *needle;
+    size_t length, count;
+
+    //
+    // A long option string, with the searched-for option at the very end.
+    //
+    options = malloc(BENCH_OPTION_COUNT * 32 + 64);
+    if (options == NULL) {
+        perror("malloc");
+        return 2;
+    }
+
+    length = 0;
+    count = sizeof(option_names) / sizeof(option_names[0]);
+    for (size_t i = 0; i < BENCH_OPTION_COUNT; i++) {
+        length += (size_t)sprintf(options + length, "%s ", option_names[i % count]);
+    }
+
+    strcpy(options + length, "/HYPERVISORLAUNCHTYPE=AUTO");
+    bench("options, last", options, "/HYPERVISORLAUNCHTYPE=AUTO");
+    bench("options, absent", options, "/HYPERVISORDEBUG");
+    bench("options, near miss", options, "/NOEXECUTE=OPTOUT");
+
+    //
+    // A repetitive haystack with a needle that almost matches everywhere.
+    //
+    repeat = malloc(BENCH_REPEAT_LENGTH + 1);
+    needle = malloc(257);
+    if (repeat == NULL || needle == NULL) {
+        perror("malloc");
+        return 2;
+    }
+
+    memset(repeat, 'a', BENCH_REPEAT_LENGTH);
+    repeat[BENCH_REPEAT_LENGTH] = '\0';
+    memset(needle, 'a', 255);
+    needle[255] = 'b';
+    needle[256] = '\0';
+    bench("repetitive, absent", repeat, needle);
+
+    free(options);
+    free(repeat);
+    free(needle);
+    return failures != 0;
+}